@@ -0,0 +1,51 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <parser.hpp>
+#include <vm.hpp>
+
+#include <fmt/core.h>
+
+using namespace std;
+using namespace monkey;
+
+// Runs examples/fib.monkey on the VM and as the native executable that
+// `add_monkey_executable` built from it, and reports the best time of each.
+// Both print the script's output. The native time includes starting the
+// process.
+
+const int Runs = 3;
+
+template <typename T> double best_time(T fn) {
+  auto best = numeric_limits<double>::max();
+  for (int run = 0; run < Runs; run++) {
+    auto start = chrono::steady_clock::now();
+    fn();
+    auto end = chrono::steady_clock::now();
+    best = min(best, chrono::duration<double, milli>(end - start).count());
+  }
+  return best;
+}
+
+int main() {
+  ifstream ifs(MONKEY_SCRIPT);
+  string source((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+
+  vector<string> msgs;
+  auto ast = parse(MONKEY_SCRIPT, source.data(), source.size(), msgs);
+  for (const auto &msg : msgs) {
+    fmt::print("{}\n", msg);
+  }
+  if (!ast) { return -1; }
+
+  Compiler compiler(CompilerOptions::level(2));
+  compiler.compile(ast);
+  auto bytecode = compiler.bytecode();
+
+  auto vm = best_time([&]() { VM(bytecode).run(); });
+  auto native = best_time([]() { return std::system(MONKEY_NATIVE); });
+
+  fmt::print("{:<10} {:>10}\n", "engine", "ms");
+  fmt::print("{:<10} {:>10.1f}\n", "vm -O2", vm);
+  fmt::print("{:<10} {:>10.1f}\n", "native", native);
+}
@@ -0,0 +1,81 @@
+#include <batch.hpp>
+#include <chrono>
+#include <parser.hpp>
+
+#include <fmt/core.h>
+
+using namespace std;
+using namespace monkey;
+
+// Calls a small function over a million rows of integers, once per row with
+// `VM::call` and in batches with `BatchVM`, and reports the best time of
+// each.
+
+const int Runs = 3;
+const size_t Rows = 1000000;
+
+const char *Source = R"(
+let scale = 3;
+fn(price, quantity) {
+  let total = price * quantity;
+  if (total > 1000) { total - total / 10 } else { total + scale }
+}
+)";
+
+template <typename T> double best_time(T fn) {
+  auto best = numeric_limits<double>::max();
+  for (int run = 0; run < Runs; run++) {
+    auto start = chrono::steady_clock::now();
+    fn();
+    auto end = chrono::steady_clock::now();
+    best = min(best, chrono::duration<double, milli>(end - start).count());
+  }
+  return best;
+}
+
+int main() {
+  string source = Source;
+  vector<string> msgs;
+  auto ast = parse("bench-batch", source.data(), source.size(), msgs);
+  for (const auto &msg : msgs) {
+    fmt::print("{}\n", msg);
+  }
+  if (!ast) { return -1; }
+
+  Compiler compiler(CompilerOptions::level(2));
+  compiler.compile(ast);
+  VM vm(compiler.bytecode());
+  vm.run();
+  auto fn = Value::object(vm.last_popped_stack_elem());
+
+  vector<vector<Value>> rows;
+  for (size_t i = 0; i < Rows; i++) {
+    rows.push_back({Value::integer(i % 97), Value::integer(i % 31)});
+  }
+
+  int64_t perRowSum = 0;
+  auto perRow = best_time([&]() {
+    perRowSum = 0;
+    for (const auto &row : rows) {
+      perRowSum += vm.call(fn, row).as_integer();
+    }
+  });
+
+  int64_t batchSum = 0;
+  BatchVM batchVM(vm);
+  auto batch = best_time([&]() {
+    batchSum = 0;
+    for (const auto &result : batchVM.call(fn, rows)) {
+      batchSum += result.as_integer();
+    }
+  });
+
+  if (perRowSum != batchSum) {
+    fmt::print("results differ: {} {}\n", perRowSum, batchSum);
+    return -1;
+  }
+
+  fmt::print("{:<10} {:>10}\n", "calls", "ms");
+  fmt::print("{:<10} {:>10.1f}\n", "per row", perRow);
+  fmt::print("{:<10} {:>10.1f}\n", "batched", batch);
+}
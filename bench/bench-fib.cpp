@@ -0,0 +1,106 @@
+#define MONKEY_COUNT_DISPATCH
+#include <chrono>
+#include <parser.hpp>
+#include <reg_vm.hpp>
+#include <vm.hpp>
+
+#include <fmt/core.h>
+
+using namespace std;
+using namespace monkey;
+
+// Runs the `fibonacci` function from examples/fib.monkey on each engine and
+// with different compiler options, and reports how many instructions are
+// dispatched per Monkey call. Dispatches are counted, so timings include that
+// overhead.
+
+const int N = 25;
+const int Runs = 5;
+
+const char *Source = R"(
+  let fibonacci = fn(x) {
+    if (x == 0) {
+      0
+    } else {
+      if (x == 1) {
+        return 1;
+      } else {
+        fibonacci(x - 1) + fibonacci(x - 2);
+      }
+    }
+  };
+  fibonacci(N);
+)";
+
+int64_t count_calls(int n) {
+  if (n < 2) { return 1; }
+  return 1 + count_calls(n - 1) + count_calls(n - 2);
+}
+
+shared_ptr<Ast> parse_source() {
+  // The AST refers to the source text, so it has to outlive it.
+  static auto source = [] {
+    auto s = string(Source);
+    s.replace(s.find("N)"), 1, to_string(N));
+    return s;
+  }();
+
+  vector<string> msgs;
+  auto ast = parse("bench-fib", source.data(), source.size(), msgs);
+  for (const auto &msg : msgs) {
+    fmt::print("{}\n", msg);
+  }
+  return ast;
+}
+
+// `make_vm` returns a fresh VM ready to run the program.
+template <typename T> void bench(const char *name, T make_vm) {
+  size_t dispatches = 0;
+  auto best = numeric_limits<double>::max();
+  for (int run = 0; run < Runs; run++) {
+    auto vm = make_vm();
+    auto start = chrono::steady_clock::now();
+    vm.run();
+    auto end = chrono::steady_clock::now();
+    dispatches = vm.dispatchCount;
+    best = min(best, chrono::duration<double, milli>(end - start).count());
+  }
+
+  auto calls = count_calls(N);
+  fmt::print("{:<20} {:>12} {:>14.2f} {:>10.1f}\n", name, dispatches,
+             static_cast<double>(dispatches) / calls, best);
+}
+
+void bench_vm(const char *name, const CompilerOptions &options) {
+  auto ast = parse_source();
+  if (!ast) { return; }
+
+  Compiler compiler(options);
+  compiler.compile(ast);
+  auto bytecode = compiler.bytecode();
+  bench(name, [&]() { return VM(bytecode); });
+}
+
+void bench_reg_vm(const char *name) {
+  auto ast = parse_source();
+  if (!ast) { return; }
+
+  RegCompiler compiler;
+  compiler.compile(ast);
+  auto bytecode = compiler.bytecode();
+  bench(name, [&]() { return RegVM(bytecode); });
+}
+
+int main() {
+  fmt::print("fibonacci({}): {} calls\n", N, count_calls(N));
+  fmt::print("{:<20} {:>12} {:>14} {:>10}\n", "engine", "dispatches",
+             "per call", "ms");
+
+  bench_vm("vm", CompilerOptions());
+
+  CompilerOptions superinstructions;
+  superinstructions.superinstructions = true;
+  bench_vm("vm superinstructions", superinstructions);
+
+  bench_reg_vm("regvm");
+}
@@ -0,0 +1,162 @@
+#include <chrono>
+#include <vm.hpp>
+
+#include <fmt/core.h>
+
+using namespace std;
+using namespace monkey;
+
+// Per-opcode dispatch microbenchmark. Each case is a short instruction
+// sequence that leaves the stack balanced; it is repeated `Repeat` times in
+// straight-line code inside a function, and the reported figure is the time
+// per executed instruction. The function is called once before measuring so
+// one-time work such as decoding is not counted.
+
+const int Repeat = 10000;
+const int Runs = 50;
+
+struct BenchCase {
+  string name;
+  vector<shared_ptr<Object>> constants;
+  // Instructions run once before the measured sequence.
+  vector<Instructions> setup;
+  // Builds one copy of the measured sequence starting at byte offset `pos`.
+  function<vector<Instructions>(size_t pos)> body;
+  // Number of instructions in one copy of the sequence.
+  size_t count;
+};
+
+Instructions concat(const vector<Instructions> &instructions) {
+  Instructions out;
+  for (const auto &ins : instructions) {
+    out.insert(out.end(), ins.begin(), ins.end());
+  }
+  return out;
+}
+
+Bytecode build(const BenchCase &c) {
+  Instructions out;
+  for (const auto &ins : c.setup) {
+    out.insert(out.end(), ins.begin(), ins.end());
+  }
+  for (int i = 0; i < Repeat; i++) {
+    for (const auto &ins : c.body(out.size())) {
+      out.insert(out.end(), ins.begin(), ins.end());
+    }
+  }
+  auto ret = make(OpReturn, {});
+  out.insert(out.end(), ret.begin(), ret.end());
+
+  Bytecode bytecode;
+  bytecode.constants = c.constants;
+  auto fnIndex = static_cast<int>(bytecode.constants.size());
+  bytecode.constants.push_back(make_compiled_function({out}, 1));
+  bytecode.instructions = concat({
+      make(OpClosure, {fnIndex, 0}),
+      make(OpCall, {0}),
+      make(OpPop, {}),
+  });
+  return bytecode;
+}
+
+double run_case(const BenchCase &c) {
+  auto bytecode = build(c);
+  VM(bytecode).run();
+
+  auto best = numeric_limits<double>::max();
+  for (int i = 0; i < Runs; i++) {
+    VM vm(bytecode);
+    auto start = chrono::steady_clock::now();
+    vm.run();
+    auto end = chrono::steady_clock::now();
+    best = min(best, chrono::duration<double, nano>(end - start).count());
+  }
+  return best / (Repeat * c.count);
+}
+
+vector<BenchCase> bench_cases() {
+  auto integers = vector<shared_ptr<Object>>{make_integer(7), make_integer(3)};
+
+  auto function = [](vector<Instructions> body, int numParameters = 0) {
+    return make_compiled_function(body, numParameters, numParameters);
+  };
+
+  auto fixed = [](vector<Instructions> body) {
+    return [=](size_t) { return body; };
+  };
+
+  return {
+      {"OpConstant", integers, {},
+       fixed({make(OpConstant, {0}), make(OpPop, {})}), 2},
+      {"OpTrue", {}, {}, fixed({make(OpTrue, {}), make(OpPop, {})}), 2},
+      {"OpNull", {}, {}, fixed({make(OpNull, {}), make(OpPop, {})}), 2},
+      {"OpAdd", integers, {},
+       fixed({make(OpConstant, {0}), make(OpConstant, {1}), make(OpAdd, {}),
+              make(OpPop, {})}),
+       4},
+      {"OpMul", integers, {},
+       fixed({make(OpConstant, {0}), make(OpConstant, {1}), make(OpMul, {}),
+              make(OpPop, {})}),
+       4},
+      {"OpGreaterThan", integers, {},
+       fixed({make(OpConstant, {0}), make(OpConstant, {1}),
+              make(OpGreaterThan, {}), make(OpPop, {})}),
+       4},
+      {"OpEqual", integers, {},
+       fixed({make(OpConstant, {0}), make(OpConstant, {1}), make(OpEqual, {}),
+              make(OpPop, {})}),
+       4},
+      {"OpMinus", integers, {},
+       fixed({make(OpConstant, {0}), make(OpMinus, {}), make(OpPop, {})}), 3},
+      {"OpBang", {}, {},
+       fixed({make(OpTrue, {}), make(OpBang, {}), make(OpPop, {})}), 3},
+      {"OpJump", {}, {},
+       [](size_t pos) {
+         return vector<Instructions>{make(OpJump, {static_cast<int>(pos + 3)})};
+       },
+       1},
+      {"OpJumpNotTruthy", {}, {},
+       [](size_t pos) {
+         return vector<Instructions>{
+             make(OpTrue, {}),
+             make(OpJumpNotTruthy, {static_cast<int>(pos + 4)}),
+         };
+       },
+       2},
+      {"OpSetGlobal/OpGetGlobal", integers, {},
+       fixed({make(OpConstant, {0}), make(OpSetGlobal, {0}),
+              make(OpGetGlobal, {0}), make(OpPop, {})}),
+       4},
+      {"OpArray", integers, {},
+       fixed({make(OpConstant, {0}), make(OpArray, {1}), make(OpPop, {})}), 3},
+      {"OpIndex", integers, {},
+       fixed({make(OpConstant, {0}), make(OpArray, {1}), make(OpConstant, {1}),
+              make(OpIndex, {}), make(OpPop, {})}),
+       5},
+      {"OpGetBuiltin", {}, {},
+       fixed({make(OpGetBuiltin, {0}), make(OpPop, {})}), 2},
+      {"OpSetLocal/OpGetLocal", integers, {},
+       fixed({make(OpConstant, {0}), make(OpSetLocal, {0}),
+              make(OpGetLocal, {0}), make(OpPop, {})}),
+       4},
+      {"OpCall/OpReturn",
+       {function({make(OpReturn, {})})},
+       {make(OpClosure, {0, 0}), make(OpSetGlobal, {0})},
+       fixed({make(OpGetGlobal, {0}), make(OpCall, {0}), make(OpPop, {})}), 4},
+      {"OpCall/OpReturnValue",
+       {function({make(OpGetLocal, {0}), make(OpReturnValue, {})}, 1),
+        make_integer(1)},
+       {make(OpClosure, {0, 0}), make(OpSetGlobal, {0})},
+       fixed({make(OpGetGlobal, {0}), make(OpConstant, {1}), make(OpCall, {1}),
+              make(OpPop, {})}),
+       6},
+  };
+}
+
+int main(int argc, const char **argv) {
+  fmt::print("{:<24} {:>10}\n", "case", "ns/op");
+  for (const auto &c : bench_cases()) {
+    fmt::print("{:<24} {:>10.2f}\n", c.name, run_case(c));
+  }
+  return 0;
+}
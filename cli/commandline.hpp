@@ -1,13 +1,25 @@
 #pragma once
 
-#include <vector>
+#include <cstdlib>
 #include <string>
+#include <utility>
+#include <vector>
 
 struct Options {
   bool print_ast = false;
+  bool dump_ir = false;
+  bool emit_cpp = false;
+  std::string cpp_path; // --emit-cpp=<path>, standard output if empty
   bool shell = false;
   bool debug = false;
   bool vm = false;
+  bool regvm = false;
+  size_t stack_size = 0; // VM value stack limit in slots, 0 for the default
+  size_t max_frames = 0; // VM call depth limit, 0 for the default
+  bool quickening = true;
+  bool jit = false;
+  int opt_level = 0; // -O0 to -O2, see CompilerOptions::level
+  std::vector<std::pair<std::string, bool>> passes; // --enable/--disable
   std::vector<std::string> script_path_list;
 };
 
@@ -21,10 +33,40 @@ inline Options parse_command_line(int argc, const char **argv) {
       options.shell = true;
     } else if (arg == "--ast") {
       options.print_ast = true;
+    } else if (arg == "--dump-ir") {
+      options.dump_ir = true;
+    } else if (arg == "--emit-cpp") {
+      options.emit_cpp = true;
+    } else if (arg.rfind("--emit-cpp=", 0) == 0) {
+      options.emit_cpp = true;
+      options.cpp_path = arg.substr(11);
     } else if (arg == "--debug") {
       options.debug = true;
-    } else if (arg == "--vm") {
+    } else if (arg == "--vm" || arg == "--engine=vm") {
       options.vm = true;
+      options.regvm = false;
+    } else if (arg == "--engine=regvm") {
+      options.vm = false;
+      options.regvm = true;
+    } else if (arg == "--engine=eval") {
+      options.vm = false;
+      options.regvm = false;
+    } else if (arg.rfind("--stack-size=", 0) == 0) {
+      options.stack_size = std::strtoull(arg.c_str() + 13, nullptr, 10);
+    } else if (arg.rfind("--max-frames=", 0) == 0) {
+      options.max_frames = std::strtoull(arg.c_str() + 13, nullptr, 10);
+    } else if (arg == "--no-quickening") {
+      options.quickening = false;
+    } else if (arg == "--jit") {
+      options.jit = true;
+    } else if (arg == "--no-jit") {
+      options.jit = false;
+    } else if (arg == "-O0" || arg == "-O1" || arg == "-O2") {
+      options.opt_level = arg[2] - '0';
+    } else if (arg.rfind("--enable=", 0) == 0) {
+      options.passes.emplace_back(arg.substr(9), true);
+    } else if (arg.rfind("--disable=", 0) == 0) {
+      options.passes.emplace_back(arg.substr(10), false);
     } else {
       options.script_path_list.push_back(arg);
     }
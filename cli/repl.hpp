@@ -3,9 +3,11 @@
 #include <evaluator.hpp>
 #include <parser.hpp>
 
+#include <reg_vm.hpp>
 #include <vm.hpp>
 
 #include "linenoise.hpp"
+#include "run.hpp"
 
 namespace monkey {
 
@@ -15,7 +17,8 @@ inline int repl(std::shared_ptr<monkey::Environment> env,
   using namespace std;
 
   std::vector<std::shared_ptr<Object>> constants;
-  std::vector<std::shared_ptr<Object>> globals(VM::GlobalSize);
+  std::vector<Value> globals(VM::GlobalSize);
+  RegFunctions regFunctions;
   std::shared_ptr<SymbolTable> symbolTable = symbol_table();
 
   {
@@ -39,10 +42,29 @@ inline int repl(std::shared_ptr<monkey::Environment> env,
 
         try {
           if (options.vm) {
-            Compiler compiler(symbolTable, constants);
+            auto compilerOptions = compiler_options(options);
+            Bytecode bytecode;
+            if (compilerOptions.ssa) {
+              IRCompiler compiler(symbolTable, constants, compilerOptions);
+              bytecode = compile_bytecode(compiler, ast, options);
+              constants = compiler.constants;
+            } else {
+              Compiler compiler(symbolTable, constants, compilerOptions);
+              bytecode = compile_bytecode(compiler, ast, options);
+              constants = compiler.constants;
+            }
+            VM vm(bytecode, globals, vm_options(options));
+            vm.run();
+            globals = vm.globals;
+            auto last_poped = vm.last_popped_stack_elem();
+            cout << last_poped->inspect() << endl;
+            linenoise::AddHistory(line.c_str());
+          } else if (options.regvm) {
+            RegCompiler compiler(symbolTable, constants, regFunctions);
             compiler.compile(ast);
             constants = compiler.constants;
-            VM vm(compiler.bytecode(), globals);
+            regFunctions = compiler.functions;
+            RegVM vm(compiler.bytecode(), globals, vm_options(options));
             vm.run();
             globals = vm.globals;
             auto last_poped = vm.last_popped_stack_elem();
@@ -2,7 +2,11 @@
 
 #include <evaluator.hpp>
 #include <fstream>
+#include <ir_compiler.hpp>
 #include <parser.hpp>
+#include <reg_vm.hpp>
+#include <transpiler.hpp>
+#include <vm.hpp>
 
 inline bool read_file(const char *path, std::vector<char> &buff) {
   using namespace std;
@@ -20,6 +24,81 @@ inline bool read_file(const char *path, std::vector<char> &buff) {
   return true;
 }
 
+inline monkey::CompilerOptions compiler_options(const Options &options) {
+  auto compilerOptions = monkey::CompilerOptions::level(options.opt_level);
+  for (const auto &[name, enabled] : options.passes) {
+    auto pass = monkey::Compiler::find_pass(name);
+    if (!pass) { throw std::runtime_error("unknown pass '" + name + "'."); }
+    compilerOptions.*pass->enabled = enabled;
+  }
+  compilerOptions.timePasses = options.debug;
+  if (options.dump_ir) {
+    compilerOptions.ssa = true;
+    compilerOptions.dumpIR = true;
+  }
+  return compilerOptions;
+}
+
+template <typename T> inline void print_pass_times(const T &compiler) {
+  const auto &passes = monkey::Compiler::passes();
+  for (size_t i = 0; i < passes.size(); i++) {
+    if (!(compiler.options.*passes[i].enabled)) { continue; }
+    auto us = std::chrono::duration<double, std::micro>(compiler.passTimes[i]);
+    std::cerr << "pass " << passes[i].name << ": " << us.count() << " us"
+              << std::endl;
+  }
+}
+
+// Compiles with `compiler`, which is either a `Compiler` or an `IRCompiler`.
+template <typename T>
+inline monkey::Bytecode compile_bytecode(T &compiler,
+                                         const std::shared_ptr<monkey::Ast> &ast,
+                                         const Options &options) {
+  compiler.compile(ast);
+  auto bytecode = compiler.bytecode();
+  if constexpr (std::is_same_v<T, monkey::IRCompiler>) {
+    if (options.dump_ir) { std::cout << compiler.irDump; }
+  }
+  if (options.debug) {
+    print_pass_times(compiler);
+    if constexpr (std::is_same_v<T, monkey::Compiler>) {
+      if (compiler.options.inlining) {
+        std::cerr << "inlined calls: " << compiler.inlinedCalls << std::endl;
+      }
+    }
+  }
+  return bytecode;
+}
+
+inline monkey::VMOptions vm_options(const Options &options) {
+  monkey::VMOptions vmOptions;
+  if (options.stack_size) { vmOptions.maxStackSize = options.stack_size; }
+  if (options.max_frames) { vmOptions.maxFrames = options.max_frames; }
+  vmOptions.quickening = options.quickening;
+  vmOptions.jit = options.jit;
+  return vmOptions;
+}
+
+// Writes the C++ translation unit of the program in `ast` to the file given
+// with `--emit-cpp=`, or to standard output.
+inline bool emit_cpp(const std::shared_ptr<monkey::Ast> &ast,
+                     const Options &options) {
+  monkey::Transpiler transpiler;
+  transpiler.transpile(ast);
+  auto source = transpiler.translation_unit();
+  if (options.cpp_path.empty()) {
+    std::cout << source;
+    return true;
+  }
+  std::ofstream ofs(options.cpp_path, std::ios::out | std::ios::binary);
+  ofs << source;
+  if (ofs.fail()) {
+    std::cerr << "can't write '" << options.cpp_path << "'." << std::endl;
+    return false;
+  }
+  return true;
+}
+
 inline bool run(std::shared_ptr<monkey::Environment> env,
                 const Options &options) {
   using namespace monkey;
@@ -38,7 +117,39 @@ inline bool run(std::shared_ptr<monkey::Environment> env,
     if (ast) {
       if (options.print_ast) { cout << peg::ast_to_s(ast); }
 
-      auto val = eval(ast, env);
+      if (options.emit_cpp) {
+        if (!emit_cpp(ast, options)) { return false; }
+        continue;
+      }
+
+      std::shared_ptr<Object> val;
+      if (options.vm) {
+        auto compilerOptions = compiler_options(options);
+        Bytecode bytecode;
+        if (compilerOptions.ssa) {
+          IRCompiler compiler(compilerOptions);
+          bytecode = compile_bytecode(compiler, ast, options);
+        } else {
+          Compiler compiler(compilerOptions);
+          bytecode = compile_bytecode(compiler, ast, options);
+        }
+        VM vm(bytecode, vm_options(options));
+        vm.run();
+        val = vm.last_popped_stack_elem();
+        if (options.debug) {
+          cerr << "call cache: " << vm.callCacheHits << " hits, "
+               << vm.callCacheMisses << " misses" << endl;
+        }
+      } else if (options.regvm) {
+        RegCompiler compiler;
+        compiler.compile(ast);
+        RegVM vm(compiler.bytecode(), vm_options(options));
+        vm.run();
+        val = vm.last_popped_stack_elem();
+      } else {
+        val = eval(ast, env);
+      }
+
       if (val->type() != ERROR_OBJ) {
         continue;
       } else {
@@ -0,0 +1,32 @@
+# add_monkey_executable(<target> <script>)
+#
+# Builds a Monkey script into a native executable: `monkey --emit-cpp`
+# translates it to C++, which is compiled with the engine headers.
+
+set(MONKEY_ENGINE_DIR ${CMAKE_CURRENT_LIST_DIR}/../engine)
+
+function(add_monkey_executable target script)
+  get_filename_component(script ${script} ABSOLUTE)
+  set(source ${CMAKE_CURRENT_BINARY_DIR}/${target}.cpp)
+
+  add_custom_command(
+    OUTPUT ${source}
+    COMMAND monkey --emit-cpp=${source} ${script}
+    DEPENDS monkey ${script}
+    COMMENT "Translating ${script} to C++"
+    VERBATIM
+  )
+
+  add_executable(${target}
+    ${source}
+  )
+
+  target_include_directories(${target} PRIVATE
+    ${peglib_SOURCE_DIR}
+    ${MONKEY_ENGINE_DIR}
+  )
+
+  target_link_libraries(${target} PRIVATE
+    fmt::fmt
+  )
+endfunction()
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <vm.hpp>
+
+namespace monkey {
+
+// A function of a program that `Transpiler` compiled to C++. `fn` is called
+// with the function value itself, for its free variables and recursive
+// calls, and with exactly `numParameters` arguments, which it may move from.
+struct NativeFunction : public Object {
+  using Entry = Value (*)(const Value &self, Value *args);
+
+  NativeFunction(Entry fn, int numParameters, std::vector<Value> free)
+      : fn(fn), numParameters(numParameters), free(std::move(free)) {}
+
+  ObjectType type() const override { return NATIVE_FUNCTION_OBJ; }
+  std::string name() const override { return "NATIVE_FUNCTION"; }
+
+  std::string inspect() const override {
+    std::stringstream ss;
+    ss << "NativeFunction[" << std::hex << this << std::dec << "]";
+    return ss.str();
+  }
+
+  const Entry fn;
+  const int numParameters;
+  const std::vector<Value> free;
+};
+
+// The operations generated code is made of. Integer operands are handled
+// inline; everything else goes to the VM's operations, so programs behave
+// and fail the same way as on the VM.
+namespace aot {
+
+inline Value string(std::string_view s) {
+  return Value::object(make_string(s), STRING_OBJ);
+}
+
+inline const Value &builtin(int i) {
+  static const auto values = [] {
+    std::vector<Value> values;
+    for (const auto &[_, fn] : BUILTINS) {
+      values.push_back(Value::object(fn, BUILTIN_OBJ));
+    }
+    return values;
+  }();
+  return values[i];
+}
+
+inline Value closure(NativeFunction::Entry fn, int numParameters,
+                     std::vector<Value> free) {
+  return Value::object(
+      std::make_shared<NativeFunction>(fn, numParameters, std::move(free)),
+      NATIVE_FUNCTION_OBJ);
+}
+
+inline const std::vector<Value> &free(const Value &self) {
+  return cast<NativeFunction>(self).free;
+}
+
+inline Value call(const Value &callee, Value *args, int numArgs) {
+  if (callee.type() == NATIVE_FUNCTION_OBJ) {
+    const auto &fn = cast<NativeFunction>(callee);
+    if (numArgs != fn.numParameters) {
+      throw make_error(fmt::format("wrong number of arguments: want={}, got={}",
+                                   fn.numParameters, numArgs));
+    }
+    return fn.fn(callee, args);
+  } else if (callee.type() == BUILTIN_OBJ) {
+    return VM::call_builtin(cast<Builtin>(callee), args, numArgs);
+  }
+  throw make_error("calling non-function and non-built-in");
+}
+
+inline Value array(std::initializer_list<Value> elements) {
+  return Value::object(VM::build_array(elements.begin(), elements.end()),
+                       ARRAY_OBJ);
+}
+
+inline Value hash(std::initializer_list<Value> keysAndValues) {
+  return Value::object(
+      VM::build_hash(keysAndValues.begin(), keysAndValues.end()), HASH_OBJ);
+}
+
+inline Value add(const Value &left, const Value &right) {
+  if (left.is_integer() && right.is_integer()) {
+    return Value::integer(
+        VM::wrapping_add(left.as_integer(), right.as_integer()));
+  }
+  return VM::binary_operation(OpAdd, left, right);
+}
+
+inline Value sub(const Value &left, const Value &right) {
+  if (left.is_integer() && right.is_integer()) {
+    return Value::integer(
+        VM::wrapping_sub(left.as_integer(), right.as_integer()));
+  }
+  return VM::binary_operation(OpSub, left, right);
+}
+
+inline Value mul(const Value &left, const Value &right) {
+  if (left.is_integer() && right.is_integer()) {
+    return Value::integer(
+        VM::wrapping_mul(left.as_integer(), right.as_integer()));
+  }
+  return VM::binary_operation(OpMul, left, right);
+}
+
+inline Value div(const Value &left, const Value &right) {
+  return VM::binary_operation(OpDiv, left, right);
+}
+
+inline bool greater_than(const Value &left, const Value &right) {
+  if (left.is_integer() && right.is_integer()) {
+    return left.as_integer() > right.as_integer();
+  }
+  return VM::compare(OpGreaterThan, left, right);
+}
+
+inline bool equal(const Value &left, const Value &right) {
+  if (left.is_integer() && right.is_integer()) {
+    return left.as_integer() == right.as_integer();
+  }
+  return VM::compare(OpEqual, left, right);
+}
+
+inline bool not_equal(const Value &left, const Value &right) {
+  if (left.is_integer() && right.is_integer()) {
+    return left.as_integer() != right.as_integer();
+  }
+  return VM::compare(OpNotEqual, left, right);
+}
+
+inline Value minus(const Value &operand) {
+  if (operand.is_integer()) {
+    return Value::integer(VM::wrapping_neg(operand.as_integer()));
+  }
+  return VM::minus_operator(operand);
+}
+
+inline bool bang(const Value &operand) { return !VM::is_truthy(operand); }
+
+inline Value index(const Value &left, const Value &index) {
+  return VM::index_expression(left, index);
+}
+
+// Runs the main program of a generated executable, reporting an error the
+// way the `monkey` command does.
+inline int run(void (*program)()) {
+  try {
+    program();
+    return 0;
+  } catch (const std::shared_ptr<Object> &err) {
+    std::cerr << cast<Error>(err).message << std::endl;
+  } catch (std::exception &e) { std::cerr << e.what() << std::endl; }
+  return -1;
+}
+
+} // namespace aot
+
+} // namespace monkey
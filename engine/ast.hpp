@@ -21,7 +21,7 @@ inline void annotate(std::shared_ptr<Ast> &ast) {
     assert(ast->nodes.empty());
     switch (ast->tag) {
     case "BOOLEAN"_: ast->value = (ast->token == "true"); break;
-    case "INTEGER"_: ast->value = ast->token_to_number<long long>(); break;
+    case "INTEGER"_: ast->value = ast->token_to_number<int64_t>(); break;
     case "STRING"_: ast->value = ast->token; break;
     }
   } else {
@@ -0,0 +1,423 @@
+#pragma once
+
+#include <map>
+#include <vm.hpp>
+
+namespace monkey {
+
+// One value for each lane of a batch, all of the same scalar type. Booleans
+// are stored as 0 and 1, and nulls as 0.
+struct Column {
+  ObjectType type = NULL_OBJ;
+  std::vector<int64_t> values;
+
+  Column() = default;
+  Column(ObjectType type, size_t lanes) : type(type), values(lanes) {}
+
+  static Column broadcast(const Value &value, size_t lanes) {
+    Column column(value.type(), lanes);
+    std::fill(column.values.begin(), column.values.end(), value.as_integer());
+    return column;
+  }
+
+  Value at(size_t lane) const {
+    switch (type) {
+    case INTEGER_OBJ: return Value::integer(values[lane]);
+    case BOOLEAN_OBJ: return Value::boolean(values[lane] != 0);
+    default: return Value::null();
+    }
+  }
+};
+
+// Runs a closure over many rows of arguments at once. Each instruction is
+// interpreted once for a batch of rows, as a loop over columns of integers
+// and booleans. Where a branch goes both ways, the batch splits and each
+// part carries on by itself.
+//
+// Rows that need anything else, such as a call, an object or an operation
+// that fails, are run one at a time with `VM::call` from the start. The
+// instructions run in columns have no effects, so the result is the same.
+struct BatchVM {
+  VM &vm;
+
+  // Rows are run in batches of at most this many, so the columns a batch
+  // works on stay in cache.
+  size_t batchSize = 1024;
+
+  // Rows that ran in columns and rows that were run one by one.
+  size_t batchedRows = 0;
+  size_t fallbackRows = 0;
+
+  // Instructions decoded without the VM's handlers, which the VM may not
+  // have set up yet.
+  std::map<std::shared_ptr<CompiledFunction>, DecodedInstructions> code;
+
+  explicit BatchVM(VM &vm) : vm(vm) {}
+
+  // Returns a result for each row, which is an error value if the call
+  // failed.
+  std::vector<Value> call(const Value &callee,
+                          const std::vector<std::vector<Value>> &rows) {
+    std::vector<Value> results(rows.size());
+
+    // Rows go into batches by the types of their arguments, so each column
+    // has a single type. Two bits per argument tell the scalar types apart.
+    std::map<uint64_t, std::vector<size_t>> batches;
+    std::vector<size_t> *current = nullptr;
+    uint64_t currentTypes = 0;
+    for (size_t row = 0; row < rows.size(); row++) {
+      if (!may_batch(callee, rows[row])) {
+        results[row] = run_row(callee, rows[row]);
+        continue;
+      }
+      uint64_t types = 0;
+      for (const auto &arg : rows[row]) {
+        types = types << 2 | arg.type();
+      }
+      if (!current || types != currentTypes) {
+        current = &batches[types];
+        currentTypes = types;
+      }
+      current->push_back(row);
+    }
+
+    for (const auto &[_, batch] : batches) {
+      for (size_t i = 0; i < batch.size(); i += batchSize) {
+        auto last = std::min(batch.size(), i + batchSize);
+        std::vector<size_t> lanes(batch.begin() + i, batch.begin() + last);
+        run_batch(callee, rows, lanes, results);
+      }
+    }
+    return results;
+  }
+
+  static bool may_batch(const Value &callee, const std::vector<Value> &args) {
+    if (callee.type() != CLOSURE_OBJ) { return false; }
+    const auto &fn = *cast<Closure>(callee).fn;
+    if (static_cast<int>(args.size()) != fn.numParameters ||
+        args.size() > 32) {
+      return false;
+    }
+    for (const auto &arg : args) {
+      if (arg.is_object()) { return false; }
+    }
+    return true;
+  }
+
+  Value run_row(const Value &callee, const std::vector<Value> &args) {
+    fallbackRows++;
+    return vm.call(callee, args);
+  }
+
+  void run_batch(const Value &callee,
+                 const std::vector<std::vector<Value>> &rows,
+                 const std::vector<size_t> &lanes,
+                 std::vector<Value> &results) {
+    const auto &cl = cast<Closure>(callee);
+    const auto &fn = *cl.fn;
+    auto &decoded = code[cl.fn];
+    if (decoded.empty()) { decoded = decode(fn.instructions); }
+
+    // The locals come first, then the operand stack.
+    std::vector<Column> stack(fn.numLocals);
+    for (int i = 0; i < fn.numParameters; i++) {
+      stack[i] = Column(rows[lanes[0]][i].type(), lanes.size());
+      auto values = stack[i].values.data();
+      for (size_t lane = 0; lane < lanes.size(); lane++) {
+        values[lane] = rows[lanes[lane]][i].as_integer();
+      }
+    }
+    for (int i = fn.numParameters; i < fn.numLocals; i++) {
+      stack[i] = Column(NULL_OBJ, lanes.size());
+    }
+
+    Call call{callee, cl, decoded, rows, results};
+    Batch batch{0, lanes, std::move(stack)};
+    run(call, batch);
+  }
+
+private:
+  struct Call {
+    const Value &callee;
+    const Closure &cl;
+    const DecodedInstructions &code;
+    const std::vector<std::vector<Value>> &rows;
+    std::vector<Value> &results;
+  };
+
+  // Rows that are at the same instruction, one lane each.
+  struct Batch {
+    size_t ip = 0;
+    std::vector<size_t> lanes;
+    std::vector<Column> stack;
+  };
+
+  void run(const Call &call, Batch &batch) {
+    const auto &code = call.code;
+    const auto &constants = vm.constants;
+    auto &stack = batch.stack;
+
+    auto lanes = batch.lanes.size();
+    auto pop = [&]() {
+      auto column = std::move(stack.back());
+      stack.pop_back();
+      return column;
+    };
+
+    for (;;) {
+      const auto &ins = code[batch.ip++];
+      switch (ins.op) {
+      case OpConstant: {
+        const auto &constant = constants[ins.operands[0]];
+        if (constant.is_object()) { return fall_back(call, batch); }
+        stack.push_back(Column::broadcast(constant, lanes));
+        break;
+      }
+      case OpTrue:
+      case OpFalse: {
+        auto value = Value::boolean(ins.op == OpTrue);
+        stack.push_back(Column::broadcast(value, lanes));
+        break;
+      }
+      case OpNull: stack.push_back(Column(NULL_OBJ, lanes)); break;
+      // A moved local is copied all the same: `split` needs every column to
+      // have a value for each lane.
+      case OpGetLocal:
+      case OpMoveLocal: stack.push_back(stack[ins.operands[0]]); break;
+      case OpSetLocal: stack[ins.operands[0]] = pop(); break;
+      case OpGetGlobal:
+      case OpGetFree: {
+        const auto &value = ins.op == OpGetGlobal
+                                ? vm.globals[ins.operands[0]]
+                                : call.cl.free[ins.operands[0]];
+        if (value.is_object()) { return fall_back(call, batch); }
+        stack.push_back(Column::broadcast(value, lanes));
+        break;
+      }
+      case OpPop: stack.pop_back(); break;
+      case OpAdd:
+      case OpSub:
+      case OpMul:
+      case OpDiv:
+      case OpEqual:
+      case OpNotEqual:
+      case OpGreaterThan:
+      case OpAddInt:
+      case OpSubInt:
+      case OpMulInt:
+      case OpEqualInt:
+      case OpNotEqualInt:
+      case OpGreaterThanInt:
+      case OpAddIntUnchecked:
+      case OpSubIntUnchecked:
+      case OpMulIntUnchecked:
+      case OpEqualIntUnchecked:
+      case OpNotEqualIntUnchecked:
+      case OpGreaterThanIntUnchecked: {
+        auto right = pop();
+        if (!binary_operation(generic_opecode(ins.op), stack.back(), right)) {
+          return fall_back(call, batch);
+        }
+        break;
+      }
+      case OpAddLocalConstant:
+      case OpSubLocalConstant: {
+        const auto &constant = constants[ins.operands[1]];
+        if (constant.is_object()) { return fall_back(call, batch); }
+        stack.push_back(stack[ins.operands[0]]);
+        auto op = ins.op == OpAddLocalConstant ? OpAdd : OpSub;
+        if (!binary_operation(op, stack.back(),
+                              Column::broadcast(constant, lanes))) {
+          return fall_back(call, batch);
+        }
+        break;
+      }
+      case OpAddLocals: {
+        stack.push_back(stack[ins.operands[0]]);
+        if (!binary_operation(OpAdd, stack.back(), stack[ins.operands[1]])) {
+          return fall_back(call, batch);
+        }
+        break;
+      }
+      case OpMinus: {
+        auto &operand = stack.back();
+        if (operand.type != INTEGER_OBJ) { return fall_back(call, batch); }
+        auto values = operand.values.data();
+        for (size_t i = 0; i < lanes; i++) {
+          values[i] =
+              static_cast<int64_t>(0 - static_cast<uint64_t>(values[i]));
+        }
+        break;
+      }
+      case OpBang: {
+        auto &operand = stack.back();
+        truthy(operand);
+        invert(operand);
+        operand.type = BOOLEAN_OBJ;
+        break;
+      }
+      case OpJump: batch.ip = ins.operands[0]; break;
+      case OpJumpNotTruthy:
+      case OpJumpTruthy: {
+        auto condition = pop();
+        truthy(condition);
+        if (ins.op == OpJumpNotTruthy) { invert(condition); }
+        branch(call, batch, condition, ins.operands[0]);
+        lanes = batch.lanes.size();
+        break;
+      }
+      case OpJumpNotEqualConstant:
+      case OpJumpNotGreaterThanConstant: {
+        const auto &constant = constants[ins.operands[1]];
+        if (constant.is_object()) { return fall_back(call, batch); }
+        auto op = ins.op == OpJumpNotEqualConstant ? OpEqual : OpGreaterThan;
+        auto condition = Column::broadcast(constant, lanes);
+        if (!binary_operation(op, stack.back(), condition)) {
+          return fall_back(call, batch);
+        }
+        condition = pop();
+        invert(condition);
+        branch(call, batch, condition, ins.operands[0]);
+        lanes = batch.lanes.size();
+        break;
+      }
+      case OpReturnValue:
+      case OpReturn: {
+        auto result = ins.op == OpReturnValue ? pop() : Column(NULL_OBJ, lanes);
+        for (size_t i = 0; i < lanes; i++) {
+          call.results[batch.lanes[i]] = result.at(i);
+        }
+        batchedRows += lanes;
+        return;
+      }
+      default: return fall_back(call, batch);
+      }
+    }
+  }
+
+  void fall_back(const Call &call, const Batch &batch) {
+    for (auto lane : batch.lanes) {
+      call.results[lane] = run_row(call.callee, call.rows[lane]);
+    }
+  }
+
+  // Replaces `left` with `left op right`, if that can be done in columns.
+  // Operations that would fail, or divide by zero, are left to the VM.
+  static bool binary_operation(Opecode op, Column &left, const Column &right) {
+    auto lanes = left.values.size();
+    auto l = left.values.data();
+    auto r = right.values.data();
+
+    if (left.type != right.type) { return false; }
+    if (left.type == BOOLEAN_OBJ && (op == OpEqual || op == OpNotEqual)) {
+      compare(op, l, r, lanes);
+      return true;
+    }
+    if (left.type != INTEGER_OBJ) { return false; }
+
+    switch (op) {
+    case OpAdd:
+      for (size_t i = 0; i < lanes; i++) {
+        l[i] = static_cast<int64_t>(static_cast<uint64_t>(l[i]) +
+                                    static_cast<uint64_t>(r[i]));
+      }
+      return true;
+    case OpSub:
+      for (size_t i = 0; i < lanes; i++) {
+        l[i] = static_cast<int64_t>(static_cast<uint64_t>(l[i]) -
+                                    static_cast<uint64_t>(r[i]));
+      }
+      return true;
+    case OpMul:
+      for (size_t i = 0; i < lanes; i++) {
+        l[i] = static_cast<int64_t>(static_cast<uint64_t>(l[i]) *
+                                    static_cast<uint64_t>(r[i]));
+      }
+      return true;
+    case OpDiv:
+      for (size_t i = 0; i < lanes; i++) {
+        if (r[i] == 0 || (r[i] == -1 && l[i] == INT64_MIN)) { return false; }
+      }
+      for (size_t i = 0; i < lanes; i++) {
+        l[i] /= r[i];
+      }
+      return true;
+    default:
+      compare(op, l, r, lanes);
+      left.type = BOOLEAN_OBJ;
+      return true;
+    }
+  }
+
+  static void compare(Opecode op, int64_t *l, const int64_t *r, size_t lanes) {
+    switch (op) {
+    case OpEqual:
+      for (size_t i = 0; i < lanes; i++) {
+        l[i] = l[i] == r[i];
+      }
+      break;
+    case OpNotEqual:
+      for (size_t i = 0; i < lanes; i++) {
+        l[i] = l[i] != r[i];
+      }
+      break;
+    default:
+      for (size_t i = 0; i < lanes; i++) {
+        l[i] = l[i] > r[i];
+      }
+      break;
+    }
+  }
+
+  // Turns `column` into 1 where its value is truthy and 0 where it isn't.
+  static void truthy(Column &column) {
+    if (column.type == BOOLEAN_OBJ) { return; }
+    std::fill(column.values.begin(), column.values.end(),
+              column.type == NULL_OBJ ? 0 : 1);
+  }
+
+  static void invert(Column &column) {
+    auto values = column.values.data();
+    for (size_t i = 0; i < column.values.size(); i++) {
+      values[i] = values[i] == 0;
+    }
+  }
+
+  // Jumps to `target` in the lanes where `jump` is set. If only some lanes
+  // jump, they run to the end as a batch of their own first; Monkey has no
+  // loops, so that always comes to an end.
+  void branch(const Call &call, Batch &batch, const Column &jump,
+              size_t target) {
+    std::vector<size_t> taken, notTaken;
+    for (size_t i = 0; i < jump.values.size(); i++) {
+      (jump.values[i] ? taken : notTaken).push_back(i);
+    }
+    if (notTaken.empty()) {
+      batch.ip = target;
+      return;
+    }
+    if (taken.empty()) { return; }
+
+    auto part = split(batch, taken);
+    part.ip = target;
+    run(call, part);
+    batch = split(batch, notTaken);
+  }
+
+  static Batch split(const Batch &batch, const std::vector<size_t> &indexes) {
+    Batch part{batch.ip, {}, {}};
+    for (auto i : indexes) {
+      part.lanes.push_back(batch.lanes[i]);
+    }
+    for (const auto &column : batch.stack) {
+      Column picked(column.type, indexes.size());
+      for (size_t i = 0; i < indexes.size(); i++) {
+        picked.values[i] = column.values[indexes[i]];
+      }
+      part.stack.push_back(std::move(picked));
+    }
+    return part;
+  }
+};
+
+} // namespace monkey
@@ -4,6 +4,7 @@
 #include <fmt/core.h>
 #include <map>
 #include <numeric>
+#include <tuple>
 #include <vector>
 
 namespace monkey {
@@ -43,6 +44,59 @@ enum OpecodeType {
   OpClosure,
   OpGetFree,
   OpCurrentClosure,
+  OpTailCall,
+  OpJumpTruthy,
+
+  // Superinstructions, selected by `Compiler` after emission. Each one does
+  // the work of the sequence in its comment. Jump targets come first.
+  OpAddLocalConstant,           // OpGetLocal OpConstant OpAdd
+  OpSubLocalConstant,           // OpGetLocal OpConstant OpSub
+  OpAddLocals,                  // OpGetLocal OpGetLocal OpAdd
+  OpJumpNotEqualConstant,       // OpConstant OpEqual OpJumpNotTruthy
+  OpJumpNotGreaterThanConstant, // OpConstant OpGreaterThan OpJumpNotTruthy
+
+  // Integer forms of the arithmetic and comparison opcodes, selected where
+  // type inference expects integer operands or where the VM has seen them.
+  // They fall back to the generic operation when an operand turns out not to
+  // be an integer.
+  OpAddInt,
+  OpSubInt,
+  OpMulInt,
+  OpEqualInt,
+  OpNotEqualInt,
+  OpGreaterThanInt,
+
+  // Integer forms that don't check their operands, selected only where type
+  // inference proves both of them to be integers.
+  OpAddIntUnchecked,
+  OpSubIntUnchecked,
+  OpMulIntUnchecked,
+  OpEqualIntUnchecked,
+  OpNotEqualIntUnchecked,
+  OpGreaterThanIntUnchecked,
+
+  // Call of a closure in the constant pool whose arity the compiler has
+  // checked, so the callee is neither inspected nor looked up: the constant
+  // index, then the number of arguments.
+  OpCallKnown,
+
+  // `OpGetLocal` at the last read of a local, selected by `Compiler` from
+  // the liveness of locals: the value is moved onto the stack and the slot
+  // is left null, so that nothing holds on to it.
+  OpMoveLocal,
+
+  // Forms of `OpIndex` for the operand types they are named after. Never
+  // emitted: the VM quickens `OpIndex` into them once it has seen the types.
+  OpIndexArrayInt,
+  OpIndexHashString,
+
+  // Appended by `decode` after the last instruction; never emitted.
+  OpHalt,
+
+  // Prefix that makes every operand of the next instruction 4 bytes wide.
+  // `make` adds it when an operand doesn't fit its width, and `decode` reads
+  // it as part of the instruction, so the VM never runs it.
+  OpWide,
 };
 
 struct Definition {
@@ -82,6 +136,31 @@ inline std::map<Opecode, Definition> &definitions() {
       {OpClosure, {"OpClosure", {2, 1}}},
       {OpGetFree, {"OpGetFree", {1}}},
       {OpCurrentClosure, {"CurrentClosure", {}}},
+      {OpTailCall, {"OpTailCall", {1}}},
+      {OpJumpTruthy, {"OpJumpTruthy", {2}}},
+      {OpAddLocalConstant, {"OpAddLocalConstant", {1, 2}}},
+      {OpSubLocalConstant, {"OpSubLocalConstant", {1, 2}}},
+      {OpAddLocals, {"OpAddLocals", {1, 1}}},
+      {OpJumpNotEqualConstant, {"OpJumpNotEqualConstant", {2, 2}}},
+      {OpJumpNotGreaterThanConstant, {"OpJumpNotGreaterThanConstant", {2, 2}}},
+      {OpAddInt, {"OpAddInt", {}}},
+      {OpSubInt, {"OpSubInt", {}}},
+      {OpMulInt, {"OpMulInt", {}}},
+      {OpEqualInt, {"OpEqualInt", {}}},
+      {OpNotEqualInt, {"OpNotEqualInt", {}}},
+      {OpGreaterThanInt, {"OpGreaterThanInt", {}}},
+      {OpAddIntUnchecked, {"OpAddIntUnchecked", {}}},
+      {OpSubIntUnchecked, {"OpSubIntUnchecked", {}}},
+      {OpMulIntUnchecked, {"OpMulIntUnchecked", {}}},
+      {OpEqualIntUnchecked, {"OpEqualIntUnchecked", {}}},
+      {OpNotEqualIntUnchecked, {"OpNotEqualIntUnchecked", {}}},
+      {OpGreaterThanIntUnchecked, {"OpGreaterThanIntUnchecked", {}}},
+      {OpCallKnown, {"OpCallKnown", {2, 1}}},
+      {OpMoveLocal, {"OpMoveLocal", {1}}},
+      {OpIndexArrayInt, {"OpIndexArrayInt", {}}},
+      {OpIndexHashString, {"OpIndexHashString", {}}},
+      {OpHalt, {"OpHalt", {}}},
+      {OpWide, {"OpWide", {}}},
   };
   return definitions_;
 }
@@ -115,11 +194,53 @@ inline uint8_t read_uint8(const uint8_t *p) {
   return *p;
 }
 
+inline void put_uint32(uint8_t *p, uint32_t n) {
+  for (auto i = 0; i < 4; i++) {
+    p[i] = static_cast<uint8_t>(n >> (24 - 8 * i));
+  }
+}
+
+inline uint32_t read_uint32(const uint8_t *p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+         (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+// Operand width of the instructions prefixed by `OpWide`.
+constexpr size_t WideOperandWidth = 4;
+
+inline bool fits(const std::vector<size_t> &widths,
+                 const std::vector<int> &operands) {
+  for (size_t i = 0; i < operands.size(); i++) {
+    if (operands[i] < 0 || operands[i] >= (1 << (8 * widths[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline size_t instruction_size(Opecode op, const std::vector<int> &operands) {
+  const auto &widths = lookup(op).operand_widths;
+  if (!fits(widths, operands)) {
+    return 2 + WideOperandWidth * widths.size();
+  }
+  return std::accumulate(widths.begin(), widths.end(), size_t(1));
+}
+
 inline std::vector<uint8_t> make(Opecode op, const std::vector<int> &operands) {
   auto it = definitions().find(op);
   if (it == definitions().end()) { return std::vector<uint8_t>(); }
   const auto &widths = it->second.operand_widths;
 
+  if (!fits(widths, operands)) {
+    auto instruction = std::vector<uint8_t>(2 + WideOperandWidth * widths.size());
+    instruction[0] = OpWide;
+    instruction[1] = op;
+    for (size_t i = 0; i < operands.size(); i++) {
+      put_uint32(&instruction[2 + WideOperandWidth * i], operands[i]);
+    }
+    return instruction;
+  }
+
   auto instruction_len = std::accumulate(widths.begin(), widths.end(), 1);
 
   auto instruction = std::vector<uint8_t>(instruction_len);
@@ -157,6 +278,23 @@ read_operands(const Definition &def, const Instructions &ins,
   return std::pair(operands, offset - start_offset);
 }
 
+// Reads the instruction at `offset`, with its `OpWide` prefix if it has one:
+// the opcode, the operands and the number of bytes read.
+inline std::tuple<Opecode, std::vector<int>, size_t>
+read_instruction(const Instructions &ins, size_t offset) {
+  if (ins[offset] != OpWide) {
+    auto op = ins[offset];
+    auto [operands, read] = read_operands(lookup(op), ins, offset + 1);
+    return {op, operands, 1 + read};
+  }
+  auto op = ins[offset + 1];
+  std::vector<int> operands(lookup(op).operand_widths.size());
+  for (size_t i = 0; i < operands.size(); i++) {
+    operands[i] = read_uint32(&ins[offset + 2 + WideOperandWidth * i]);
+  }
+  return {op, operands, 2 + WideOperandWidth * operands.size()};
+}
+
 inline std::string fmt_instruction(const Definition &def,
                                    const std::vector<int> &operands) {
   auto operand_count = def.operand_widths.size();
@@ -179,13 +317,228 @@ inline std::string to_string(const Instructions &ins, const char *ln = "\\n") {
 
   size_t i = 0;
   while (i < ins.size()) {
-    auto &def = lookup(ins[i]);
-    auto [operands, read] = read_operands(def, ins, i + 1);
-    out += fmt::format(R"({:04} {}{})", i, fmt_instruction(def, operands), ln);
-    i += 1 + read;
+    auto [op, operands, read] = read_instruction(ins, i);
+    out += fmt::format(R"({:04} {}{})", i,
+                       fmt_instruction(lookup(op), operands), ln);
+    i += read;
   }
 
   return out;
 }
 
+inline bool is_jump(Opecode op) {
+  switch (op) {
+  case OpJump:
+  case OpJumpNotTruthy:
+  case OpJumpTruthy:
+  case OpJumpNotEqualConstant:
+  case OpJumpNotGreaterThanConstant: return true;
+  default: return false;
+  }
+}
+
+// The integer form of a generic opcode, or `op` if it has none.
+inline Opecode integer_opecode(Opecode op) {
+  switch (op) {
+  case OpAdd: return OpAddInt;
+  case OpSub: return OpSubInt;
+  case OpMul: return OpMulInt;
+  case OpEqual: return OpEqualInt;
+  case OpNotEqual: return OpNotEqualInt;
+  case OpGreaterThan: return OpGreaterThanInt;
+  default: return op;
+  }
+}
+
+// The unchecked integer form of a generic opcode, or `op` if it has none.
+inline Opecode unchecked_integer_opecode(Opecode op) {
+  switch (op) {
+  case OpAdd: return OpAddIntUnchecked;
+  case OpSub: return OpSubIntUnchecked;
+  case OpMul: return OpMulIntUnchecked;
+  case OpEqual: return OpEqualIntUnchecked;
+  case OpNotEqual: return OpNotEqualIntUnchecked;
+  case OpGreaterThan: return OpGreaterThanIntUnchecked;
+  default: return op;
+  }
+}
+
+// The generic opcode of an integer form, checked or not, or `op` if it isn't
+// one.
+inline Opecode generic_opecode(Opecode op) {
+  switch (op) {
+  case OpAddInt:
+  case OpAddIntUnchecked: return OpAdd;
+  case OpSubInt:
+  case OpSubIntUnchecked: return OpSub;
+  case OpMulInt:
+  case OpMulIntUnchecked: return OpMul;
+  case OpEqualInt:
+  case OpEqualIntUnchecked: return OpEqual;
+  case OpNotEqualInt:
+  case OpNotEqualIntUnchecked: return OpNotEqual;
+  case OpGreaterThanInt:
+  case OpGreaterThanIntUnchecked: return OpGreaterThan;
+  default: return op;
+  }
+}
+
+// An instruction with its operands already read, as executed by the VM.
+// `handler` is the address of the VM's handler for `op` when the VM uses
+// threaded dispatch. Jump targets are indexes into the decoded stream.
+// `deoptimizations` counts how often the VM turned a quickened form back
+// into the generic one.
+struct DecodedInstruction {
+  const void *handler = nullptr;
+  Opecode op = OpHalt;
+  uint8_t deoptimizations = 0;
+  int operands[2] = {0, 0};
+};
+
+using DecodedInstructions = std::vector<DecodedInstruction>;
+
+// Jumps whose targets didn't fit their operand when they were patched keep
+// the targets in `farTargets`, by the position of the jump.
+inline DecodedInstructions
+decode(const Instructions &ins, const void *const *handlers = nullptr,
+       const std::map<size_t, int> *farTargets = nullptr) {
+  DecodedInstructions decoded;
+  std::vector<int> indexes(ins.size() + 1);
+
+  size_t i = 0;
+  while (i < ins.size()) {
+    auto [op, operands, read] = read_instruction(ins, i);
+
+    DecodedInstruction d;
+    d.op = op;
+    for (size_t j = 0; j < operands.size(); j++) {
+      d.operands[j] = operands[j];
+    }
+    if (farTargets) {
+      auto it = farTargets->find(i);
+      if (it != farTargets->end()) { d.operands[0] = it->second; }
+    }
+
+    indexes[i] = decoded.size();
+    decoded.push_back(d);
+    i += read;
+  }
+
+  indexes[i] = decoded.size();
+  decoded.push_back(DecodedInstruction{});
+
+  for (auto &d : decoded) {
+    if (is_jump(d.op)) { d.operands[0] = indexes[d.operands[0]]; }
+    if (handlers) { d.handler = handlers[d.op]; }
+  }
+
+  return decoded;
+}
+
+// Turns a decoded stream back into bytecode. Jump operands are indexes into
+// `decoded`; a trailing `OpHalt` sentinel is dropped. A jump may need the
+// wide form once the instructions before its target grow, so the offsets
+// are recomputed until none of them changes.
+inline Instructions encode(const DecodedInstructions &decoded) {
+  auto count = decoded.size();
+  if (count > 0 && decoded.back().op == OpHalt) { count--; }
+
+  std::vector<int> offsets(count + 1);
+  auto operands_at = [&](size_t i) {
+    const auto &d = decoded[i];
+    std::vector<int> operands(lookup(d.op).operand_widths.size());
+    for (size_t j = 0; j < operands.size(); j++) {
+      operands[j] = d.operands[j];
+    }
+    if (is_jump(d.op)) { operands[0] = offsets[operands[0]]; }
+    return operands;
+  };
+
+  for (auto changed = true; changed;) {
+    changed = false;
+    for (size_t i = 0; i < count; i++) {
+      auto next = offsets[i] + static_cast<int>(instruction_size(
+                                   decoded[i].op, operands_at(i)));
+      if (next != offsets[i + 1]) {
+        offsets[i + 1] = next;
+        changed = true;
+      }
+    }
+  }
+
+  Instructions ins;
+  ins.reserve(offsets[count]);
+  for (size_t i = 0; i < count; i++) {
+    auto bytes = make(decoded[i].op, operands_at(i));
+    ins.insert(ins.end(), bytes.begin(), bytes.end());
+  }
+  return ins;
+}
+
+// Bytecode with the far targets of `decode` written into their jumps,
+// which become wide.
+inline Instructions widen_jumps(const Instructions &ins,
+                                const std::map<size_t, int> &farTargets) {
+  return encode(decode(ins, nullptr, &farTargets));
+}
+
+inline std::vector<bool> jump_targets(const DecodedInstructions &decoded) {
+  std::vector<bool> targets(decoded.size());
+  for (const auto &d : decoded) {
+    if (is_jump(d.op)) { targets[d.operands[0]] = true; }
+  }
+  return targets;
+}
+
+// True if the instructions from `i` on start with `ops` and no jump lands
+// inside that sequence, so it can be replaced as a whole. The integer form
+// of an opcode matches the generic one.
+inline bool matches(const DecodedInstructions &decoded,
+                    const std::vector<bool> &targets, size_t i,
+                    std::initializer_list<Opecode> ops) {
+  if (i + ops.size() > decoded.size()) { return false; }
+  size_t j = i;
+  for (auto op : ops) {
+    if (generic_opecode(decoded[j].op) != op || (j > i && targets[j])) {
+      return false;
+    }
+    j++;
+  }
+  return true;
+}
+
+// Rewrites bytecode one instruction at a time. `rewrite_at(in, targets, i,
+// out)` either appends a replacement for the instructions starting at `in[i]`
+// to `out` and returns how many of them it replaced, or returns 0 to keep
+// `in[i]` as it is. Jump operands in `out` still refer to `in` and are fixed
+// up afterwards.
+template <typename T>
+inline Instructions rewrite(const Instructions &ins, T rewrite_at) {
+  auto in = decode(ins);
+  auto targets = jump_targets(in);
+
+  DecodedInstructions out;
+  std::vector<int> indexes(in.size());
+
+  size_t i = 0;
+  while (i + 1 < in.size()) {
+    auto index = static_cast<int>(out.size());
+    auto count = rewrite_at(in, targets, i, out);
+    if (count == 0) {
+      out.push_back(in[i]);
+      count = 1;
+    }
+    for (size_t j = i; j < i + count; j++) {
+      indexes[j] = index;
+    }
+    i += count;
+  }
+  indexes[i] = out.size();
+
+  for (auto &d : out) {
+    if (is_jump(d.op)) { d.operands[0] = indexes[d.operands[0]]; }
+  }
+  return encode(out);
+}
+
 } // namespace monkey
@@ -1,7 +1,12 @@
 #pragma once
 
+#include <chrono>
+#include <map>
 #include <object.hpp>
+#include <optional>
+#include <set>
 #include <symbol_table.hpp>
+#include <unordered_map>
 
 namespace monkey {
 
@@ -13,22 +18,186 @@ struct EmittedInstruction {
 struct Bytecode {
   Instructions instructions;
   std::vector<std::shared_ptr<Object>> constants;
+  int numLocals = 0;  // slots the main program keeps at the stack bottom
+  int numGlobals = 0; // globals defined so far, earlier REPL lines included
+};
+
+// Shares equal constants in a pool: integers and strings by value, and
+// compiled functions by their instructions. Constants that get into the
+// pool some other way, such as those of earlier REPL lines, are indexed the
+// next time one is added.
+struct ConstantIndex {
+  std::unordered_map<std::string, int> indexes;
+  size_t indexed = 0;
+
+  int add(std::vector<std::shared_ptr<Object>> &constants,
+          const std::shared_ptr<Object> &obj) {
+    for (; indexed < constants.size(); indexed++) {
+      auto k = key(constants[indexed]);
+      if (k) { indexes.emplace(std::move(*k), static_cast<int>(indexed)); }
+    }
+    auto k = key(obj);
+    if (k) {
+      auto it = indexes.find(*k);
+      if (it != indexes.end()) { return it->second; }
+    }
+    constants.push_back(obj);
+    return constants.size() - 1;
+  }
+
+  static std::optional<std::string> key(const std::shared_ptr<Object> &obj) {
+    switch (obj->type()) {
+    case INTEGER_OBJ: return "i" + std::to_string(cast<Integer>(obj).value);
+    case STRING_OBJ: return "s" + cast<String>(obj).value;
+    case COMPILED_FUNCTION_OBJ: {
+      const auto &fn = cast<CompiledFunction>(obj);
+      return fmt::format("f{}:{}:", fn.numLocals, fn.numParameters) +
+             std::string(fn.instructions.begin(), fn.instructions.end());
+    }
+    default: return std::nullopt;
+    }
+  }
+};
+
+// Optimizations applied while compiling. All of them are off by default, so
+// `compile` produces the plain instruction sequences.
+struct CompilerOptions {
+  bool constantFolding = false;
+  bool deadCode = false;
+  bool peephole = false;
+  bool superinstructions = false;
+  bool tailCalls = false;
+
+  // Replaces calls to small functions bound by `let` with their bodies. A
+  // body may have at most `inlineBudget` AST nodes.
+  bool inlining = false;
+  int inlineBudget = 24;
+
+  // Emits the integer forms of arithmetic and comparison opcodes where the
+  // operand types are inferred to be integers.
+  bool typeInference = false;
+
+  // Creates closures without free variables once, in the constant pool, and
+  // calls the ones bound by `let` with `OpCallKnown`.
+  bool lambdaLifting = false;
+
+  // Moves each local out of its slot at its last read and drops stores that
+  // are never read, so what a dead local held is released right away.
+  bool releaseLocals = false;
+
+  // Compiles through the SSA form of `IRCompiler` instead of `Compiler`.
+  bool ssa = false;
+
+  // Keeps the IR of each function in `IRCompiler::irDump`.
+  bool dumpIR = false;
+
+  // Adds the time spent in each pass to `Compiler::passTimes`.
+  bool timePasses = false;
+
+  // Level 0 compiles the program as written. Level 1 adds constant folding,
+  // the peephole pass and releasing locals; level 2 adds dead code
+  // elimination, tail calls, type inference, inlining, lambda lifting and
+  // superinstructions. `ssa` is a separate pipeline that no level selects.
+  static CompilerOptions level(int n) {
+    CompilerOptions options;
+    options.constantFolding = n >= 1;
+    options.peephole = n >= 1;
+    options.releaseLocals = n >= 1;
+    options.deadCode = n >= 2;
+    options.tailCalls = n >= 2;
+    options.typeInference = n >= 2;
+    options.inlining = n >= 2;
+    options.lambdaLifting = n >= 2;
+    options.superinstructions = n >= 2;
+    return options;
+  }
+};
+
+// Rewrites the instructions of a function, or of the main program when the
+// second argument is false.
+using BytecodePass = Instructions (*)(const Instructions &, bool);
+
+// An optimization pass, toggled by `enabled`. AST passes have no `rewrite`:
+// they are applied by `Compiler::compile` as it walks the tree. Bytecode
+// passes rewrite the instructions of each function once it is compiled.
+struct CompilerPass {
+  const char *name;
+  bool CompilerOptions::*enabled;
+  BytecodePass rewrite;
+};
+
+enum CompilerPassIndex {
+  ConstantFoldingPass = 0,
+  DeadCodePass,
+  TypeInferencePass,
+  InliningPass,
+  LambdaLiftingPass,
+  SsaPass,
+  PeepholePass,
+  TailCallPass,
+  SuperinstructionPass,
+  ReleaseLocalsPass,
+};
+
+// A function that calls may be replaced with, and the globals and builtins
+// its body refers to, as resolved where it was defined.
+struct InlineCandidate {
+  std::shared_ptr<Ast> function;
+  std::vector<std::pair<std::string, Symbol>> outerSymbols;
+};
+
+// What is known at compile time about the bindings whose `let` has run on
+// every path to the code being compiled, by symbol index.
+struct KnownBindings {
+  std::map<int, ObjectType> types;              // with type inference
+  std::map<int, InlineCandidate> functions;     // with inlining
+  std::map<int, int> closures; // constant indexes, with lambda lifting
 };
 
 struct CompilerScope {
   Instructions instructions;
   EmittedInstruction lastInstruction;
   EmittedInstruction previousInstruction;
+
+  // Identifiers read anywhere in the function body, nested functions
+  // included. Only collected when dead code elimination is on.
+  std::set<std::string_view> usedNames;
+
+  KnownBindings knownLocals;
+
+  // Local slots used by inlined calls end here. In a function they are
+  // definitions of its symbol table, so later `let`s don't reuse them; in
+  // the main program, whose definitions are globals, they start at 0.
+  int inlinedLocalsEnd = 0;
+
+  // Targets of the jumps that don't fit a 2-byte operand, by position. The
+  // jumps are widened once the function is compiled, since that moves the
+  // instructions after them.
+  std::map<size_t, int> farJumps;
 };
 
 struct Compiler {
+  CompilerOptions options;
   std::shared_ptr<SymbolTable> symbolTable;
   std::vector<std::shared_ptr<Object>> constants;
+  ConstantIndex constantIndex;
 
   std::vector<CompilerScope> scopes{CompilerScope{}};
   int scopeIndex = 0;
 
-  Compiler() : symbolTable(symbol_table()) {
+  KnownBindings knownGlobals;
+
+  // Functions whose calls are being replaced with their bodies, innermost
+  // last, and the number of calls replaced so far.
+  std::vector<const Ast *> inlining;
+  int inlinedCalls = 0;
+
+  // Time spent in each of `passes()`, when `options.timePasses` is set.
+  std::vector<std::chrono::nanoseconds> passTimes =
+      std::vector<std::chrono::nanoseconds>(passes().size());
+
+  Compiler(const CompilerOptions &options = CompilerOptions())
+      : options(options), symbolTable(symbol_table()) {
     int i = 0;
     for (const auto &[name, _] : BUILTINS) {
       symbolTable->define_builtin(i, name);
@@ -37,23 +206,38 @@ struct Compiler {
   };
 
   Compiler(std::shared_ptr<SymbolTable> symbolTable,
-           const std::vector<std::shared_ptr<Object>> &constants)
-      : symbolTable(symbolTable), constants(constants){};
+           const std::vector<std::shared_ptr<Object>> &constants,
+           const CompilerOptions &options = CompilerOptions())
+      : options(options), symbolTable(symbolTable), constants(constants){};
 
   void compile(const std::shared_ptr<Ast> &ast) {
     using namespace peg::udl;
 
     switch (ast->tag) {
     case "STATEMENTS"_: {
-      for (auto node : ast->nodes) {
-        compile(node);
+      const auto &nodes = ast->nodes;
+      for (size_t i = 0; i < nodes.size(); i++) {
+        if (options.deadCode && is_dead_statement(nodes, i)) { continue; }
+        compile(nodes[i]);
+        if (options.deadCode && nodes[i]->tag == "RETURN"_) {
+          // The rest can't run, but a block doesn't start a scope, so its
+          // bindings may still be referred to after the enclosing `if`.
+          for (auto j = i + 1; j < nodes.size(); j++) {
+            define_used_names(nodes[j]);
+          }
+          break;
+        }
       }
       break;
     }
     case "ASSIGNMENT"_: {
+      if (options.deadCode && is_unused_local(ast)) { break; }
       auto name = std::string(ast->nodes[0]->token);
       auto symbol = symbolTable->define(name);
       compile(ast->nodes[1]);
+      if (options.typeInference) { record_type(symbol, ast->nodes[1]); }
+      if (options.inlining) { record_function(symbol, ast->nodes[1]); }
+      if (options.lambdaLifting) { record_closure(symbol, ast->nodes[1]); }
       if (symbol.scope == GlobalScope) {
         emit(OpSetGlobal, {symbol.index});
       } else {
@@ -76,12 +260,14 @@ struct Compiler {
       break;
     }
     case "INFIX_EXPR"_: {
+      if (options.constantFolding && emit_folded_constant(ast)) { break; }
+
       auto op = ast->nodes[1]->token;
 
       if (op == "<") {
         compile(ast->nodes[2]);
         compile(ast->nodes[0]);
-        emit(OpGreaterThan, {});
+        emit(typed_opecode(OpGreaterThan, ast), {});
         return;
       }
 
@@ -89,13 +275,13 @@ struct Compiler {
       compile(ast->nodes[2]);
 
       switch (peg::str2tag(op)) {
-      case "+"_: emit(OpAdd, {}); break;
-      case "-"_: emit(OpSub, {}); break;
-      case "*"_: emit(OpMul, {}); break;
+      case "+"_: emit(typed_opecode(OpAdd, ast), {}); break;
+      case "-"_: emit(typed_opecode(OpSub, ast), {}); break;
+      case "*"_: emit(typed_opecode(OpMul, ast), {}); break;
       case "/"_: emit(OpDiv, {}); break;
-      case ">"_: emit(OpGreaterThan, {}); break;
-      case "=="_: emit(OpEqual, {}); break;
-      case "!="_: emit(OpNotEqual, {}); break;
+      case ">"_: emit(typed_opecode(OpGreaterThan, ast), {}); break;
+      case "=="_: emit(typed_opecode(OpEqual, ast), {}); break;
+      case "!="_: emit(typed_opecode(OpNotEqual, ast), {}); break;
       default:
         throw std::runtime_error(fmt::format("unknown operator {}", op));
         break;
@@ -103,6 +289,8 @@ struct Compiler {
       break;
     }
     case "PREFIX_EXPR"_: {
+      if (options.constantFolding && emit_folded_constant(ast)) { break; }
+
       int i = ast->nodes.size() - 1;
       compile(ast->nodes[i--]);
 
@@ -125,11 +313,19 @@ struct Compiler {
       // Emit an `OpJumpNotTruthy` with a bogus value
       auto jump_not_truthy_pos = emit(OpJumpNotTruthy, {9999});
 
+      // A `let` in a branch may not have run after the `if`, so what it
+      // recorded is dropped at the end of the branch.
+      auto knownGlobalsBefore = knownGlobals;
+      auto knownLocalsBefore = scopes[scopeIndex].knownLocals;
+
       // Consequence
       compile(ast->nodes[1]);
 
       if (last_instruction_is(OpPop)) { remove_last_pop(); }
 
+      knownGlobals = knownGlobalsBefore;
+      scopes[scopeIndex].knownLocals = knownLocalsBefore;
+
       // Emit an `OpJump` with a bogus value
       auto jump_pos = emit(OpJump, {9999});
 
@@ -144,6 +340,9 @@ struct Compiler {
         compile(ast->nodes[2]);
 
         if (last_instruction_is(OpPop)) { remove_last_pop(); }
+
+        knownGlobals = knownGlobalsBefore;
+        scopes[scopeIndex].knownLocals = knownLocalsBefore;
       }
 
       auto after_alternative_pos = current_instructions().size();
@@ -155,7 +354,7 @@ struct Compiler {
       break;
     }
     case "INTEGER"_: {
-      auto integer = std::make_shared<Integer>(ast->to_integer());
+      auto integer = make_integer(ast->to_integer());
       emit(OpConstant, {add_constant(integer)});
       break;
     }
@@ -188,8 +387,16 @@ struct Compiler {
       break;
     }
     case "CALL"_: {
-      compile(ast->nodes[0]);
-      for (auto i = 1u; i < ast->nodes.size(); i++) {
+      auto i = 1u;
+      std::optional<int> known;
+      if (options.inlining && inline_call(ast)) {
+        i = 2;
+      } else if (options.lambdaLifting && (known = known_closure(ast))) {
+        emit(OpConstant, {*known});
+      } else {
+        compile(ast->nodes[0]);
+      }
+      for (; i < ast->nodes.size(); i++) {
         auto postfix = ast->nodes[i];
         switch (postfix->original_tag) {
         case "INDEX"_: {
@@ -198,11 +405,16 @@ struct Compiler {
           break;
         }
         case "ARGUMENTS"_: {
-          auto arguments = ast->nodes[1];
+          auto arguments = postfix;
           for (auto node : arguments->nodes) {
             compile(node);
           }
-          emit(OpCall, {static_cast<int>(arguments->nodes.size())});
+          auto numArgs = static_cast<int>(arguments->nodes.size());
+          if (known && i == 1) {
+            emit(OpCallKnown, {*known, numArgs});
+          } else {
+            emit(OpCall, {numArgs});
+          }
           break;
         };
         }
@@ -214,6 +426,10 @@ struct Compiler {
       if (ast->value.has_value()) {
         symbolTable->define_function_name(ast->to_string());
       }
+      if (options.deadCode) {
+        auto timer = time_pass(DeadCodePass);
+        collect_used_names(ast->nodes[1], scopes[scopeIndex].usedNames);
+      }
       auto parameters = ast->nodes[0];
       for (auto node : parameters->nodes) {
         auto name = std::string(node->token);
@@ -224,7 +440,8 @@ struct Compiler {
       if (!last_instruction_is(OpReturnValue)) { emit(OpReturn, {}); }
 
       auto freeSymbols = symbolTable->freeSymbols;
-      auto numLocals = symbolTable->numDefinitions;
+      auto numLocals = std::max(symbolTable->numDefinitions,
+                                scopes[scopeIndex].inlinedLocalsEnd);
       auto instructions = leave_scope();
 
       for (const auto &s : freeSymbols) {
@@ -233,6 +450,12 @@ struct Compiler {
 
       auto compiledFn = make_compiled_function({instructions}, numLocals,
                                                parameters->nodes.size());
+      if (options.lambdaLifting && freeSymbols.empty()) {
+        auto timer = time_pass(LambdaLiftingPass);
+        auto fn = std::static_pointer_cast<CompiledFunction>(compiledFn);
+        emit(OpConstant, {add_constant(std::make_shared<Closure>(fn))});
+        break;
+      }
       auto fnIndex = add_constant(compiledFn);
       emit(OpClosure, {fnIndex, static_cast<int>(freeSymbols.size())});
       break;
@@ -245,9 +468,220 @@ struct Compiler {
     }
   }
 
+  // An expression statement is dead if it has no effect and its value isn't
+  // used. The value of the last statement may be the result of a block or
+  // function, and at the top level the VM reports the last popped value, so
+  // there the statement must be followed by another expression statement.
+  bool is_dead_statement(const std::vector<std::shared_ptr<Ast>> &nodes,
+                         size_t i) {
+    using namespace peg::udl;
+    auto timer = time_pass(DeadCodePass);
+
+    if (nodes[i]->tag != "EXPRESSION_STATEMENT"_ || i + 1 == nodes.size()) {
+      return false;
+    }
+    if (!is_pure(nodes[i]->nodes[0])) { return false; }
+    if (scopeIndex > 0) { return true; }
+    return std::any_of(nodes.begin() + i + 1, nodes.end(), [](auto &node) {
+      return node->tag == "EXPRESSION_STATEMENT"_;
+    });
+  }
+
+  // A local binding that nothing reads needs neither its value nor a slot.
+  bool is_unused_local(const std::shared_ptr<Ast> &ast) {
+    auto timer = time_pass(DeadCodePass);
+    if (scopeIndex == 0) { return false; }
+    const auto &usedNames = scopes[scopeIndex].usedNames;
+    return !usedNames.count(ast->nodes[0]->token) && is_pure(ast->nodes[1]);
+  }
+
+  // True if evaluating `ast` can neither fail nor have a side effect.
+  bool is_pure(const std::shared_ptr<Ast> &ast) const {
+    using namespace peg::udl;
+
+    switch (ast->tag) {
+    case "INTEGER"_:
+    case "BOOLEAN"_:
+    case "STRING"_:
+    case "FUNCTION"_: return true;
+    case "IDENTIFIER"_: return is_defined(std::string(ast->token));
+    case "PREFIX_EXPR"_:
+    case "INFIX_EXPR"_: return fold_constant(ast) != nullptr;
+    case "ARRAY"_:
+      return std::all_of(ast->nodes.begin(), ast->nodes.end(),
+                         [&](auto &node) { return is_pure(node); });
+    case "HASH"_:
+      return std::all_of(ast->nodes.begin(), ast->nodes.end(), [&](auto &node) {
+        auto keyTag = node->nodes[0]->tag;
+        return (keyTag == "INTEGER"_ || keyTag == "STRING"_ ||
+                keyTag == "BOOLEAN"_) &&
+               is_pure(node->nodes[1]);
+      });
+    default: return false;
+    }
+  }
+
+  // Unlike `SymbolTable::resolve`, doesn't capture the name as a free
+  // variable of the function being compiled.
+  bool is_defined(const std::string &name) const {
+    for (auto table = symbolTable.get(); table; table = table->outer.get()) {
+      if (table->store.count(name)) { return true; }
+    }
+    return false;
+  }
+
+  static void collect_used_names(const std::shared_ptr<Ast> &ast,
+                                 std::set<std::string_view> &names) {
+    using namespace peg::udl;
+
+    switch (ast->tag) {
+    case "IDENTIFIER"_: names.insert(ast->token); break;
+    case "ASSIGNMENT"_: collect_used_names(ast->nodes[1], names); break;
+    case "FUNCTION"_: collect_used_names(ast->nodes[1], names); break;
+    default:
+      for (auto node : ast->nodes) {
+        collect_used_names(node, names);
+      }
+      break;
+    }
+  }
+
+  // Defines the bindings in unreachable statements that are read elsewhere,
+  // without compiling the statements.
+  void define_used_names(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+
+    switch (ast->tag) {
+    case "ASSIGNMENT"_: {
+      auto name = ast->nodes[0]->token;
+      if (scopeIndex == 0 || scopes[scopeIndex].usedNames.count(name)) {
+        symbolTable->define(std::string(name));
+      }
+      break;
+    }
+    case "FUNCTION"_: break;
+    default:
+      for (auto node : ast->nodes) {
+        define_used_names(node);
+      }
+      break;
+    }
+  }
+
   int add_constant(std::shared_ptr<Object> obj) {
-    constants.push_back(obj);
-    return constants.size() - 1;
+    return constantIndex.add(constants, obj);
+  }
+
+  bool emit_folded_constant(const std::shared_ptr<Ast> &ast) {
+    std::shared_ptr<Object> value;
+    {
+      auto timer = time_pass(ConstantFoldingPass);
+      value = fold_constant(ast);
+    }
+    if (!value) { return false; }
+    emit_constant(value);
+    return true;
+  }
+
+  void emit_constant(const std::shared_ptr<Object> &value) {
+    if (value->type() == BOOLEAN_OBJ) {
+      emit(cast<Boolean>(value).value ? OpTrue : OpFalse, {});
+    } else {
+      emit(OpConstant, {add_constant(value)});
+    }
+  }
+
+  // Evaluates an expression made only of literals, with the semantics of the
+  // VM. Returns nullptr if the expression isn't constant or if evaluating it
+  // would fail, so that the error still happens at run time.
+  static std::shared_ptr<Object> fold_constant(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+
+    switch (ast->tag) {
+    case "INTEGER"_: return make_integer(ast->to_integer());
+    case "BOOLEAN"_: return make_bool(ast->to_bool());
+    case "STRING"_: return make_string(ast->token);
+    case "PREFIX_EXPR"_: {
+      int i = ast->nodes.size() - 1;
+      auto value = fold_constant(ast->nodes[i--]);
+      while (value && i >= 0) {
+        value = fold_prefix_expression(ast->nodes[i]->token, value);
+        i--;
+      }
+      return value;
+    }
+    case "INFIX_EXPR"_: {
+      auto left = fold_constant(ast->nodes[0]);
+      if (!left) { return nullptr; }
+      auto right = fold_constant(ast->nodes[2]);
+      if (!right) { return nullptr; }
+      return fold_infix_expression(ast->nodes[1]->token, left, right);
+    }
+    default: return nullptr;
+    }
+  }
+
+  static std::shared_ptr<Object>
+  fold_prefix_expression(std::string_view op,
+                         const std::shared_ptr<Object> &value) {
+    if (op == "!") {
+      return make_bool(value->type() == BOOLEAN_OBJ
+                           ? !cast<Boolean>(value).value
+                           : value->type() == NULL_OBJ);
+    }
+    if (op == "-" && value->type() == INTEGER_OBJ) {
+      return make_integer(static_cast<int64_t>(
+          -static_cast<uint64_t>(cast<Integer>(value).value)));
+    }
+    return nullptr;
+  }
+
+  static std::shared_ptr<Object>
+  fold_infix_expression(std::string_view op,
+                        const std::shared_ptr<Object> &left,
+                        const std::shared_ptr<Object> &right) {
+    using namespace peg::udl;
+
+    auto tag = peg::str2tag(op);
+    auto leftType = left->type();
+    auto rightType = right->type();
+
+    if (leftType == INTEGER_OBJ && rightType == INTEGER_OBJ) {
+      auto lval = cast<Integer>(left).value;
+      auto rval = cast<Integer>(right).value;
+      // Overflow wraps, and INT64_MIN / -1 is left to run time.
+      auto l = static_cast<uint64_t>(lval);
+      auto r = static_cast<uint64_t>(rval);
+      switch (tag) {
+      case "+"_: return make_integer(static_cast<int64_t>(l + r));
+      case "-"_: return make_integer(static_cast<int64_t>(l - r));
+      case "*"_: return make_integer(static_cast<int64_t>(l * r));
+      case "/"_:
+        if (rval == 0 || (rval == -1 && lval == INT64_MIN)) { return nullptr; }
+        return make_integer(lval / rval);
+      case "<"_: return make_bool(lval < rval);
+      case ">"_: return make_bool(lval > rval);
+      case "=="_: return make_bool(lval == rval);
+      case "!="_: return make_bool(lval != rval);
+      default: return nullptr;
+      }
+    }
+
+    if (leftType == BOOLEAN_OBJ && rightType == BOOLEAN_OBJ) {
+      auto lval = cast<Boolean>(left).value;
+      auto rval = cast<Boolean>(right).value;
+      switch (tag) {
+      case "=="_: return make_bool(lval == rval);
+      case "!="_: return make_bool(lval != rval);
+      default: return nullptr;
+      }
+    }
+
+    if (leftType == STRING_OBJ && rightType == STRING_OBJ && tag == "+"_) {
+      return make_string(cast<String>(left).value + cast<String>(right).value);
+    }
+
+    return nullptr;
   }
 
   size_t emit(Opecode op, const std::vector<int> &operands) {
@@ -291,11 +725,31 @@ struct Compiler {
 
   void change_operand(int op_pos, int operand) {
     auto op = current_instructions()[op_pos];
+    if (is_jump(op) && !fits(lookup(op).operand_widths, {operand})) {
+      scopes[scopeIndex].farJumps[op_pos] = operand;
+      return;
+    }
     auto new_instruction = make(op, {operand});
     replace_instruction(op_pos, new_instruction);
   }
 
-  Bytecode bytecode() { return Bytecode{current_instructions(), constants}; }
+  Bytecode bytecode() {
+    return Bytecode{optimize(finished_instructions(), false), constants,
+                    scopes[0].inlinedLocalsEnd, global_count(symbolTable)};
+  }
+
+  static int global_count(std::shared_ptr<SymbolTable> table) {
+    while (table->outer) {
+      table = table->outer;
+    }
+    return table->numDefinitions;
+  }
+
+  Instructions finished_instructions() const {
+    const auto &scope = scopes[scopeIndex];
+    if (scope.farJumps.empty()) { return scope.instructions; }
+    return widen_jumps(scope.instructions, scope.farJumps);
+  }
 
   Instructions &current_instructions() {
     return scopes[scopeIndex].instructions;
@@ -324,7 +778,7 @@ struct Compiler {
   }
 
   Instructions leave_scope() {
-    auto instructions = current_instructions();
+    auto instructions = optimize(finished_instructions(), true);
     scopes.pop_back();
     scopeIndex--;
     symbolTable = symbolTable->outer;
@@ -342,6 +796,548 @@ struct Compiler {
     last_instruction().opecode = OpReturnValue;
   }
 
+  // All passes, in the order they run.
+  static const std::vector<CompilerPass> &passes() {
+    static const std::vector<CompilerPass> passes_{
+        {"constant-folding", &CompilerOptions::constantFolding, nullptr},
+        {"dead-code", &CompilerOptions::deadCode, nullptr},
+        {"type-inference", &CompilerOptions::typeInference, nullptr},
+        {"inlining", &CompilerOptions::inlining, nullptr},
+        {"lambda-lifting", &CompilerOptions::lambdaLifting, nullptr},
+        {"ssa", &CompilerOptions::ssa, nullptr},
+        {"peephole", &CompilerOptions::peephole,
+         [](const Instructions &ins, bool) { return peephole(ins); }},
+        {"tail-calls", &CompilerOptions::tailCalls,
+         [](const Instructions &ins, bool inFunction) {
+           return inFunction ? mark_tail_calls(ins) : ins;
+         }},
+        {"superinstructions", &CompilerOptions::superinstructions,
+         [](const Instructions &ins, bool) {
+           return fuse_superinstructions(ins);
+         }},
+        {"release-locals", &CompilerOptions::releaseLocals,
+         [](const Instructions &ins, bool) { return release_locals(ins); }},
+    };
+    return passes_;
+  }
+
+  static const CompilerPass *find_pass(std::string_view name) {
+    for (const auto &pass : passes()) {
+      if (name == pass.name) { return &pass; }
+    }
+    return nullptr;
+  }
+
+  // Adds the time until the returned timer goes out of scope to the pass.
+  struct PassTimer {
+    std::chrono::nanoseconds *total;
+    std::chrono::steady_clock::time_point start;
+
+    ~PassTimer() {
+      if (total) { *total += std::chrono::steady_clock::now() - start; }
+    }
+  };
+
+  PassTimer time_pass(CompilerPassIndex pass) {
+    if (!options.timePasses) { return PassTimer{nullptr, {}}; }
+    return PassTimer{&passTimes[pass], std::chrono::steady_clock::now()};
+  }
+
+  Instructions optimize(const Instructions &ins, bool inFunction) {
+    auto out = ins;
+    const auto &all = passes();
+    for (size_t i = 0; i < all.size(); i++) {
+      if (!all[i].rewrite || !(options.*all[i].enabled)) { continue; }
+      auto timer = time_pass(static_cast<CompilerPassIndex>(i));
+      out = all[i].rewrite(out, inFunction);
+    }
+    return out;
+  }
+
+  // Simplifies jumps and drops instructions with no effect, repeating until
+  // nothing changes since one rewrite can expose another:
+  //
+  // - a jump to an `OpJump` goes to that jump's target instead
+  // - an `OpJump` to the next instruction is dropped
+  // - `OpTrue OpJumpNotTruthy` never jumps and is dropped
+  // - `OpFalse OpJumpNotTruthy` always jumps and becomes `OpJump`
+  // - `OpBang OpJumpNotTruthy` becomes `OpJumpTruthy`
+  // - `OpNull OpPop` is dropped unless it is the last `OpPop`, whose value
+  //   is the result of the program
+  // - instructions after `OpJump`, `OpReturnValue` or `OpReturn` that no
+  //   jump lands on are unreachable and dropped
+  static Instructions peephole(const Instructions &ins) {
+    auto out = ins;
+    for (;;) {
+      // Index of the last `OpPop`, found once per pass.
+      std::optional<size_t> lastPop;
+      auto next = rewrite(out, [&](const DecodedInstructions &in,
+                                   const std::vector<bool> &targets, size_t i,
+                                   DecodedInstructions &out) -> size_t {
+        if (!lastPop) {
+          lastPop = 0;
+          for (size_t j = 0; j < in.size(); j++) {
+            if (in[j].op == OpPop) { lastPop = j; }
+          }
+        }
+        auto target = [&](size_t j) {
+          auto t = in[j].operands[0];
+          for (size_t n = 0; in[t].op == OpJump && n < in.size(); n++) {
+            t = in[t].operands[0];
+          }
+          return t;
+        };
+        auto jump = [&](Opecode op, size_t j) {
+          out.push_back(DecodedInstruction{nullptr, op, 0, {target(j)}});
+        };
+
+        if (matches(in, targets, i, {OpTrue, OpJumpNotTruthy})) { return 2; }
+        if (matches(in, targets, i, {OpFalse, OpJumpNotTruthy})) {
+          jump(OpJump, i + 1);
+          return 2;
+        }
+        if (matches(in, targets, i, {OpBang, OpJumpNotTruthy})) {
+          jump(OpJumpTruthy, i + 1);
+          return 2;
+        }
+        if (matches(in, targets, i, {OpNull, OpPop}) && i + 1 < *lastPop) {
+          return 2;
+        }
+
+        auto op = in[i].op;
+        if (op == OpJump || op == OpReturnValue || op == OpReturn) {
+          if (op == OpJump && target(i) != static_cast<int>(i + 1)) {
+            jump(OpJump, i);
+          } else if (op != OpJump) {
+            out.push_back(in[i]);
+          }
+          auto j = i + 1;
+          while (j + 1 < in.size() && !targets[j]) {
+            j++;
+          }
+          return j - i;
+        }
+        if (is_jump(op)) {
+          out.push_back(in[i]);
+          out.back().operands[0] = target(i);
+          return 1;
+        }
+        return 0;
+      });
+      if (next == out) { return out; }
+      out = next;
+    }
+  }
+
+  // A call is in tail position when its result is returned right away,
+  // either by the next instruction or at the end of the jumps that follow
+  // it (the branches of an `if` that ends a function body). The
+  // `OpReturnValue` stays, since a builtin called by `OpTailCall` returns to
+  // the calling function. `OpCallKnown` has its callee on the stack as well,
+  // so it becomes an `OpTailCall` too.
+  static Instructions mark_tail_calls(const Instructions &ins) {
+    return rewrite(ins, [](const DecodedInstructions &in,
+                           const std::vector<bool> &, size_t i,
+                           DecodedInstructions &out) -> size_t {
+      if (in[i].op != OpCall && in[i].op != OpCallKnown) { return 0; }
+
+      auto next = i + 1;
+      while (in[next].op == OpJump) {
+        next = in[next].operands[0];
+      }
+      if (in[next].op != OpReturnValue) { return 0; }
+
+      auto numArgs = in[i].operands[in[i].op == OpCallKnown ? 1 : 0];
+      out.push_back(DecodedInstruction{nullptr, OpTailCall, 0, {numArgs}});
+      return 1;
+    });
+  }
+
+  static Instructions fuse_superinstructions(const Instructions &ins) {
+    return rewrite(ins, [](const DecodedInstructions &in,
+                           const std::vector<bool> &targets, size_t i,
+                           DecodedInstructions &out) -> size_t {
+      auto fuse = [&](Opecode op, int a, int b) {
+        out.push_back(DecodedInstruction{nullptr, op, 0, {a, b}});
+      };
+
+      if (matches(in, targets, i, {OpGetLocal, OpConstant, OpAdd})) {
+        fuse(OpAddLocalConstant, in[i].operands[0], in[i + 1].operands[0]);
+        return 3;
+      }
+      if (matches(in, targets, i, {OpGetLocal, OpConstant, OpSub})) {
+        fuse(OpSubLocalConstant, in[i].operands[0], in[i + 1].operands[0]);
+        return 3;
+      }
+      if (matches(in, targets, i, {OpGetLocal, OpGetLocal, OpAdd})) {
+        fuse(OpAddLocals, in[i].operands[0], in[i + 1].operands[0]);
+        return 3;
+      }
+      if (matches(in, targets, i, {OpConstant, OpEqual, OpJumpNotTruthy})) {
+        fuse(OpJumpNotEqualConstant, in[i + 2].operands[0],
+             in[i].operands[0]);
+        return 3;
+      }
+      if (matches(in, targets, i,
+                  {OpConstant, OpGreaterThan, OpJumpNotTruthy})) {
+        fuse(OpJumpNotGreaterThanConstant, in[i + 2].operands[0],
+             in[i].operands[0]);
+        return 3;
+      }
+      return 0;
+    });
+  }
+
+  // The locals that may still be read after each instruction: `live[i][n]`
+  // is true if some path from `in[i]` on reads local `n` before storing to
+  // it. Monkey only jumps forward, so a single backward sweep finds them.
+  static std::vector<std::vector<bool>>
+  live_locals(const DecodedInstructions &in) {
+    size_t numLocals = 0;
+    for (const auto &d : in) {
+      if (d.op == OpGetLocal || d.op == OpSetLocal || d.op == OpAddLocals ||
+          d.op == OpAddLocalConstant || d.op == OpSubLocalConstant) {
+        numLocals = std::max(numLocals, static_cast<size_t>(d.operands[0]) + 1);
+      }
+      if (d.op == OpAddLocals) {
+        numLocals = std::max(numLocals, static_cast<size_t>(d.operands[1]) + 1);
+      }
+    }
+
+    std::vector<std::vector<bool>> live(in.size(),
+                                        std::vector<bool>(numLocals));
+    std::vector<std::vector<bool>> liveIn(in.size() + 1,
+                                          std::vector<bool>(numLocals));
+    for (auto i = in.size(); i-- > 0;) {
+      const auto &d = in[i];
+      auto op = d.op;
+      if (op != OpJump && op != OpReturnValue && op != OpReturn) {
+        live[i] = liveIn[i + 1];
+      }
+      if (is_jump(op)) {
+        const auto &target = liveIn[d.operands[0]];
+        for (size_t n = 0; n < numLocals; n++) {
+          if (target[n]) { live[i][n] = true; }
+        }
+      }
+
+      liveIn[i] = live[i];
+      switch (op) {
+      case OpSetLocal: liveIn[i][d.operands[0]] = false; break;
+      case OpAddLocals: liveIn[i][d.operands[1]] = true; [[fallthrough]];
+      case OpGetLocal:
+      case OpAddLocalConstant:
+      case OpSubLocalConstant: liveIn[i][d.operands[0]] = true; break;
+      default: break;
+      }
+    }
+    return live;
+  }
+
+  // Turns the last read of a local into `OpMoveLocal`, and a store to a
+  // local that is never read into `OpPop`.
+  static Instructions release_locals(const Instructions &ins) {
+    auto live = live_locals(decode(ins));
+    return rewrite(ins, [&](const DecodedInstructions &in,
+                            const std::vector<bool> &, size_t i,
+                            DecodedInstructions &out) -> size_t {
+      auto op = in[i].op;
+      if (op != OpGetLocal && op != OpSetLocal) { return 0; }
+      auto local = in[i].operands[0];
+      if (live[i][local]) { return 0; }
+      if (op == OpGetLocal) {
+        out.push_back(DecodedInstruction{nullptr, OpMoveLocal, 0, {local}});
+      } else {
+        out.push_back(DecodedInstruction{nullptr, OpPop, 0, {}});
+      }
+      return 1;
+    });
+  }
+
+  KnownBindings &known_bindings(const Symbol &symbol) {
+    return symbol.scope == GlobalScope ? knownGlobals
+                                       : scopes[scopeIndex].knownLocals;
+  }
+
+  // The type `ast` evaluates to, if it is known at compile time. Call it
+  // after `ast` is compiled, so that resolving its identifiers has no side
+  // effect on the symbol table.
+  std::optional<ObjectType> infer_type(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+
+    switch (ast->tag) {
+    case "INTEGER"_: return INTEGER_OBJ;
+    case "BOOLEAN"_: return BOOLEAN_OBJ;
+    case "STRING"_: return STRING_OBJ;
+    case "ARRAY"_: return ARRAY_OBJ;
+    case "HASH"_: return HASH_OBJ;
+    case "IDENTIFIER"_: {
+      auto symbol = symbolTable->resolve(std::string(ast->token));
+      if (!symbol ||
+          (symbol->scope != GlobalScope && symbol->scope != LocalScope)) {
+        return std::nullopt;
+      }
+      const auto &types = known_bindings(*symbol).types;
+      auto it = types.find(symbol->index);
+      if (it == types.end()) { return std::nullopt; }
+      return it->second;
+    }
+    case "INFIX_EXPR"_: {
+      auto op = ast->nodes[1]->token;
+      if (op != "+" && op != "-" && op != "*" && op != "/") {
+        return BOOLEAN_OBJ;
+      }
+      auto left = infer_type(ast->nodes[0]);
+      auto right = infer_type(ast->nodes[2]);
+      if (!left || !right || *left != *right) { return std::nullopt; }
+      if (*left == INTEGER_OBJ) { return INTEGER_OBJ; }
+      if (*left == STRING_OBJ && op == "+") { return STRING_OBJ; }
+      return std::nullopt;
+    }
+    case "PREFIX_EXPR"_: {
+      auto type = infer_type(ast->nodes.back());
+      for (auto i = ast->nodes.size() - 1; i-- > 0;) {
+        if (ast->nodes[i]->token == "!") {
+          type = BOOLEAN_OBJ;
+        } else if (type != INTEGER_OBJ) {
+          type = std::nullopt;
+        }
+      }
+      return type;
+    }
+    default: return std::nullopt;
+    }
+  }
+
+  void record_type(const Symbol &symbol, const std::shared_ptr<Ast> &value) {
+    auto timer = time_pass(TypeInferencePass);
+    auto &types = known_bindings(symbol).types;
+    if (auto type = infer_type(value)) {
+      types[symbol.index] = *type;
+    } else {
+      types.erase(symbol.index);
+    }
+  }
+
+  // With type inference, the form of `op` for the infix expression `ast`:
+  // the unchecked integer form when both operands are known to be integers,
+  // and the checked one when one is known to be an integer and the other may
+  // be one. The checked form falls back to the generic operation, so a wrong
+  // guess about the unknown operand only costs the fallback.
+  Opecode typed_opecode(Opecode op, const std::shared_ptr<Ast> &ast) {
+    if (!options.typeInference) { return op; }
+    auto timer = time_pass(TypeInferencePass);
+    auto left = infer_type(ast->nodes[0]);
+    auto right = infer_type(ast->nodes[2]);
+    auto may_be_integer = [](const std::optional<ObjectType> &type) {
+      return !type || *type == INTEGER_OBJ;
+    };
+    if (left == INTEGER_OBJ && right == INTEGER_OBJ) {
+      return unchecked_integer_opecode(op);
+    }
+    if (may_be_integer(left) && may_be_integer(right) && (left || right)) {
+      return integer_opecode(op);
+    }
+    return op;
+  }
+
+  // Remembers `value` as the function bound to `symbol` if calls to it can
+  // be inlined: its body fits the budget, has no `return` (which would
+  // return from the caller), no function literal and no `let` in a branch
+  // (whose slot would keep what an earlier inlined call left if the branch
+  // didn't run), doesn't refer to the binding itself, and refers to nothing
+  // but its own bindings, globals and builtins.
+  void record_function(const Symbol &symbol,
+                       const std::shared_ptr<Ast> &value) {
+    using namespace peg::udl;
+    auto timer = time_pass(InliningPass);
+
+    auto &functions = known_bindings(symbol).functions;
+    functions.erase(symbol.index);
+    if (value->tag != "FUNCTION"_) { return; }
+
+    const auto &body = value->nodes[1];
+    auto size = 0;
+    auto inlinable = true;
+    std::set<std::string_view> bound;
+    for (const auto &node : value->nodes[0]->nodes) {
+      bound.insert(node->token);
+    }
+    visit(body, [&](const Ast &node) {
+      size++;
+      if (node.tag == "RETURN"_ || node.tag == "FUNCTION"_) {
+        inlinable = false;
+      }
+      if (node.tag == "ASSIGNMENT"_) { bound.insert(node.nodes[0]->token); }
+      for (size_t i = 1; node.tag == "IF"_ && i < node.nodes.size(); i++) {
+        visit(node.nodes[i], [&](const Ast &branch) {
+          if (branch.tag == "ASSIGNMENT"_) { inlinable = false; }
+        });
+      }
+    });
+    if (!inlinable || size > options.inlineBudget) { return; }
+
+    std::set<std::string_view> used;
+    collect_used_names(body, used);
+    InlineCandidate candidate{value, {}};
+    for (auto name : used) {
+      if (bound.count(name)) { continue; }
+      if (name == symbol.name) { return; }
+      // Looked up without `resolve`, which would turn a local of an
+      // enclosing function into a free variable of this one.
+      auto table = symbolTable;
+      auto it = table->store.find(std::string(name));
+      while (it == table->store.end() && table->outer) {
+        table = table->outer;
+        it = table->store.find(std::string(name));
+      }
+      if (it == table->store.end() || table->outer) { return; }
+      candidate.outerSymbols.emplace_back(it->first, it->second);
+    }
+    functions[symbol.index] = candidate;
+  }
+
+  // Remembers the constant index of the closure bound to `symbol` if
+  // `value` was lifted to the constant pool.
+  void record_closure(const Symbol &symbol, const std::shared_ptr<Ast> &value) {
+    using namespace peg::udl;
+    auto &closures = known_bindings(symbol).closures;
+    closures.erase(symbol.index);
+    if (value->tag == "FUNCTION"_ && last_instruction_is(OpConstant) &&
+        constants.back()->type() == CLOSURE_OBJ) {
+      closures[symbol.index] = static_cast<int>(constants.size()) - 1;
+    }
+  }
+
+  // The constant index of the closure that the call `ast` calls, if it is
+  // a known lifted closure taking as many arguments as the call passes.
+  std::optional<int> known_closure(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+    const auto &callee = ast->nodes[0];
+    const auto &arguments = ast->nodes[1];
+    if (callee->tag != "IDENTIFIER"_ ||
+        arguments->original_tag != "ARGUMENTS"_) {
+      return std::nullopt;
+    }
+
+    auto timer = time_pass(LambdaLiftingPass);
+    auto symbol = symbolTable->resolve(std::string(callee->token));
+    if (!symbol ||
+        (symbol->scope != GlobalScope && symbol->scope != LocalScope)) {
+      return std::nullopt;
+    }
+    const auto &closures = known_bindings(*symbol).closures;
+    auto it = closures.find(symbol->index);
+    if (it == closures.end()) { return std::nullopt; }
+    const auto &fn = cast<Closure>(constants[it->second]).fn;
+    if (fn->numParameters != static_cast<int>(arguments->nodes.size())) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  template <typename T>
+  static void visit(const std::shared_ptr<Ast> &ast, T fn) {
+    fn(*ast);
+    for (const auto &node : ast->nodes) {
+      visit(node, fn);
+    }
+  }
+
+  // Compiles the call `ast` as the body of the function it calls, if that
+  // function is known and can be inlined. The arguments are stored in local
+  // slots that the body reads as its parameters.
+  bool inline_call(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+
+    const auto &callee = ast->nodes[0];
+    const auto &arguments = ast->nodes[1];
+    if (callee->tag != "IDENTIFIER"_ ||
+        arguments->original_tag != "ARGUMENTS"_) {
+      return false;
+    }
+
+    std::shared_ptr<Ast> function;
+    std::shared_ptr<SymbolTable> inlined;
+    {
+      auto timer = time_pass(InliningPass);
+      auto symbol = symbolTable->resolve(std::string(callee->token));
+      if (!symbol ||
+          (symbol->scope != GlobalScope && symbol->scope != LocalScope)) {
+        return false;
+      }
+      const auto &functions = known_bindings(*symbol).functions;
+      auto it = functions.find(symbol->index);
+      if (it == functions.end()) { return false; }
+      function = it->second.function;
+
+      const auto &parameters = function->nodes[0]->nodes;
+      if (arguments->nodes.size() != parameters.size() ||
+          std::count(inlining.begin(), inlining.end(), function.get())) {
+        return false;
+      }
+
+      // The body is compiled with a table of its own over the globals, so
+      // a global it refers to must not have been redefined since.
+      auto globals = symbolTable;
+      while (globals->outer) {
+        globals = globals->outer;
+      }
+      for (const auto &[name, outer] : it->second.outerSymbols) {
+        if (!(globals->resolve(name) == outer)) { return false; }
+      }
+      inlined = enclosed_symbol_table(globals);
+    }
+
+    for (const auto &node : arguments->nodes) {
+      compile(node);
+    }
+
+    // Slots past the caller's own definitions; in the main program, whose
+    // definitions are globals, they start at 0.
+    inlined->numDefinitions =
+        symbolTable->outer ? symbolTable->numDefinitions : 0;
+    const auto &parameters = function->nodes[0]->nodes;
+    for (const auto &node : parameters) {
+      inlined->define(std::string(node->token));
+    }
+    for (auto i = parameters.size(); i-- > 0;) {
+      emit(OpSetLocal, {static_cast<int>(inlined->numDefinitions -
+                                         parameters.size() + i)});
+    }
+
+    auto knownLocalsBefore = scopes[scopeIndex].knownLocals;
+    if (options.deadCode) {
+      collect_used_names(function->nodes[1], scopes[scopeIndex].usedNames);
+    }
+
+    auto caller = symbolTable;
+    symbolTable = inlined;
+    inlining.push_back(function.get());
+    auto start = current_instructions().size();
+    compile(function->nodes[1]);
+    if (last_instruction_is(OpPop) &&
+        static_cast<size_t>(last_instruction().position) >= start) {
+      remove_last_pop();
+    } else {
+      emit(OpNull, {});
+    }
+    inlining.pop_back();
+    symbolTable = caller;
+
+    // A later `let` of the caller mustn't take an inlined slot: if it sat
+    // in a branch that didn't run, reading it would give what the inlined
+    // call left there instead of null.
+    if (caller->outer) { caller->numDefinitions = inlined->numDefinitions; }
+
+    auto &scope = scopes[scopeIndex];
+    scope.knownLocals = knownLocalsBefore;
+    scope.inlinedLocalsEnd =
+        std::max(scope.inlinedLocalsEnd, inlined->numDefinitions);
+    inlinedCalls++;
+    return true;
+  }
+
   void load_symbol(const Symbol &s) {
     if (s.scope == GlobalScope) {
       emit(OpGetGlobal, {s.index});
@@ -26,7 +26,7 @@ struct Evaluator {
       throw make_error("unknown operator: -" + right->name());
     }
     auto val = cast<Integer>(right).value;
-    return std::make_shared<Integer>(-val);
+    return make_integer(-val);
   }
 
   std::shared_ptr<Object>
@@ -63,13 +63,13 @@ struct Evaluator {
     auto rval = cast<Integer>(right).value;
 
     switch (tag) {
-    case "+"_: return std::make_shared<Integer>(lval + rval);
-    case "-"_: return std::make_shared<Integer>(lval - rval);
-    case "*"_: return std::make_shared<Integer>(lval * rval);
-    case "%"_: return std::make_shared<Integer>(lval % rval);
+    case "+"_: return make_integer(lval + rval);
+    case "-"_: return make_integer(lval - rval);
+    case "*"_: return make_integer(lval * rval);
+    case "%"_: return make_integer(lval % rval);
     case "/"_:
       if (rval == 0) { throw make_error("divide by 0 error"); }
-      return std::make_shared<Integer>(lval / rval);
+      return make_integer(lval / rval);
     case "<"_: return make_bool(lval < rval);
     case ">"_: return make_bool(lval > rval);
     case "=="_: return make_bool(lval == rval);
@@ -338,7 +338,7 @@ struct Evaluator {
     using namespace peg::udl;
 
     switch (node.tag) {
-    case "INTEGER"_: return std::make_shared<Integer>(node.to_integer());
+    case "INTEGER"_: return make_integer(node.to_integer());
     case "BOOLEAN"_: return make_bool(node.to_bool());
     case "PREFIX_EXPR"_: return eval_prefix_expression(node, env);
     case "INFIX_EXPR"_: return eval_infix_expression(node, env);
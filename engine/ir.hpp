@@ -0,0 +1,189 @@
+#pragma once
+
+#include <code.hpp>
+#include <object.hpp>
+
+namespace monkey {
+
+// Operations of the SSA form built by `IRCompiler`. Every value is defined
+// once by the operation that computes it, and `args` are its operands.
+enum IROp : uint8_t {
+  IRConst,          // `constant`
+  IRParam,          // parameter `index`
+  IRGetGlobal,      // globals[index]
+  IRSetGlobal,      // globals[index] = args[0]
+  IRGetBuiltin,     // builtins[index]
+  IRGetFree,        // free[index] of the running closure
+  IRCurrentClosure, // the running closure
+  IRBinary,         // args[0] `opecode` args[1]
+  IRUnary,          // `opecode` args[0]
+  IRArray,          // [args[0], ...]
+  IRHash,           // {args[0]: args[1], ...}
+  IRIndex,          // args[0][args[1]]
+  IRCall,           // args[0](args[1], ...)
+  IRClosure,        // closure of constants[index] over args
+  IRPhi,            // args[i] when entered from the i-th predecessor
+  IRPop,            // args[0] is the value of a top level expression statement
+};
+
+// What is known about the type of a value at compile time.
+enum IRType : uint8_t {
+  AnyType,
+  IntegerType,
+  BooleanType,
+  StringType,
+  NullType,
+  ArrayType,
+  HashType,
+  FunctionType,
+};
+
+// How a block ends. `IRJump` goes to `targets[0]`; `IRBranch` goes to
+// `targets[0]` if `operand` is truthy and to `targets[1]` otherwise.
+enum IRTerminator : uint8_t {
+  IROpen, // still being built
+  IRJump,
+  IRBranch,
+  IRReturn,     // return `operand`
+  IRReturnNull, // return null
+  IREnd,        // end of the main program
+};
+
+struct IRBlock;
+
+struct IRValue {
+  IROp op;
+  IRType type = AnyType;
+  int id = 0;
+  int index = 0;
+  Opecode opecode = 0;
+  std::shared_ptr<Object> constant;
+  std::vector<IRValue *> args;
+  IRBlock *block = nullptr;
+  bool dead = false;
+};
+
+struct IRBlock {
+  int id = 0;
+  std::vector<IRValue *> values; // phis first, then in execution order
+  std::vector<IRBlock *> preds;
+  IRTerminator terminator = IROpen;
+  IRValue *operand = nullptr;
+  IRBlock *targets[2] = {nullptr, nullptr};
+};
+
+// A function, or the main program, as a graph of basic blocks. `blocks[0]`
+// is the entry, and blocks are kept in the order their code is laid out.
+// Monkey has no loops, so every jump goes to a later block.
+struct IRFunction {
+  int numParameters = 0;
+  std::vector<std::unique_ptr<IRBlock>> blocks;
+  std::vector<std::unique_ptr<IRValue>> values;
+
+  IRBlock *new_block() {
+    blocks.push_back(std::make_unique<IRBlock>());
+    blocks.back()->id = static_cast<int>(blocks.size() - 1);
+    return blocks.back().get();
+  }
+
+  IRValue *new_value(IROp op, IRBlock *block) {
+    values.push_back(std::make_unique<IRValue>());
+    auto v = values.back().get();
+    v->op = op;
+    v->id = static_cast<int>(values.size() - 1);
+    v->block = block;
+    return v;
+  }
+};
+
+inline IRType ir_type(const std::shared_ptr<Object> &obj) {
+  switch (obj->type()) {
+  case INTEGER_OBJ: return IntegerType;
+  case BOOLEAN_OBJ: return BooleanType;
+  case STRING_OBJ: return StringType;
+  case NULL_OBJ: return NullType;
+  case ARRAY_OBJ: return ArrayType;
+  case HASH_OBJ: return HashType;
+  default: return AnyType;
+  }
+}
+
+inline const char *ir_type_name(IRType type) {
+  static const char *names[] = {
+      "any", "integer", "boolean", "string",
+      "null", "array", "hash", "function",
+  };
+  static_assert(sizeof(names) / sizeof(names[0]) == FunctionType + 1);
+  return names[type];
+}
+
+inline const char *ir_op_name(IROp op) {
+  static const char *names[] = {
+      "const",     "param",   "get_global", "set_global",
+      "get_builtin", "get_free", "current_closure", "binary",
+      "unary",     "array",   "hash",       "index",
+      "call",      "closure", "phi",        "pop",
+  };
+  static_assert(sizeof(names) / sizeof(names[0]) == IRPop + 1);
+  return names[op];
+}
+
+inline std::string to_string(const IRValue &v) {
+  std::string out;
+  if (v.op != IRSetGlobal && v.op != IRPop) {
+    out += fmt::format("v{}: {} = ", v.id, ir_type_name(v.type));
+  }
+
+  switch (v.op) {
+  case IRConst: out += "const " + v.constant->inspect(); break;
+  case IRBinary:
+  case IRUnary: out += lookup(v.opecode).name; break;
+  default:
+    out += ir_op_name(v.op);
+    if (v.op != IRCurrentClosure && v.op != IRPop && v.op != IRPhi &&
+        v.op != IRArray && v.op != IRHash && v.op != IRIndex &&
+        v.op != IRCall) {
+      out += fmt::format(" {}", v.index);
+    }
+    break;
+  }
+
+  for (size_t i = 0; i < v.args.size(); i++) {
+    out += fmt::format("{}v{}", i == 0 ? " " : ", ", v.args[i]->id);
+  }
+  return out;
+}
+
+inline std::string to_string(const IRFunction &fn, const char *ln = "\n") {
+  std::string out;
+  for (const auto &block : fn.blocks) {
+    out += fmt::format("b{}:", block->id);
+    if (!block->preds.empty()) {
+      out += " <-";
+      for (auto pred : block->preds) {
+        out += fmt::format(" b{}", pred->id);
+      }
+    }
+    out += ln;
+
+    for (auto v : block->values) {
+      if (!v->dead) { out += "  " + to_string(*v) + ln; }
+    }
+
+    switch (block->terminator) {
+    case IROpen: break;
+    case IRJump: out += fmt::format("  jump b{}", block->targets[0]->id); break;
+    case IRBranch:
+      out += fmt::format("  branch v{} b{} b{}", block->operand->id,
+                         block->targets[0]->id, block->targets[1]->id);
+      break;
+    case IRReturn: out += fmt::format("  return v{}", block->operand->id); break;
+    case IRReturnNull: out += "  return"; break;
+    case IREnd: out += "  end"; break;
+    }
+    if (block->terminator != IROpen) { out += ln; }
+  }
+  return out;
+}
+
+} // namespace monkey
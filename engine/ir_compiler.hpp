@@ -0,0 +1,1098 @@
+#pragma once
+
+#include <compiler.hpp>
+#include <ir.hpp>
+#include <map>
+#include <reg_compiler.hpp>
+
+namespace monkey {
+
+// A function being lowered. `locals` maps local symbol indexes to their
+// current values. The tables of known values are stacked by branch: what is
+// learned inside an `if` branch is dropped when the branch ends, so only
+// values computed in dominating blocks are reused.
+struct IRCompilerScope {
+  IRFunction fn;
+  IRBlock *current = nullptr;
+  std::vector<IRValue *> locals;
+
+  std::vector<std::map<std::string, IRValue *>> numbering{{}};
+  std::vector<std::map<int, IRValue *>> globals{{}};
+  std::vector<std::map<IRValue *, IRValue *>> known{{}};
+};
+
+// Compiles through the SSA form of `ir.hpp`: each function is lowered from
+// the AST, optimized, and then turned into the same bytecode as `Compiler`
+// generates, so the result runs on `VM`.
+//
+// While lowering, a pure operation whose operands and operator match a value
+// already computed in a dominating block reuses that value (global value
+// numbering). This also removes repeated `OpGetGlobal`, `OpGetFree` and
+// `OpCurrentClosure` loads, and a global read after `let` in the main
+// program uses the stored value. With constant folding, operations on
+// constants are folded, an `if` on a constant keeps only the branch taken,
+// and in the branch where `x == c` holds, `x` is the constant `c`.
+struct IRCompiler {
+  CompilerOptions options;
+  std::shared_ptr<SymbolTable> symbolTable;
+  std::vector<std::shared_ptr<Object>> constants;
+  ConstantIndex constantIndex;
+
+  std::vector<IRCompilerScope> scopes;
+  Instructions mainInstructions;
+  int mainNumLocals = 0;
+
+  std::vector<std::chrono::nanoseconds> passTimes =
+      std::vector<std::chrono::nanoseconds>(Compiler::passes().size());
+
+  // The IR of each function after optimization, when `options.dumpIR` is
+  // set. Nested functions come before the function that contains them.
+  std::string irDump;
+
+  IRCompiler(const CompilerOptions &options = CompilerOptions())
+      : options(options), symbolTable(symbol_table()) {
+    int i = 0;
+    for (const auto &[name, _] : BUILTINS) {
+      symbolTable->define_builtin(i, name);
+      i++;
+    }
+  }
+
+  IRCompiler(std::shared_ptr<SymbolTable> symbolTable,
+             const std::vector<std::shared_ptr<Object>> &constants,
+             const CompilerOptions &options = CompilerOptions())
+      : options(options), symbolTable(symbolTable), constants(constants) {}
+
+  // Compiles a whole program; call it once.
+  void compile(const std::shared_ptr<Ast> &ast) {
+    Compiler::PassTimer timer{nullptr, {}};
+    if (options.timePasses) {
+      timer = {&passTimes[SsaPass], std::chrono::steady_clock::now()};
+    }
+
+    enter_scope(0);
+    for (const auto &node : RegCompiler::statements(ast)) {
+      lower_statement(node, true);
+    }
+    if (scope().current) { scope().current->terminator = IREnd; }
+    auto fn = leave_scope();
+    mainNumLocals = generate(fn, mainInstructions);
+  }
+
+  Bytecode bytecode() {
+    return Bytecode{optimize(mainInstructions, false), constants,
+                    mainNumLocals, Compiler::global_count(symbolTable)};
+  }
+
+  Instructions optimize(const Instructions &ins, bool inFunction) {
+    auto out = ins;
+    const auto &all = Compiler::passes();
+    for (size_t i = 0; i < all.size(); i++) {
+      if (!all[i].rewrite || !(options.*all[i].enabled)) { continue; }
+      std::chrono::steady_clock::time_point start;
+      if (options.timePasses) { start = std::chrono::steady_clock::now(); }
+      out = all[i].rewrite(out, inFunction);
+      if (options.timePasses) {
+        passTimes[i] += std::chrono::steady_clock::now() - start;
+      }
+    }
+    return out;
+  }
+
+  //
+  // Lowering
+  //
+
+  IRCompilerScope &scope() { return scopes.back(); }
+
+  void enter_scope(int numParameters) {
+    scopes.emplace_back();
+    auto &s = scope();
+    s.fn.numParameters = numParameters;
+    s.current = s.fn.new_block();
+  }
+
+  IRFunction leave_scope() {
+    auto fn = std::move(scope().fn);
+    scopes.pop_back();
+    return fn;
+  }
+
+  void lower_statement(const std::shared_ptr<Ast> &ast, bool topLevel) {
+    using namespace peg::udl;
+
+    if (!scope().current) { return; }
+
+    switch (ast->tag) {
+    case "ASSIGNMENT"_: {
+      auto name = std::string(ast->nodes[0]->token);
+      auto symbol = symbolTable->define(name);
+      auto value = lower_expression(ast->nodes[1]);
+      if (!value) { break; }
+      if (symbol.scope == GlobalScope) {
+        auto set = add(IRSetGlobal, {value}, symbol.index);
+        set->type = value->type;
+        scope().globals.back()[symbol.index] = value;
+      } else {
+        set_local(symbol.index, value);
+      }
+      break;
+    }
+    case "RETURN"_: {
+      auto value = lower_expression(ast->nodes[0]);
+      if (value) { terminate(IRReturn, value); }
+      break;
+    }
+    case "EXPRESSION_STATEMENT"_: {
+      auto value = lower_expression(ast->nodes[0]);
+      if (value && topLevel) { add(IRPop, {value}); }
+      break;
+    }
+    default: lower_expression(ast); break;
+    }
+  }
+
+  // Defines the names bound by `let` in a branch that is never lowered, as
+  // `Compiler` does when it compiles that branch, so that uses after the
+  // `if` load null.
+  void define_bindings(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+
+    if (ast->tag == "FUNCTION"_) { return; }
+    if (ast->tag == "ASSIGNMENT"_) {
+      symbolTable->define(std::string(ast->nodes[0]->token));
+    }
+    for (const auto &node : ast->nodes) {
+      define_bindings(node);
+    }
+  }
+
+  // Returns the value of the last statement of a block, or nullptr if it
+  // isn't an expression statement.
+  IRValue *lower_block(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+
+    auto nodes = RegCompiler::statements(ast->nodes[0]);
+    if (nodes.empty()) { return nullptr; }
+
+    for (size_t i = 0; i + 1 < nodes.size(); i++) {
+      lower_statement(nodes[i], false);
+    }
+
+    const auto &last = nodes.back();
+    if (last->tag == "EXPRESSION_STATEMENT"_) {
+      if (!scope().current) { return nullptr; }
+      return lower_expression(last->nodes[0]);
+    }
+    lower_statement(last, false);
+    return nullptr;
+  }
+
+  // Returns nullptr if the expression never completes, because an `if` in it
+  // returns from the function in both branches.
+  IRValue *lower_expression(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+
+    if (!scope().current) { return nullptr; }
+
+    switch (ast->tag) {
+    case "IDENTIFIER"_: {
+      auto name = std::string(ast->token);
+      const auto &symbol = symbolTable->resolve(name);
+      if (!symbol) {
+        throw std::runtime_error(fmt::format("undefined variable {}", name));
+      }
+      return known_value(load_symbol(*symbol));
+    }
+    case "INFIX_EXPR"_: {
+      auto op = ast->nodes[1]->token;
+
+      if (op == "<") {
+        auto right = lower_expression(ast->nodes[2]);
+        auto left = right ? lower_expression(ast->nodes[0]) : nullptr;
+        if (!left) { return nullptr; }
+        return binary(OpGreaterThan, right, left);
+      }
+
+      auto left = lower_expression(ast->nodes[0]);
+      auto right = left ? lower_expression(ast->nodes[2]) : nullptr;
+      if (!right) { return nullptr; }
+
+      switch (peg::str2tag(op)) {
+      case "+"_: return binary(OpAdd, left, right);
+      case "-"_: return binary(OpSub, left, right);
+      case "*"_: return binary(OpMul, left, right);
+      case "/"_: return binary(OpDiv, left, right);
+      case ">"_: return binary(OpGreaterThan, left, right);
+      case "=="_: return binary(OpEqual, left, right);
+      case "!="_: return binary(OpNotEqual, left, right);
+      default:
+        throw std::runtime_error(fmt::format("unknown operator {}", op));
+      }
+    }
+    case "PREFIX_EXPR"_: {
+      int i = ast->nodes.size() - 1;
+      auto value = lower_expression(ast->nodes[i--]);
+      while (value && i >= 0) {
+        auto op = ast->nodes[i]->token;
+        switch (peg::str2tag(op)) {
+        case "!"_: value = unary(OpBang, value); break;
+        case "-"_: value = unary(OpMinus, value); break;
+        default:
+          throw std::runtime_error(fmt::format("unknown operator {}", op));
+        }
+        i--;
+      }
+      return value;
+    }
+    case "IF"_: return lower_if(ast);
+    case "INTEGER"_: return constant(make_integer(ast->to_integer()));
+    case "BOOLEAN"_: return constant(make_bool(ast->to_bool()));
+    case "STRING"_: return constant(make_string(ast->token));
+    case "ARRAY"_: {
+      std::vector<IRValue *> elements;
+      for (const auto &node : ast->nodes) {
+        elements.push_back(lower_expression(node));
+        if (!elements.back()) { return nullptr; }
+      }
+      auto array = add(IRArray, elements);
+      array->type = ArrayType;
+      return array;
+    }
+    case "HASH"_: {
+      std::vector<IRValue *> elements;
+      for (const auto &node : ast->nodes) {
+        for (const auto &child : node->nodes) {
+          elements.push_back(lower_expression(child));
+          if (!elements.back()) { return nullptr; }
+        }
+      }
+      auto hash = add(IRHash, elements);
+      hash->type = HashType;
+      return hash;
+    }
+    case "CALL"_: {
+      auto value = lower_expression(ast->nodes[0]);
+      for (auto i = 1u; value && i < ast->nodes.size(); i++) {
+        auto postfix = ast->nodes[i];
+        switch (postfix->original_tag) {
+        case "INDEX"_: {
+          auto index = lower_expression(postfix->nodes[0]);
+          value = index ? numbered(IRIndex, {value, index}) : nullptr;
+          break;
+        }
+        case "ARGUMENTS"_: {
+          std::vector<IRValue *> args{value};
+          for (const auto &node : postfix->nodes) {
+            args.push_back(lower_expression(node));
+            if (!args.back()) { return nullptr; }
+          }
+          value = add(IRCall, args);
+          break;
+        }
+        }
+      }
+      return value;
+    }
+    case "FUNCTION"_: return lower_function(ast);
+    default: return constant(CONST_NULL);
+    }
+  }
+
+  IRValue *lower_if(const std::shared_ptr<Ast> &ast) {
+    auto condition = lower_expression(ast->nodes[0]);
+    if (!condition) { return nullptr; }
+
+    if (options.constantFolding && condition->op == IRConst) {
+      // The branches bind their names in order, as if both were lowered.
+      if (!is_truthy(condition->constant)) {
+        define_bindings(ast->nodes[1]);
+        if (ast->nodes.size() < 3) { return constant(CONST_NULL); }
+        return value_or_null(lower_block(ast->nodes[2]));
+      }
+      auto value = value_or_null(lower_block(ast->nodes[1]));
+      if (ast->nodes.size() > 2) { define_bindings(ast->nodes[2]); }
+      return value;
+    }
+
+    auto &s = scope();
+    auto conditionBlock = s.current;
+    auto saved = s.locals;
+
+    auto thenBlock = s.fn.new_block();
+    enter_branch(condition, true);
+    s.current = thenBlock;
+    auto thenValue = value_or_null(lower_block(ast->nodes[1]));
+    auto thenEnd = s.current;
+    auto thenLocals = s.locals;
+    leave_branch();
+
+    s.locals = saved;
+    auto elseBlock = s.fn.new_block();
+    enter_branch(condition, false);
+    s.current = elseBlock;
+    auto elseValue = ast->nodes.size() < 3
+                         ? constant(CONST_NULL)
+                         : value_or_null(lower_block(ast->nodes[2]));
+    auto elseEnd = s.current;
+    auto elseLocals = s.locals;
+    leave_branch();
+
+    conditionBlock->terminator = IRBranch;
+    conditionBlock->operand = condition;
+    conditionBlock->targets[0] = thenBlock;
+    conditionBlock->targets[1] = elseBlock;
+    thenBlock->preds.push_back(conditionBlock);
+    elseBlock->preds.push_back(conditionBlock);
+
+    if (!thenEnd && !elseEnd) {
+      s.current = nullptr;
+      return nullptr;
+    }
+
+    // If only one branch continues, the code after the `if` follows it.
+    if (!thenEnd || !elseEnd) {
+      s.current = thenEnd ? thenEnd : elseEnd;
+      s.locals = thenEnd ? thenLocals : elseLocals;
+      return thenEnd ? thenValue : elseValue;
+    }
+
+    auto join = s.fn.new_block();
+    for (auto end : {thenEnd, elseEnd}) {
+      end->terminator = IRJump;
+      end->targets[0] = join;
+      join->preds.push_back(end);
+    }
+    s.current = join;
+
+    s.locals.resize(std::max(thenLocals.size(), elseLocals.size()));
+    thenLocals.resize(s.locals.size());
+    elseLocals.resize(s.locals.size());
+    for (size_t i = 0; i < s.locals.size(); i++) {
+      if (!thenLocals[i] && !elseLocals[i]) { continue; }
+      s.locals[i] = merge(join, value_or_null(thenLocals[i]),
+                          value_or_null(elseLocals[i]));
+    }
+    return merge(join, thenValue, elseValue);
+  }
+
+  IRValue *lower_function(const std::shared_ptr<Ast> &ast) {
+    auto parameters = ast->nodes[0];
+    auto numParameters = static_cast<int>(parameters->nodes.size());
+
+    symbolTable = enclosed_symbol_table(symbolTable);
+    enter_scope(numParameters);
+    if (ast->value.has_value()) {
+      symbolTable->define_function_name(ast->to_string());
+    }
+    for (auto node : parameters->nodes) {
+      auto symbol = symbolTable->define(std::string(node->token));
+      set_local(symbol.index, numbered(IRParam, {}, symbol.index));
+    }
+
+    auto value = lower_block(ast->nodes[1]);
+    if (scope().current) {
+      if (value) {
+        terminate(IRReturn, value);
+      } else {
+        terminate(IRReturnNull, nullptr);
+      }
+    }
+
+    auto freeSymbols = symbolTable->freeSymbols;
+    auto fn = leave_scope();
+    symbolTable = symbolTable->outer;
+
+    Instructions instructions;
+    auto numLocals = generate(fn, instructions);
+    auto compiledFn = make_compiled_function(
+        {optimize(instructions, true)}, numLocals, numParameters);
+    if (options.lambdaLifting && freeSymbols.empty()) {
+      auto fn = std::static_pointer_cast<CompiledFunction>(compiledFn);
+      auto closure = constant(std::make_shared<Closure>(fn));
+      closure->type = FunctionType;
+      return closure;
+    }
+    auto fnIndex = add_constant(compiledFn);
+
+    std::vector<IRValue *> free;
+    for (const auto &symbol : freeSymbols) {
+      free.push_back(load_symbol(symbol));
+    }
+    auto closure = add(IRClosure, free, fnIndex);
+    closure->type = FunctionType;
+    return closure;
+  }
+
+  IRValue *load_symbol(const Symbol &s) {
+    if (s.scope == GlobalScope) {
+      auto &known = scope().globals;
+      for (auto it = known.rbegin(); it != known.rend(); ++it) {
+        auto found = it->find(s.index);
+        if (found != it->end()) { return found->second; }
+      }
+      auto value = numbered(IRGetGlobal, {}, s.index);
+      known.back()[s.index] = value;
+      return value;
+    } else if (s.scope == LocalScope) {
+      auto &locals = scope().locals;
+      auto index = static_cast<size_t>(s.index);
+      return index < locals.size() && locals[index] ? locals[index]
+                                                    : constant(CONST_NULL);
+    } else if (s.scope == BuiltinScope) {
+      return numbered(IRGetBuiltin, {}, s.index);
+    } else if (s.scope == FreeScope) {
+      return numbered(IRGetFree, {}, s.index);
+    } else {
+      auto closure = numbered(IRCurrentClosure, {});
+      closure->type = FunctionType;
+      return closure;
+    }
+  }
+
+  void set_local(int index, IRValue *value) {
+    auto &locals = scope().locals;
+    if (static_cast<size_t>(index) >= locals.size()) {
+      locals.resize(index + 1);
+    }
+    locals[index] = value;
+  }
+
+  // Inside a branch, what the branch condition tells about `condition`'s
+  // operands: if `x == c` holds, `x` is `c`. Only integers and booleans are
+  // comparable, so this is exact.
+  void enter_branch(IRValue *condition, bool taken) {
+    auto &s = scope();
+    s.numbering.emplace_back();
+    s.globals.emplace_back();
+    s.known.emplace_back();
+
+    if (!options.constantFolding || condition->op != IRBinary) { return; }
+    auto op = condition->opecode;
+    if (!((op == OpEqual && taken) || (op == OpNotEqual && !taken))) {
+      return;
+    }
+    auto left = condition->args[0];
+    auto right = condition->args[1];
+    if (left->op == IRConst) { std::swap(left, right); }
+    if (right->op == IRConst && left->op != IRConst &&
+        (right->type == IntegerType || right->type == BooleanType)) {
+      s.known.back()[left] = right;
+    }
+  }
+
+  void leave_branch() {
+    auto &s = scope();
+    s.numbering.pop_back();
+    s.globals.pop_back();
+    s.known.pop_back();
+  }
+
+  IRValue *known_value(IRValue *value) {
+    const auto &known = scope().known;
+    for (auto it = known.rbegin(); it != known.rend(); ++it) {
+      auto found = it->find(value);
+      if (found != it->end()) { return found->second; }
+    }
+    return value;
+  }
+
+  IRValue *value_or_null(IRValue *value) {
+    if (!scope().current) { return nullptr; }
+    return value ? value : constant(CONST_NULL);
+  }
+
+  IRValue *merge(IRBlock *join, IRValue *thenValue, IRValue *elseValue) {
+    if (thenValue == elseValue) { return thenValue; }
+    auto phi = scope().fn.new_value(IRPhi, join);
+    phi->args = {thenValue, elseValue};
+    phi->type = thenValue->type == elseValue->type ? thenValue->type : AnyType;
+    auto &values = join->values;
+    auto it = std::find_if(values.begin(), values.end(),
+                           [](auto v) { return v->op != IRPhi; });
+    values.insert(it, phi);
+    return phi;
+  }
+
+  void terminate(IRTerminator terminator, IRValue *operand) {
+    auto &s = scope();
+    s.current->terminator = terminator;
+    s.current->operand = operand;
+    s.current = nullptr;
+  }
+
+  IRValue *add(IROp op, const std::vector<IRValue *> &args, int index = 0,
+               Opecode opecode = 0) {
+    auto &s = scope();
+    auto v = s.fn.new_value(op, s.current);
+    v->args = args;
+    v->index = index;
+    v->opecode = opecode;
+    s.current->values.push_back(v);
+    return v;
+  }
+
+  // Adds a pure operation, or returns the value an identical one computed
+  // in a dominating block.
+  IRValue *numbered(IROp op, const std::vector<IRValue *> &args,
+                    int index = 0, Opecode opecode = 0,
+                    const std::string &constantKey = "") {
+    auto key = fmt::format("{}:{}:{}:{}", op, index, opecode, constantKey);
+    for (auto arg : args) {
+      key += fmt::format(":{}", arg->id);
+    }
+
+    auto &numbering = scope().numbering;
+    for (auto it = numbering.rbegin(); it != numbering.rend(); ++it) {
+      auto found = it->find(key);
+      if (found != it->end()) { return found->second; }
+    }
+    auto v = add(op, args, index, opecode);
+    numbering.back()[key] = v;
+    return v;
+  }
+
+  IRValue *constant(const std::shared_ptr<Object> &obj) {
+    auto v = numbered(IRConst, {}, 0, 0,
+                      fmt::format("{}:{}", obj->type(), obj->inspect()));
+    if (!v->constant) {
+      v->constant = obj;
+      v->type = ir_type(obj);
+    }
+    return v;
+  }
+
+  IRValue *binary(Opecode op, IRValue *left, IRValue *right) {
+    if (options.constantFolding && left->op == IRConst &&
+        right->op == IRConst) {
+      auto value = Compiler::fold_infix_expression(
+          operator_name(op), left->constant, right->constant);
+      if (value) { return constant(value); }
+    }
+
+    auto v = numbered(IRBinary, {left, right}, 0, op);
+    auto l = left->type;
+    auto r = right->type;
+    switch (op) {
+    case OpAdd:
+      if (l == IntegerType && r == IntegerType) { v->type = IntegerType; }
+      if (l == StringType && r == StringType) { v->type = StringType; }
+      break;
+    case OpSub:
+    case OpMul:
+    case OpDiv:
+      if (l == IntegerType && r == IntegerType) { v->type = IntegerType; }
+      break;
+    default: v->type = BooleanType; break;
+    }
+    return v;
+  }
+
+  IRValue *unary(Opecode op, IRValue *operand) {
+    if (options.constantFolding && operand->op == IRConst) {
+      auto value = Compiler::fold_prefix_expression(
+          op == OpBang ? "!" : "-", operand->constant);
+      if (value) { return constant(value); }
+    }
+
+    auto v = numbered(IRUnary, {operand}, 0, op);
+    if (op == OpBang) {
+      v->type = BooleanType;
+    } else if (operand->type == IntegerType) {
+      v->type = IntegerType;
+    }
+    return v;
+  }
+
+  static const char *operator_name(Opecode op) {
+    switch (op) {
+    case OpAdd: return "+";
+    case OpSub: return "-";
+    case OpMul: return "*";
+    case OpDiv: return "/";
+    case OpEqual: return "==";
+    case OpNotEqual: return "!=";
+    default: return ">";
+    }
+  }
+
+  static bool is_truthy(const std::shared_ptr<Object> &obj) {
+    if (obj->type() == BOOLEAN_OBJ) { return cast<Boolean>(obj).value; }
+    return obj->type() != NULL_OBJ;
+  }
+
+  int add_constant(std::shared_ptr<Object> obj) {
+    return constantIndex.add(constants, obj);
+  }
+
+  //
+  // Optimization
+  //
+
+  // True if dropping the value can't hide an error or a side effect.
+  static bool is_removable(const IRValue &v) {
+    auto integers = [&]() {
+      return v.args[0]->type == IntegerType && v.args[1]->type == IntegerType;
+    };
+    switch (v.op) {
+    case IRConst:
+    case IRParam:
+    case IRGetGlobal:
+    case IRGetBuiltin:
+    case IRGetFree:
+    case IRCurrentClosure:
+    case IRArray:
+    case IRClosure:
+    case IRPhi: return true;
+    case IRUnary: return v.opecode == OpBang || v.type == IntegerType;
+    case IRBinary:
+      switch (v.opecode) {
+      case OpAdd: return v.type != AnyType;
+      case OpSub:
+      case OpMul:
+      case OpGreaterThan: return integers();
+      case OpEqual:
+      case OpNotEqual:
+        return integers() || (v.args[0]->type == BooleanType &&
+                              v.args[1]->type == BooleanType);
+      default: return false;
+      }
+    default: return false;
+    }
+  }
+
+  static std::map<IRValue *, int> count_uses(const IRFunction &fn) {
+    std::map<IRValue *, int> uses;
+    for (const auto &block : fn.blocks) {
+      for (auto v : block->values) {
+        if (v->dead) { continue; }
+        for (auto arg : v->args) {
+          uses[arg]++;
+        }
+      }
+      if (block->operand) { uses[block->operand]++; }
+    }
+    return uses;
+  }
+
+  static void eliminate_dead_values(IRFunction &fn) {
+    for (;;) {
+      auto uses = count_uses(fn);
+      auto changed = false;
+      for (const auto &v : fn.values) {
+        if (!v->dead && !uses[v.get()] && is_removable(*v)) {
+          v->dead = true;
+          changed = true;
+        }
+      }
+      if (!changed) { return; }
+    }
+  }
+
+  //
+  // Code generation
+  //
+
+  static bool is_load(const IRValue *v) {
+    switch (v->op) {
+    case IRConst:
+    case IRParam:
+    case IRGetGlobal:
+    case IRGetBuiltin:
+    case IRGetFree:
+    case IRCurrentClosure: return true;
+    default: return false;
+    }
+  }
+
+  // The constant index of the lifted closure that `call` calls, if it takes
+  // as many arguments as the call passes and was loaded as a constant.
+  static std::optional<int>
+  known_callee(const IRValue &call,
+               const std::map<const Object *, int> &constantIndexes) {
+    auto callee = call.args[0];
+    if (callee->op != IRConst || callee->constant->type() != CLOSURE_OBJ) {
+      return std::nullopt;
+    }
+    const auto &fn = cast<Closure>(callee->constant).fn;
+    auto it = constantIndexes.find(callee->constant.get());
+    if (it == constantIndexes.end() ||
+        fn->numParameters != static_cast<int>(call.args.size()) - 1) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  // Generates the instructions of `fn` and returns its number of locals.
+  //
+  // A value used once, later in the block that computes it, stays on the
+  // stack until its use if the values computed in between are consumed
+  // first. So does a phi used once in its block, with each predecessor
+  // leaving its operand on the stack. Constants and loads of parameters,
+  // builtins, free variables and globals the function doesn't store are
+  // emitted again at every use. Any other value is stored in a local slot of
+  // its own.
+  int generate(IRFunction &fn, Instructions &out) {
+    if (options.deadCode) { eliminate_dead_values(fn); }
+    if (options.dumpIR) { irDump += to_string(fn); }
+
+    std::set<int> storedGlobals;
+    for (const auto &v : fn.values) {
+      if (!v->dead && v->op == IRSetGlobal) { storedGlobals.insert(v->index); }
+    }
+    std::set<IRValue *> copies;
+    auto rematerialized = [&](IRValue *v) {
+      if (!is_load(v) || copies.count(v)) { return false; }
+      return v->op != IRGetGlobal || !storedGlobals.count(v->index);
+    };
+    copies = schedule_loads(fn, rematerialized);
+
+    // Where each value is used, if it is used once.
+    auto uses = count_uses(fn);
+    std::map<IRValue *, IRBlock *> useBlock;
+    for (const auto &block : fn.blocks) {
+      for (auto v : block->values) {
+        if (v->dead) { continue; }
+        for (size_t i = 0; i < v->args.size(); i++) {
+          useBlock[v->args[i]] =
+              v->op == IRPhi ? v->block->preds[i] : block.get();
+        }
+      }
+      if (block->operand) { useBlock[block->operand] = block.get(); }
+    }
+
+    std::set<IRValue *> stacked;
+    for (const auto &block : fn.blocks) {
+      auto hasStackedPhi = false;
+      for (auto v : block->values) {
+        if (v->dead || rematerialized(v) || uses[v] != 1 ||
+            useBlock[v] != block.get()) {
+          continue;
+        }
+        if (v->op == IRPhi) {
+          if (hasStackedPhi) { continue; }
+          hasStackedPhi = true;
+        }
+        stacked.insert(v);
+      }
+    }
+    while (simulate(fn, stacked)) {}
+
+    std::map<IRValue *, int> slots;
+    auto numLocals = fn.numParameters;
+    for (const auto &v : fn.values) {
+      if (!v->dead && uses[v.get()] && !stacked.count(v.get()) &&
+          !rematerialized(v.get())) {
+        slots[v.get()] = numLocals++;
+      }
+    }
+
+    std::map<const Object *, int> constantIndexes;
+    auto emit = [&](Opecode op, const std::vector<int> &operands) {
+      auto ins = make(op, operands);
+      out.insert(out.end(), ins.begin(), ins.end());
+    };
+    auto push = [&](IRValue *v) {
+      switch (v->op) {
+      case IRConst:
+        switch (v->constant->type()) {
+        case BOOLEAN_OBJ:
+          emit(cast<Boolean>(v->constant).value ? OpTrue : OpFalse, {});
+          break;
+        case NULL_OBJ: emit(OpNull, {}); break;
+        default: {
+          auto it = constantIndexes.find(v->constant.get());
+          if (it == constantIndexes.end()) {
+            it = constantIndexes
+                     .emplace(v->constant.get(), add_constant(v->constant))
+                     .first;
+          }
+          emit(OpConstant, {it->second});
+          break;
+        }
+        }
+        break;
+      case IRParam: emit(OpGetLocal, {v->index}); break;
+      case IRGetGlobal: emit(OpGetGlobal, {v->index}); break;
+      case IRGetBuiltin: emit(OpGetBuiltin, {v->index}); break;
+      case IRGetFree: emit(OpGetFree, {v->index}); break;
+      default: emit(OpCurrentClosure, {}); break;
+      }
+    };
+    auto load = [&](IRValue *v) {
+      if (stacked.count(v)) { return; }
+      if (rematerialized(v)) {
+        push(v);
+      } else {
+        emit(OpGetLocal, {slots[v]});
+      }
+    };
+
+    std::vector<std::pair<size_t, IRBlock *>> jumps;
+    std::vector<size_t> offsets(fn.blocks.size());
+    auto jump = [&](Opecode op, IRBlock *target) {
+      jumps.emplace_back(out.size(), target);
+      emit(op, {9999});
+    };
+
+    for (size_t b = 0; b < fn.blocks.size(); b++) {
+      auto block = fn.blocks[b].get();
+      auto next = b + 1 < fn.blocks.size() ? fn.blocks[b + 1].get() : nullptr;
+      offsets[b] = out.size();
+
+      for (auto v : block->values) {
+        if (v->dead || v->op == IRPhi || rematerialized(v)) { continue; }
+        for (auto arg : v->args) {
+          load(arg);
+        }
+
+        auto numArgs = static_cast<int>(v->args.size());
+        switch (v->op) {
+        case IRSetGlobal: emit(OpSetGlobal, {v->index}); break;
+        case IRBinary: emit(binary_opecode(*v), {}); break;
+        case IRUnary: emit(v->opecode, {}); break;
+        case IRArray: emit(OpArray, {numArgs}); break;
+        case IRHash: emit(OpHash, {numArgs}); break;
+        case IRIndex: emit(OpIndex, {}); break;
+        case IRCall: {
+          auto known = known_callee(*v, constantIndexes);
+          if (known) {
+            emit(OpCallKnown, {*known, numArgs - 1});
+          } else {
+            emit(OpCall, {numArgs - 1});
+          }
+          break;
+        }
+        case IRClosure: emit(OpClosure, {v->index, numArgs}); break;
+        case IRPop: emit(OpPop, {}); break;
+        default: push(v); break;
+        }
+
+        if (v->op == IRSetGlobal || v->op == IRPop) { continue; }
+        if (!uses[v]) {
+          emit(OpPop, {});
+        } else if (!stacked.count(v)) {
+          emit(OpSetLocal, {slots[v]});
+        }
+      }
+
+      switch (block->terminator) {
+      case IRJump: {
+        auto target = block->targets[0];
+        auto pred = pred_index(target, block);
+        IRValue *carried = nullptr;
+        for (auto phi : target->values) {
+          if (phi->op != IRPhi || phi->dead) { continue; }
+          if (stacked.count(phi)) {
+            carried = phi->args[pred];
+            continue;
+          }
+          if (!uses[phi]) {
+            if (stacked.count(phi->args[pred])) { emit(OpPop, {}); }
+            continue;
+          }
+          load(phi->args[pred]);
+          emit(OpSetLocal, {slots[phi]});
+        }
+        if (carried) { load(carried); }
+        if (target != next) { jump(OpJump, target); }
+        break;
+      }
+      case IRBranch: {
+        load(block->operand);
+        auto thenBlock = block->targets[0];
+        auto elseBlock = block->targets[1];
+        if (thenBlock == next) {
+          jump(OpJumpNotTruthy, elseBlock);
+        } else if (elseBlock == next) {
+          jump(OpJumpTruthy, thenBlock);
+        } else {
+          jump(OpJumpNotTruthy, elseBlock);
+          jump(OpJump, thenBlock);
+        }
+        break;
+      }
+      case IRReturn:
+        load(block->operand);
+        emit(OpReturnValue, {});
+        break;
+      case IRReturnNull: emit(OpReturn, {}); break;
+      default: break;
+      }
+    }
+
+    std::map<size_t, int> farJumps;
+    for (const auto &[pos, target] : jumps) {
+      auto offset = static_cast<int>(offsets[target->id]);
+      if (!fits(lookup(out[pos]).operand_widths, {offset})) {
+        farJumps[pos] = offset;
+        continue;
+      }
+      auto ins = make(out[pos], {offset});
+      std::copy(ins.begin(), ins.end(), out.begin() + pos);
+    }
+    if (!farJumps.empty()) { out = widen_jumps(out, farJumps); }
+    return numLocals;
+  }
+
+  // With type inference, the unchecked integer form of the operator when
+  // both operands are known to be integers, and the checked one when one is
+  // and the other may be one, as in `Compiler`.
+  Opecode binary_opecode(const IRValue &v) const {
+    if (!options.typeInference) { return v.opecode; }
+    auto l = v.args[0]->type;
+    auto r = v.args[1]->type;
+    auto may_be_integer = [](IRType t) {
+      return t == IntegerType || t == AnyType;
+    };
+    if (l == IntegerType && r == IntegerType) {
+      return unchecked_integer_opecode(v.opecode);
+    }
+    if (may_be_integer(l) && may_be_integer(r) &&
+        (l == IntegerType || r == IntegerType)) {
+      return integer_opecode(v.opecode);
+    }
+    return v.opecode;
+  }
+
+  // Gives an operation a copy of each load it would otherwise emit after
+  // computing a later operand, placed where that operand starts, so that the
+  // operands can stay on the stack. Returns the copies.
+  template <typename T>
+  static std::set<IRValue *> schedule_loads(IRFunction &fn,
+                                            T rematerialized) {
+    std::set<IRValue *> copies;
+    for (const auto &block : fn.blocks) {
+      auto &values = block->values;
+      std::map<IRValue *, size_t> position;
+      for (size_t i = 0; i < values.size(); i++) {
+        if (!values[i]->dead && values[i]->op != IRPhi) {
+          position[values[i]] = i;
+        }
+      }
+      auto computed_at = [&](IRValue *v) {
+        auto it = position.find(v);
+        return it == position.end() || rematerialized(v) ? values.size()
+                                                          : it->second;
+      };
+
+      // Copies are inserted before `values[first]`; those of an operation
+      // go before those of the operations it contains.
+      std::vector<std::tuple<size_t, size_t, IRValue *>> inserts;
+      for (size_t i = 0; i < values.size(); i++) {
+        auto v = values[i];
+        if (v->dead || v->op == IRPhi) { continue; }
+        for (size_t k = 0; k < v->args.size(); k++) {
+          if (!rematerialized(v->args[k])) { continue; }
+          auto first = values.size();
+          for (size_t j = k + 1; j < v->args.size(); j++) {
+            first = std::min(first, computed_at(v->args[j]));
+          }
+          if (first == values.size()) { continue; }
+          auto ordered = true;
+          for (size_t j = 0; j < k; j++) {
+            auto at = computed_at(v->args[j]);
+            if (at != values.size() && at > first) { ordered = false; }
+          }
+          if (!ordered) { continue; }
+
+          auto copy = fn.new_value(v->args[k]->op, block.get());
+          copy->type = v->args[k]->type;
+          copy->index = v->args[k]->index;
+          copy->constant = v->args[k]->constant;
+          v->args[k] = copy;
+          copies.insert(copy);
+          inserts.emplace_back(first, values.size() - i, copy);
+        }
+      }
+
+      std::stable_sort(inserts.begin(), inserts.end());
+      for (auto it = inserts.rbegin(); it != inserts.rend(); ++it) {
+        values.insert(values.begin() + std::get<0>(*it), std::get<2>(*it));
+      }
+    }
+    return copies;
+  }
+
+  static size_t pred_index(const IRBlock *block, const IRBlock *pred) {
+    auto it = std::find(block->preds.begin(), block->preds.end(), pred);
+    return it - block->preds.begin();
+  }
+
+  // Runs the stack through the code `generate` would emit, and takes values
+  // off the stack where the order of the operands on it doesn't match their
+  // uses. Returns true if it did, so that it runs again.
+  static bool simulate(const IRFunction &fn, std::set<IRValue *> &stacked) {
+    std::vector<IRValue *> pending;
+
+    // The stacked operands must be the first ones, in order, on top of the
+    // stack; the others are loaded after them.
+    auto consume = [&](const std::vector<IRValue *> &operands) {
+      size_t count = 0;
+      while (count < operands.size() && stacked.count(operands[count])) {
+        count++;
+      }
+      auto ok = count <= pending.size();
+      for (size_t i = count; ok && i < operands.size(); i++) {
+        if (stacked.count(operands[i])) { ok = false; }
+      }
+      for (size_t i = 0; ok && i < count; i++) {
+        if (pending[pending.size() - count + i] != operands[i]) { ok = false; }
+      }
+      if (ok) {
+        pending.resize(pending.size() - count);
+        return true;
+      }
+      for (auto operand : operands) {
+        stacked.erase(operand);
+      }
+      return false;
+    };
+
+    for (const auto &block : fn.blocks) {
+      pending.clear();
+      for (auto v : block->values) {
+        if (v->op == IRPhi && stacked.count(v)) { pending.push_back(v); }
+      }
+
+      for (auto v : block->values) {
+        if (v->dead || v->op == IRPhi) { continue; }
+        if (!consume(v->args)) { return true; }
+        if (stacked.count(v)) { pending.push_back(v); }
+      }
+
+      switch (block->terminator) {
+      case IRJump: {
+        auto target = block->targets[0];
+        auto pred = pred_index(target, block.get());
+        IRValue *carried = nullptr;
+        for (auto phi : target->values) {
+          if (phi->op != IRPhi || phi->dead) { continue; }
+          if (stacked.count(phi)) {
+            carried = phi->args[pred];
+          } else if (!consume({phi->args[pred]})) {
+            return true;
+          }
+        }
+        if (carried && !consume({carried})) { return true; }
+        break;
+      }
+      case IRBranch:
+      case IRReturn:
+        if (!consume({block->operand})) { return true; }
+        break;
+      default: break;
+      }
+
+      if (!pending.empty()) {
+        for (auto v : pending) {
+          stacked.erase(v);
+        }
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+} // namespace monkey
@@ -0,0 +1,652 @@
+#pragma once
+
+#include <code.hpp>
+#include <cstring>
+#include <object.hpp>
+
+#if !defined(MONKEY_NO_JIT) && defined(__x86_64__) &&                          \
+    (defined(__linux__) || defined(__APPLE__))
+#define MONKEY_JIT 1
+#include <sys/mman.h>
+#else
+#define MONKEY_JIT 0
+#endif
+
+namespace monkey {
+
+// The VM state native code runs against. Native code shares the
+// interpreter's stack layout, so it can stop before any instruction and let
+// the interpreter carry on from there.
+struct JitFrame {
+  Value *top; // one past the top of the stack; written back on exit
+  Value *bp;
+  const Value *constants;
+  Value *globals;
+  const Value *free;
+  Value *lastPopped; // `VM::lastPopped`
+};
+
+#if MONKEY_JIT
+
+// A function's native code. `run` starts at instruction `ip` and returns the
+// index of the first instruction it didn't run.
+struct JitCode {
+  using Entry = size_t (*)(JitFrame *frame, size_t ip);
+
+  JitCode() = default;
+  JitCode(const JitCode &) = delete;
+  JitCode &operator=(const JitCode &) = delete;
+
+  ~JitCode() {
+    if (memory) { munmap(memory, size); }
+  }
+
+  size_t run(JitFrame &frame, size_t ip) const { return entry(&frame, ip); }
+
+  void *memory = nullptr;
+  size_t size = 0;
+  Entry entry = nullptr;
+
+  // The native address of each instruction, for entering mid-function.
+  std::vector<uintptr_t> entries;
+};
+
+// Just the x86-64 encodings the JIT uses. Memory operands are always
+// `[base + disp32]`.
+struct Assembler {
+  enum Reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+  };
+
+  enum Cond { E = 0x4, NE = 0x5, BE = 0x6, A = 0x7, LE = 0xE, G = 0xF };
+
+  std::vector<uint8_t> code;
+
+  size_t new_label() {
+    labels.push_back(Unbound);
+    return labels.size() - 1;
+  }
+
+  void bind(size_t label) { labels[label] = code.size(); }
+
+  size_t offset(size_t label) const { return labels[label]; }
+
+  // Resolves the jumps to labels.
+  void finish() {
+    for (const auto &[at, label] : fixups) {
+      auto rel = static_cast<int32_t>(labels[label] - (at + 4));
+      std::memcpy(&code[at], &rel, 4);
+    }
+    fixups.clear();
+  }
+
+  void mov(Reg dst, Reg base, int32_t disp) { mem(true, {0x8B}, dst, base, disp); }
+  void mov(Reg base, int32_t disp, Reg src) { mem(true, {0x89}, src, base, disp); }
+  void mov32(Reg dst, Reg base, int32_t disp) { mem(false, {0x8B}, dst, base, disp); }
+  void mov32(Reg base, int32_t disp, Reg src) { mem(false, {0x89}, src, base, disp); }
+
+  void mov32_imm(Reg base, int32_t disp, int32_t imm) {
+    mem(false, {0xC7}, 0, base, disp);
+    emit32(imm);
+  }
+
+  void mov_imm(Reg dst, uint64_t imm) {
+    rex(true, 0, dst);
+    emit8(0xB8 + (dst & 7));
+    emit64(imm);
+  }
+
+  void mov32_imm(Reg dst, uint32_t imm) {
+    if (dst >= R8) { emit8(0x41); }
+    emit8(0xB8 + (dst & 7));
+    emit32(imm);
+  }
+
+  void mov(Reg dst, Reg src) { reg(true, {0x89}, src, dst); }
+  void lea(Reg dst, Reg base, int32_t disp) { mem(true, {0x8D}, dst, base, disp); }
+
+  void add(Reg dst, Reg base, int32_t disp) { mem(true, {0x03}, dst, base, disp); }
+  void sub(Reg dst, Reg base, int32_t disp) { mem(true, {0x2B}, dst, base, disp); }
+  void imul(Reg dst, Reg base, int32_t disp) { mem(true, {0x0F, 0xAF}, dst, base, disp); }
+  void cmp(Reg lhs, Reg base, int32_t disp) { mem(true, {0x3B}, lhs, base, disp); }
+  void add(Reg dst, Reg src) { reg(true, {0x01}, src, dst); }
+  void sub(Reg dst, Reg src) { reg(true, {0x29}, src, dst); }
+  void cmp(Reg lhs, Reg rhs) { reg(true, {0x39}, rhs, lhs); }
+  void test(Reg lhs, Reg rhs) { reg(true, {0x85}, rhs, lhs); }
+  void neg(Reg base, int32_t disp) { mem(true, {0xF7}, 3, base, disp); }
+
+  void add_imm(Reg dst, int32_t imm) { reg_imm(true, 0, dst, imm); }
+  void sub_imm(Reg dst, int32_t imm) { reg_imm(true, 5, dst, imm); }
+  void xor_imm(Reg dst, int32_t imm) { reg_imm(true, 6, dst, imm); }
+  void cmp_imm(Reg lhs, int32_t imm) { reg_imm(true, 7, lhs, imm); }
+  void cmp32_imm(Reg lhs, int32_t imm) { reg_imm(false, 7, lhs, imm); }
+
+  void cmp32_imm(Reg base, int32_t disp, int32_t imm) {
+    mem(false, {0x81}, 7, base, disp);
+    emit32(imm);
+  }
+
+  void cmp_imm(Reg base, int32_t disp, int32_t imm) {
+    mem(true, {0x81}, 7, base, disp);
+    emit32(imm);
+  }
+
+  // `al = cc; eax = zero-extended al`
+  void setcc(Cond cc) {
+    emit({0x0F, static_cast<uint8_t>(0x90 + cc), 0xC0});
+    emit({0x0F, 0xB6, 0xC0});
+  }
+
+  void cqo() { emit({0x48, 0x99}); }
+  void idiv(Reg divisor) { reg(true, {0xF7}, 7, divisor); }
+
+  void push(Reg r) {
+    if (r >= R8) { emit8(0x41); }
+    emit8(0x50 + (r & 7));
+  }
+
+  void pop(Reg r) {
+    if (r >= R8) { emit8(0x41); }
+    emit8(0x58 + (r & 7));
+  }
+
+  void call(Reg target) { reg(false, {0xFF}, 2, target); }
+  void ret() { emit8(0xC3); }
+
+  // `jmp [rax + rsi * 8]`
+  void jmp_table_rax_rsi() { emit({0xFF, 0x24, 0xF0}); }
+
+  void jmp(size_t label) {
+    emit8(0xE9);
+    fixup(label);
+  }
+
+  void jcc(Cond cc, size_t label) {
+    emit({0x0F, static_cast<uint8_t>(0x80 + cc)});
+    fixup(label);
+  }
+
+private:
+  static constexpr size_t Unbound = static_cast<size_t>(-1);
+
+  std::vector<size_t> labels;
+  std::vector<std::pair<size_t, size_t>> fixups;
+
+  void emit8(uint8_t b) { code.push_back(b); }
+
+  void emit(std::initializer_list<uint8_t> bytes) {
+    code.insert(code.end(), bytes.begin(), bytes.end());
+  }
+
+  void emit32(uint32_t n) {
+    for (auto i = 0; i < 4; i++) {
+      emit8(static_cast<uint8_t>(n >> (i * 8)));
+    }
+  }
+
+  void emit64(uint64_t n) {
+    emit32(static_cast<uint32_t>(n));
+    emit32(static_cast<uint32_t>(n >> 32));
+  }
+
+  void fixup(size_t label) {
+    fixups.emplace_back(code.size(), label);
+    emit32(0);
+  }
+
+  void rex(bool w, int r, int b) {
+    uint8_t byte = 0x40 | (w << 3) | ((r >> 3) << 2) | (b >> 3);
+    if (byte != 0x40) { emit8(byte); }
+  }
+
+  void mem(bool w, std::initializer_list<uint8_t> opcode, int r, Reg base,
+           int32_t disp) {
+    rex(w, r, base);
+    emit(opcode);
+    emit8(static_cast<uint8_t>(0x80 | ((r & 7) << 3) | (base & 7)));
+    if ((base & 7) == RSP) { emit8(0x24); }
+    emit32(static_cast<uint32_t>(disp));
+  }
+
+  void reg(bool w, std::initializer_list<uint8_t> opcode, int r, Reg rm) {
+    rex(w, r, rm);
+    emit(opcode);
+    emit8(static_cast<uint8_t>(0xC0 | ((r & 7) << 3) | (rm & 7)));
+  }
+
+  void reg_imm(bool w, int ext, Reg rm, int32_t imm) {
+    reg(w, {0x81}, ext, rm);
+    emit32(static_cast<uint32_t>(imm));
+  }
+};
+
+// A baseline compiler from a function's decoded instructions to x86-64,
+// one template per instruction. Integers and booleans are handled inline
+// behind tag checks, and copies and moves of objects call into `copy_value`
+// and `move_value` for the reference counts. Anything else (calls, returns,
+// arrays, hashes, indexes, closures, builtins, and any failed tag check)
+// exits to the interpreter at that instruction, which runs the rest of the
+// activation; calls and returns enter native code again.
+struct JitCompiler {
+  JitCompiler(const DecodedInstructions &decoded,
+              const std::vector<Value> &constants)
+      : decoded(decoded), constants(constants) {}
+
+  // Returns `nullptr` if no executable memory could be had.
+  std::shared_ptr<JitCode> compile() {
+    auto jit = std::make_shared<JitCode>();
+    jit->entries.resize(decoded.size());
+
+    for (size_t i = 0; i < decoded.size(); i++) {
+      starts.push_back(a.new_label());
+      exits.push_back(a.new_label());
+    }
+    epilogue = a.new_label();
+
+    // rbx: the JitFrame, r12: bp, r13: top, r14: constants, r15: globals.
+    // Five pushes leave rsp 16-byte aligned for the helper calls.
+    a.push(Assembler::RBX);
+    a.push(Assembler::R12);
+    a.push(Assembler::R13);
+    a.push(Assembler::R14);
+    a.push(Assembler::R15);
+    a.mov(Assembler::RBX, Assembler::RDI);
+    a.mov(Assembler::R12, Assembler::RBX, offsetof(JitFrame, bp));
+    a.mov(Assembler::R13, Assembler::RBX, offsetof(JitFrame, top));
+    a.mov(Assembler::R14, Assembler::RBX, offsetof(JitFrame, constants));
+    a.mov(Assembler::R15, Assembler::RBX, offsetof(JitFrame, globals));
+    a.mov_imm(Assembler::RAX, reinterpret_cast<uintptr_t>(jit->entries.data()));
+    a.jmp_table_rax_rsi();
+
+    for (size_t i = 0; i < decoded.size(); i++) {
+      a.bind(starts[i]);
+      compile_instruction(decoded[i], i);
+    }
+
+    for (size_t i = 0; i < decoded.size(); i++) {
+      a.bind(exits[i]);
+      a.mov32_imm(Assembler::RAX, static_cast<uint32_t>(i));
+      a.jmp(epilogue);
+    }
+
+    a.bind(epilogue);
+    a.mov(Assembler::RBX, offsetof(JitFrame, top), Assembler::R13);
+    a.pop(Assembler::R15);
+    a.pop(Assembler::R14);
+    a.pop(Assembler::R13);
+    a.pop(Assembler::R12);
+    a.pop(Assembler::RBX);
+    a.ret();
+    a.finish();
+
+    auto size = a.code.size();
+    auto memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) { return nullptr; }
+    std::memcpy(memory, a.code.data(), size);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+      munmap(memory, size);
+      return nullptr;
+    }
+
+    jit->memory = memory;
+    jit->size = size;
+    auto base = reinterpret_cast<uintptr_t>(memory);
+    jit->entry = reinterpret_cast<JitCode::Entry>(base);
+    for (size_t i = 0; i < decoded.size(); i++) {
+      jit->entries[i] = base + a.offset(starts[i]);
+    }
+    return jit;
+  }
+
+  // The only operations native code calls: they touch reference counts and
+  // never throw.
+  static void copy_value(Value *dst, const Value *src) noexcept {
+    *dst = *src;
+  }
+
+  static void move_value(Value *dst, Value *src) noexcept {
+    *dst = std::move(*src);
+  }
+
+  static void release_value(Value *val) noexcept { val->reset(); }
+
+private:
+  using Reg = Assembler::Reg;
+
+  static constexpr int32_t Size = sizeof(Value);
+
+  const DecodedInstructions &decoded;
+  const std::vector<Value> &constants;
+  Assembler a;
+  std::vector<size_t> starts;
+  std::vector<size_t> exits;
+  size_t epilogue = 0;
+
+  static int32_t tag(int32_t disp) {
+    return disp + static_cast<int32_t>(Value::type_offset());
+  }
+
+  static int32_t payload(int32_t disp) {
+    return disp + static_cast<int32_t>(Value::integer_offset());
+  }
+
+  // The slot `n` below the top of the stack, counting from 1.
+  static int32_t top(int n) { return -n * Size; }
+
+  static bool slot_fits(int index) {
+    return index >= 0 && index < INT32_MAX / Size - 1;
+  }
+
+  const Value *immediate_constant(int index) const {
+    if (index < 0 || static_cast<size_t>(index) >= constants.size()) {
+      return nullptr;
+    }
+    const auto &c = constants[index];
+    return c.is_object() ? nullptr : &c;
+  }
+
+  void exit(size_t i) { a.jmp(exits[i]); }
+
+  // Exits unless the slot at `base + disp` holds an integer.
+  void guard_integer(Reg base, int32_t disp, size_t i) {
+    a.cmp32_imm(base, tag(disp), INTEGER_OBJ);
+    a.jcc(Assembler::NE, exits[i]);
+  }
+
+  // Drops the object in the slot at `base + disp`, if any, before an
+  // immediate is stored there.
+  void release(Reg base, int32_t disp) {
+    auto done = a.new_label();
+    a.cmp32_imm(base, tag(disp), NULL_OBJ);
+    a.jcc(Assembler::BE, done);
+    a.lea(Assembler::RDI, base, disp);
+    a.mov_imm(Assembler::RAX, reinterpret_cast<uintptr_t>(&release_value));
+    a.call(Assembler::RAX);
+    a.bind(done);
+  }
+
+  void store_immediate(Reg base, int32_t disp, ObjectType type, Reg value) {
+    a.mov32_imm(base, tag(disp), type);
+    a.mov(base, payload(disp), value);
+  }
+
+  void push_immediate(const Value &val) {
+    release(Assembler::R13, 0);
+    a.mov_imm(Assembler::RAX, static_cast<uint64_t>(val.as_integer()));
+    store_immediate(Assembler::R13, 0, val.type(), Assembler::RAX);
+    a.add_imm(Assembler::R13, Size);
+  }
+
+  // `dst = src`, inline when neither holds an object.
+  void copy(Reg dstBase, int32_t dstDisp, Reg srcBase, int32_t srcDisp) {
+    auto slow = a.new_label();
+    auto done = a.new_label();
+    a.mov32(Assembler::RAX, srcBase, tag(srcDisp));
+    a.cmp32_imm(Assembler::RAX, NULL_OBJ);
+    a.jcc(Assembler::A, slow);
+    a.cmp32_imm(dstBase, tag(dstDisp), NULL_OBJ);
+    a.jcc(Assembler::A, slow);
+    a.mov(Assembler::RCX, srcBase, payload(srcDisp));
+    a.mov(dstBase, payload(dstDisp), Assembler::RCX);
+    a.mov32(dstBase, tag(dstDisp), Assembler::RAX);
+    a.jmp(done);
+    a.bind(slow);
+    a.lea(Assembler::RDI, dstBase, dstDisp);
+    a.lea(Assembler::RSI, srcBase, srcDisp);
+    a.mov_imm(Assembler::RAX, reinterpret_cast<uintptr_t>(&copy_value));
+    a.call(Assembler::RAX);
+    a.bind(done);
+  }
+
+  // `dst = std::move(src)`, inline when neither holds an object. Like the
+  // interpreter, native code leaves no object in a slot it takes a value
+  // from, so nothing above the top of the stack keeps one alive.
+  void move(Reg dstBase, int32_t dstDisp, Reg srcBase, int32_t srcDisp) {
+    auto slow = a.new_label();
+    auto done = a.new_label();
+    a.mov32(Assembler::RAX, srcBase, tag(srcDisp));
+    a.cmp32_imm(Assembler::RAX, NULL_OBJ);
+    a.jcc(Assembler::A, slow);
+    a.cmp32_imm(dstBase, tag(dstDisp), NULL_OBJ);
+    a.jcc(Assembler::A, slow);
+    a.mov(Assembler::RCX, srcBase, payload(srcDisp));
+    a.mov(dstBase, payload(dstDisp), Assembler::RCX);
+    a.mov32(dstBase, tag(dstDisp), Assembler::RAX);
+    a.jmp(done);
+    a.bind(slow);
+    a.lea(Assembler::RDI, dstBase, dstDisp);
+    a.lea(Assembler::RSI, srcBase, srcDisp);
+    a.mov_imm(Assembler::RAX, reinterpret_cast<uintptr_t>(&move_value));
+    a.call(Assembler::RAX);
+    a.bind(done);
+  }
+
+  void push_copy(Reg srcBase, int32_t srcDisp) {
+    copy(Assembler::R13, 0, srcBase, srcDisp);
+    a.add_imm(Assembler::R13, Size);
+  }
+
+  void push_move(Reg srcBase, int32_t srcDisp) {
+    move(Assembler::R13, 0, srcBase, srcDisp);
+    a.add_imm(Assembler::R13, Size);
+  }
+
+  void pop_to(Reg dstBase, int32_t dstDisp) {
+    a.sub_imm(Assembler::R13, Size);
+    move(dstBase, dstDisp, Assembler::R13, 0);
+  }
+
+  // The operands are checked to be integers unless `checked` is false,
+  // for the forms that type inference has proven them to be.
+  void integer_operation(Opecode op, size_t i, bool checked = true) {
+    if (checked) {
+      guard_integer(Assembler::R13, top(2), i);
+      guard_integer(Assembler::R13, top(1), i);
+    }
+    a.mov(Assembler::RAX, Assembler::R13, payload(top(2)));
+    switch (op) {
+    case OpAdd: a.add(Assembler::RAX, Assembler::R13, payload(top(1))); break;
+    case OpSub: a.sub(Assembler::RAX, Assembler::R13, payload(top(1))); break;
+    case OpMul: a.imul(Assembler::RAX, Assembler::R13, payload(top(1))); break;
+    case OpDiv:
+      // Division by zero and overflow are left to the interpreter.
+      a.mov(Assembler::RCX, Assembler::R13, payload(top(1)));
+      a.test(Assembler::RCX, Assembler::RCX);
+      a.jcc(Assembler::E, exits[i]);
+      a.cmp_imm(Assembler::RCX, -1);
+      a.jcc(Assembler::E, exits[i]);
+      a.cqo();
+      a.idiv(Assembler::RCX);
+      break;
+    default: {
+      a.cmp(Assembler::RAX, Assembler::R13, payload(top(1)));
+      auto cc = op == OpEqual      ? Assembler::E
+                : op == OpNotEqual ? Assembler::NE
+                                   : Assembler::G;
+      a.setcc(cc);
+      a.mov32_imm(Assembler::R13, tag(top(2)), BOOLEAN_OBJ);
+      break;
+    }
+    }
+    a.mov(Assembler::R13, payload(top(2)), Assembler::RAX);
+    a.sub_imm(Assembler::R13, Size);
+  }
+
+  // Pops the top and jumps to `target` when its truthiness is `when`.
+  void jump_if(bool when, int target) {
+    auto notBoolean = a.new_label();
+    auto notObject = a.new_label();
+    auto done = a.new_label();
+    auto jumpIf = [&](Assembler::Cond truthy) {
+      auto cc = when ? truthy
+                     : (truthy == Assembler::NE ? Assembler::E : Assembler::NE);
+      a.jcc(cc, starts[target]);
+    };
+    a.sub_imm(Assembler::R13, Size);
+    a.mov32(Assembler::RAX, Assembler::R13, tag(0));
+    a.cmp32_imm(Assembler::RAX, BOOLEAN_OBJ);
+    a.jcc(Assembler::NE, notBoolean);
+    a.cmp_imm(Assembler::R13, payload(0), 0);
+    jumpIf(Assembler::NE);
+    a.jmp(done);
+    a.bind(notBoolean);
+    a.cmp32_imm(Assembler::RAX, NULL_OBJ);
+    a.jcc(Assembler::BE, notObject);
+    // Objects are truthy, and are released once they are popped.
+    release(Assembler::R13, 0);
+    a.jmp(when ? starts[target] : done);
+    a.bind(notObject);
+    a.cmp32_imm(Assembler::RAX, NULL_OBJ);
+    jumpIf(Assembler::NE);
+    a.bind(done);
+  }
+
+  void compile_instruction(const DecodedInstruction &ins, size_t i) {
+    const auto &operands = ins.operands;
+    for (auto operand : operands) {
+      if (!slot_fits(operand)) {
+        exit(i);
+        return;
+      }
+    }
+
+    switch (ins.op) {
+    case OpConstant: {
+      if (auto val = immediate_constant(operands[0])) {
+        push_immediate(*val);
+      } else {
+        push_copy(Assembler::R14, operands[0] * Size);
+      }
+      break;
+    }
+    case OpTrue: push_immediate(Value::boolean(true)); break;
+    case OpFalse: push_immediate(Value::boolean(false)); break;
+    case OpNull: push_immediate(Value::null()); break;
+    case OpPop: {
+      a.sub_imm(Assembler::R13, Size);
+      a.mov(Assembler::RDX, Assembler::RBX, offsetof(JitFrame, lastPopped));
+      move(Assembler::RDX, 0, Assembler::R13, 0);
+      break;
+    }
+    case OpGetLocal: push_copy(Assembler::R12, operands[0] * Size); break;
+    case OpMoveLocal: push_move(Assembler::R12, operands[0] * Size); break;
+    case OpSetLocal: pop_to(Assembler::R12, operands[0] * Size); break;
+    case OpGetGlobal: push_copy(Assembler::R15, operands[0] * Size); break;
+    case OpSetGlobal: {
+      pop_to(Assembler::R15, operands[0] * Size);
+      a.mov(Assembler::RDX, Assembler::RBX, offsetof(JitFrame, lastPopped));
+      copy(Assembler::RDX, 0, Assembler::R15, operands[0] * Size);
+      break;
+    }
+    case OpCurrentClosure: push_copy(Assembler::R12, -Size); break;
+    case OpGetFree: {
+      a.mov(Assembler::RDX, Assembler::RBX, offsetof(JitFrame, free));
+      push_copy(Assembler::RDX, operands[0] * Size);
+      break;
+    }
+    case OpAdd:
+    case OpSub:
+    case OpMul:
+    case OpDiv:
+    case OpEqual:
+    case OpNotEqual:
+    case OpGreaterThan: integer_operation(ins.op, i); break;
+    case OpAddInt:
+    case OpSubInt:
+    case OpMulInt:
+    case OpEqualInt:
+    case OpNotEqualInt:
+    case OpGreaterThanInt:
+      integer_operation(generic_opecode(ins.op), i);
+      break;
+    case OpAddIntUnchecked:
+    case OpSubIntUnchecked:
+    case OpMulIntUnchecked:
+    case OpEqualIntUnchecked:
+    case OpNotEqualIntUnchecked:
+    case OpGreaterThanIntUnchecked:
+      integer_operation(generic_opecode(ins.op), i, false);
+      break;
+    case OpMinus: {
+      guard_integer(Assembler::R13, top(1), i);
+      a.neg(Assembler::R13, payload(top(1)));
+      break;
+    }
+    case OpBang: {
+      // Only `false` and `null` are falsy.
+      auto boolean = a.new_label();
+      auto done = a.new_label();
+      a.mov32(Assembler::RAX, Assembler::R13, tag(top(1)));
+      a.cmp32_imm(Assembler::RAX, NULL_OBJ);
+      a.jcc(Assembler::A, exits[i]);
+      a.cmp32_imm(Assembler::RAX, BOOLEAN_OBJ);
+      a.jcc(Assembler::E, boolean);
+      a.cmp32_imm(Assembler::RAX, NULL_OBJ);
+      a.setcc(Assembler::E);
+      a.jmp(done);
+      a.bind(boolean);
+      a.mov(Assembler::RAX, Assembler::R13, payload(top(1)));
+      a.xor_imm(Assembler::RAX, 1);
+      a.bind(done);
+      store_immediate(Assembler::R13, top(1), BOOLEAN_OBJ, Assembler::RAX);
+      break;
+    }
+    case OpJump: a.jmp(starts[operands[0]]); break;
+    case OpJumpNotTruthy: jump_if(false, operands[0]); break;
+    case OpJumpTruthy: jump_if(true, operands[0]); break;
+    case OpAddLocalConstant:
+    case OpSubLocalConstant: {
+      auto c = immediate_constant(operands[1]);
+      if (!c || !c->is_integer()) {
+        exit(i);
+        break;
+      }
+      guard_integer(Assembler::R12, operands[0] * Size, i);
+      release(Assembler::R13, 0);
+      a.mov(Assembler::RAX, Assembler::R12, payload(operands[0] * Size));
+      a.mov_imm(Assembler::RCX, static_cast<uint64_t>(c->as_integer()));
+      if (ins.op == OpAddLocalConstant) {
+        a.add(Assembler::RAX, Assembler::RCX);
+      } else {
+        a.sub(Assembler::RAX, Assembler::RCX);
+      }
+      store_immediate(Assembler::R13, 0, INTEGER_OBJ, Assembler::RAX);
+      a.add_imm(Assembler::R13, Size);
+      break;
+    }
+    case OpAddLocals: {
+      guard_integer(Assembler::R12, operands[0] * Size, i);
+      guard_integer(Assembler::R12, operands[1] * Size, i);
+      release(Assembler::R13, 0);
+      a.mov(Assembler::RAX, Assembler::R12, payload(operands[0] * Size));
+      a.add(Assembler::RAX, Assembler::R12, payload(operands[1] * Size));
+      store_immediate(Assembler::R13, 0, INTEGER_OBJ, Assembler::RAX);
+      a.add_imm(Assembler::R13, Size);
+      break;
+    }
+    case OpJumpNotEqualConstant:
+    case OpJumpNotGreaterThanConstant: {
+      auto c = immediate_constant(operands[1]);
+      if (!c || !c->is_integer()) {
+        exit(i);
+        break;
+      }
+      guard_integer(Assembler::R13, top(1), i);
+      a.sub_imm(Assembler::R13, Size);
+      a.mov_imm(Assembler::RCX, static_cast<uint64_t>(c->as_integer()));
+      a.mov(Assembler::RAX, Assembler::R13, payload(0));
+      a.cmp(Assembler::RAX, Assembler::RCX);
+      a.jcc(ins.op == OpJumpNotEqualConstant ? Assembler::NE : Assembler::LE,
+            starts[operands[0]]);
+      break;
+    }
+    default: exit(i); break;
+    }
+  }
+};
+
+#endif
+
+} // namespace monkey
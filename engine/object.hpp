@@ -2,6 +2,7 @@
 
 #include <ast.hpp>
 #include <code.hpp>
+#include <cstddef>
 #include <sstream>
 
 namespace monkey {
@@ -20,7 +21,8 @@ enum ObjectType {
   BUILTIN_OBJ,
   ARRAY_OBJ,
   HASH_OBJ,
-  CLOSURE_OBJ
+  CLOSURE_OBJ,
+  NATIVE_FUNCTION_OBJ
 };
 
 struct HashKey {
@@ -232,11 +234,138 @@ struct Hash : public Object {
   std::map<HashKey, HashPair> pairs;
 };
 
+// Value is the unit the VM works with on its stack, in globals, in closures
+// and in the constant pool. Integers, booleans and null are held inline, so
+// arithmetic and comparisons never touch the heap; any other object is held
+// through a shared_ptr.
+struct Value {
+  Value() : type_(NULL_OBJ), integer_(0) {}
+
+  Value(const Value &rhs) : type_(rhs.type_) {
+    if (rhs.is_object()) {
+      new (&object_) std::shared_ptr<Object>(rhs.object_);
+    } else {
+      integer_ = rhs.integer_;
+    }
+  }
+
+  Value(Value &&rhs) noexcept : type_(rhs.type_) {
+    if (rhs.is_object()) {
+      new (&object_) std::shared_ptr<Object>(std::move(rhs.object_));
+      rhs.reset();
+    } else {
+      integer_ = rhs.integer_;
+    }
+  }
+
+  ~Value() {
+    if (is_object()) { object_.~shared_ptr(); }
+  }
+
+  Value &operator=(const Value &rhs) {
+    if (rhs.is_object()) {
+      if (is_object()) {
+        object_ = rhs.object_;
+      } else {
+        new (&object_) std::shared_ptr<Object>(rhs.object_);
+      }
+    } else {
+      auto n = rhs.integer_;
+      if (is_object()) { object_.~shared_ptr(); }
+      integer_ = n;
+    }
+    type_ = rhs.type_;
+    return *this;
+  }
+
+  Value &operator=(Value &&rhs) noexcept {
+    if (this == &rhs) { return *this; }
+    if (rhs.is_object()) {
+      if (is_object()) {
+        object_ = std::move(rhs.object_);
+      } else {
+        new (&object_) std::shared_ptr<Object>(std::move(rhs.object_));
+      }
+    } else {
+      auto n = rhs.integer_;
+      if (is_object()) { object_.~shared_ptr(); }
+      integer_ = n;
+    }
+    type_ = rhs.type_;
+    rhs.reset();
+    return *this;
+  }
+
+  static Value integer(int64_t n) {
+    Value v;
+    v.type_ = INTEGER_OBJ;
+    v.integer_ = n;
+    return v;
+  }
+
+  static Value boolean(bool b) {
+    Value v;
+    v.type_ = BOOLEAN_OBJ;
+    v.integer_ = b ? 1 : 0;
+    return v;
+  }
+
+  static Value null() { return Value(); }
+
+  // Integer, Boolean and Null objects are unboxed into immediates.
+  static Value object(const std::shared_ptr<Object> &obj);
+
+  // For callers that already know `obj` is none of the immediate types.
+  static Value object(std::shared_ptr<Object> obj, ObjectType type) {
+    Value v;
+    v.type_ = type;
+    new (&v.object_) std::shared_ptr<Object>(std::move(obj));
+    return v;
+  }
+
+  ObjectType type() const { return type_; }
+
+  bool is_integer() const { return type_ == INTEGER_OBJ; }
+  bool is_boolean() const { return type_ == BOOLEAN_OBJ; }
+  bool is_null() const { return type_ == NULL_OBJ; }
+  bool is_object() const { return type_ > NULL_OBJ; }
+
+  int64_t as_integer() const { return integer_; }
+  bool as_boolean() const { return integer_ != 0; }
+  const std::shared_ptr<Object> &as_object() const { return object_; }
+
+  void reset() {
+    if (is_object()) { object_.~shared_ptr(); }
+    type_ = NULL_OBJ;
+    integer_ = 0;
+  }
+
+  std::shared_ptr<Object> to_object() const;
+
+  std::string inspect() const;
+  bool has_hash_key() const;
+  HashKey hash_key() const;
+
+  // Where the tag and the immediate are stored, for native code.
+  static size_t type_offset() { return offsetof(Value, type_); }
+  static size_t integer_offset() { return offsetof(Value, integer_); }
+
+private:
+  ObjectType type_;
+  union {
+    int64_t integer_;
+    std::shared_ptr<Object> object_;
+  };
+};
+
+template <typename T> inline T &cast(const Value &val) {
+  return static_cast<T &>(*val.as_object());
+}
+
 struct Closure : public Object {
   Closure(std::shared_ptr<CompiledFunction> fn) : fn(fn) {}
 
-  Closure(std::shared_ptr<CompiledFunction> fn,
-          const std::vector<std::shared_ptr<Object>> &free)
+  Closure(std::shared_ptr<CompiledFunction> fn, const std::vector<Value> &free)
       : fn(fn), free(free) {}
 
   ObjectType type() const override { return CLOSURE_OBJ; }
@@ -249,11 +378,34 @@ struct Closure : public Object {
   }
 
   std::shared_ptr<CompiledFunction> fn;
-  std::vector<std::shared_ptr<Object>> free;
+  std::vector<Value> free;
 };
 
+// Integers in this range are shared objects created on first use and never
+// freed, so small results such as counters and array indexes don't allocate.
+#ifndef MONKEY_SMALL_INTEGER_MIN
+#define MONKEY_SMALL_INTEGER_MIN -1024
+#endif
+#ifndef MONKEY_SMALL_INTEGER_MAX
+#define MONKEY_SMALL_INTEGER_MAX 65535
+#endif
+
 inline std::shared_ptr<Object> make_integer(int64_t n) {
-  return std::make_shared<Integer>(n);
+  constexpr int64_t min = MONKEY_SMALL_INTEGER_MIN;
+  constexpr int64_t max = MONKEY_SMALL_INTEGER_MAX;
+  if (n < min || n > max) { return std::make_shared<Integer>(n); }
+
+  // Filled once, so threads only ever read it, and never destroyed, so it
+  // still works while other statics are torn down.
+  static const auto &smallIntegers = *[] {
+    auto objs = new std::vector<std::shared_ptr<Object>>();
+    objs->reserve(max - min + 1);
+    for (auto i = min; i <= max; i++) {
+      objs->push_back(std::make_shared<Integer>(i));
+    }
+    return objs;
+  }();
+  return smallIntegers[n - min];
 }
 
 inline std::shared_ptr<Object> make_error(const std::string &s) {
@@ -299,6 +451,48 @@ inline std::shared_ptr<Object> make_bool(bool value) {
   return value ? CONST_TRUE : CONST_FALSE;
 }
 
+inline Value Value::object(const std::shared_ptr<Object> &obj) {
+  if (!obj) { return Value(); }
+  auto type = obj->type();
+  switch (type) {
+  case INTEGER_OBJ: return integer(cast<Integer>(obj).value);
+  case BOOLEAN_OBJ: return boolean(cast<Boolean>(obj).value);
+  case NULL_OBJ: return null();
+  default: return object(obj, type);
+  }
+}
+
+inline std::shared_ptr<Object> Value::to_object() const {
+  switch (type_) {
+  case INTEGER_OBJ: return make_integer(integer_);
+  case BOOLEAN_OBJ: return make_bool(as_boolean());
+  case NULL_OBJ: return CONST_NULL;
+  default: return object_;
+  }
+}
+
+inline std::string Value::inspect() const {
+  switch (type_) {
+  case INTEGER_OBJ: return std::to_string(integer_);
+  case BOOLEAN_OBJ: return as_boolean() ? "true" : "false";
+  case NULL_OBJ: return "null";
+  default: return object_->inspect();
+  }
+}
+
+inline bool Value::has_hash_key() const {
+  return is_object() ? object_->has_hash_key() : !is_null();
+}
+
+inline HashKey Value::hash_key() const {
+  switch (type_) {
+  case INTEGER_OBJ:
+  case BOOLEAN_OBJ: return HashKey{type_, static_cast<uint64_t>(integer_)};
+  case NULL_OBJ: throw std::logic_error("invalid internal condition.");
+  default: return object_->hash_key();
+  }
+}
+
 inline void
 validate_args_for_array(const std::vector<std::shared_ptr<Object>> &args,
                         const std::string &name, size_t argc) {
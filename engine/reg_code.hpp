@@ -0,0 +1,80 @@
+#pragma once
+
+#include <code.hpp>
+
+namespace monkey {
+
+// Instructions of the register VM. `a`, `b` and `c` are registers of the
+// current frame unless the comment says otherwise, and `a` is the
+// destination. Jump targets are instruction indexes.
+enum RegOpecode : uint8_t {
+  RegLoadConstant = 0, // a = constants[b]
+  RegLoadTrue,         // a = true
+  RegLoadFalse,        // a = false
+  RegLoadNull,         // a = null
+  RegMove,             // a = b
+  RegGetGlobal,        // a = globals[b]
+  RegSetGlobal,        // globals[a] = b
+  RegGetBuiltin,       // a = builtins[b]
+  RegGetFree,          // a = free[b] of the running closure
+  RegCurrentClosure,   // a = the running closure
+  RegAdd,              // a = b + c
+  RegSub,              // a = b - c
+  RegMul,              // a = b * c
+  RegDiv,              // a = b / c
+  RegEqual,            // a = b == c
+  RegNotEqual,         // a = b != c
+  RegGreaterThan,      // a = b > c
+  RegMinus,            // a = -b
+  RegBang,             // a = !b
+  RegJump,             // jump to a
+  RegJumpNotTruthy,    // jump to a unless b is truthy
+  RegArray,            // a = [b, ..., b + c - 1]
+  RegHash,             // a = {b: b + 1, ..., b + c - 2: b + c - 1}
+  RegIndex,            // a = b[c]
+  RegClosure,          // a = closure of constants[b] over a, ..., a + c - 1
+  RegCall,             // a = b(b + 1, ..., b + c)
+  RegReturn,           // return a
+  RegReturnNull,       // return null
+  RegPop,              // a is the result of a top level expression statement
+  RegHalt,             // end of the main program
+};
+
+struct RegInstruction {
+  RegOpecode op = RegHalt;
+  int a = 0;
+  int b = 0;
+  int c = 0;
+};
+
+using RegInstructions = std::vector<RegInstruction>;
+
+inline const char *reg_opecode_name(RegOpecode op) {
+  static const char *names[] = {
+      "RegLoadConstant",   "RegLoadTrue",       "RegLoadFalse",
+      "RegLoadNull",       "RegMove",           "RegGetGlobal",
+      "RegSetGlobal",      "RegGetBuiltin",     "RegGetFree",
+      "RegCurrentClosure", "RegAdd",            "RegSub",
+      "RegMul",            "RegDiv",            "RegEqual",
+      "RegNotEqual",       "RegGreaterThan",    "RegMinus",
+      "RegBang",           "RegJump",           "RegJumpNotTruthy",
+      "RegArray",          "RegHash",           "RegIndex",
+      "RegClosure",        "RegCall",           "RegReturn",
+      "RegReturnNull",     "RegPop",            "RegHalt",
+  };
+  static_assert(sizeof(names) / sizeof(names[0]) == RegHalt + 1);
+  return names[op];
+}
+
+inline std::string to_string(const RegInstructions &ins,
+                             const char *ln = "\\n") {
+  std::string out;
+  for (size_t i = 0; i < ins.size(); i++) {
+    const auto &r = ins[i];
+    out += fmt::format("{:04} {} {} {} {}{}", i, reg_opecode_name(r.op), r.a,
+                       r.b, r.c, ln);
+  }
+  return out;
+}
+
+} // namespace monkey
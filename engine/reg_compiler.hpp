@@ -0,0 +1,443 @@
+#pragma once
+
+#include <object.hpp>
+#include <reg_code.hpp>
+#include <symbol_table.hpp>
+#include <unordered_map>
+
+namespace monkey {
+
+// Register code of a function. `RegCompiler` keeps it apart from the
+// function's CompiledFunction, which the register VM uses only for its
+// arity and identity.
+struct RegFunction {
+  RegInstructions instructions;
+  int numRegisters = 0;
+};
+
+using RegFunctions =
+    std::unordered_map<const CompiledFunction *, RegFunction>;
+
+struct RegBytecode {
+  std::shared_ptr<CompiledFunction> main;
+  std::vector<std::shared_ptr<Object>> constants;
+  RegFunctions functions; // code of `main` and of the function constants
+  int numGlobals = 0; // globals defined so far, earlier REPL lines included
+};
+
+// Registers of a function are its locals (parameters first, in symbol index
+// order) followed by temporaries, which are allocated and released in stack
+// order while an expression is compiled.
+struct RegCompilerScope {
+  RegInstructions instructions;
+  int top = 0;
+  int numRegisters = 0;
+};
+
+// Generates code for the register VM from the same AST and symbol tables as
+// `Compiler`.
+struct RegCompiler {
+  std::shared_ptr<SymbolTable> symbolTable;
+  std::vector<std::shared_ptr<Object>> constants;
+  RegFunctions functions;
+
+  std::vector<RegCompilerScope> scopes{RegCompilerScope{}};
+  int scopeIndex = 0;
+
+  RegCompiler() : symbolTable(symbol_table()) {
+    int i = 0;
+    for (const auto &[name, _] : BUILTINS) {
+      symbolTable->define_builtin(i, name);
+      i++;
+    }
+  }
+
+  RegCompiler(std::shared_ptr<SymbolTable> symbolTable,
+              const std::vector<std::shared_ptr<Object>> &constants,
+              const RegFunctions &functions)
+      : symbolTable(symbolTable), constants(constants), functions(functions) {}
+
+  void compile(const std::shared_ptr<Ast> &ast) {
+    for (const auto &node : statements(ast)) {
+      compile_statement(node, true);
+    }
+  }
+
+  RegBytecode bytecode() {
+    auto main = std::make_shared<CompiledFunction>();
+    auto code = functions;
+    auto &mainCode = code[main.get()];
+    mainCode.instructions = scope().instructions;
+    mainCode.instructions.push_back(RegInstruction{RegHalt});
+    mainCode.numRegisters = scope().numRegisters;
+    auto globals = symbolTable;
+    while (globals->outer) {
+      globals = globals->outer;
+    }
+    return RegBytecode{main, constants, std::move(code),
+                       globals->numDefinitions};
+  }
+
+  static std::vector<std::shared_ptr<Ast>>
+  statements(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+    if (ast->tag == "STATEMENTS"_) { return ast->nodes; }
+    return {ast};
+  }
+
+  void compile_statement(const std::shared_ptr<Ast> &ast, bool topLevel) {
+    using namespace peg::udl;
+
+    switch (ast->tag) {
+    case "ASSIGNMENT"_: {
+      auto name = std::string(ast->nodes[0]->token);
+      auto symbol = symbolTable->define(name);
+      if (symbol.scope == GlobalScope) {
+        auto saved = scope().top;
+        emit(RegSetGlobal, symbol.index, compile_operand(ast->nodes[1]));
+        scope().top = saved;
+      } else {
+        compile_expression(ast->nodes[1], symbol.index);
+      }
+      break;
+    }
+    case "RETURN"_: {
+      auto saved = scope().top;
+      emit(RegReturn, compile_operand(ast->nodes[0]));
+      scope().top = saved;
+      break;
+    }
+    case "EXPRESSION_STATEMENT"_: {
+      auto saved = scope().top;
+      auto reg = compile_operand(ast->nodes[0]);
+      if (topLevel) { emit(RegPop, reg); }
+      scope().top = saved;
+      break;
+    }
+    default: {
+      auto saved = scope().top;
+      compile_operand(ast);
+      scope().top = saved;
+      break;
+    }
+    }
+  }
+
+  // Compiles a block so that its value ends up in `dst`.
+  void compile_block(const std::shared_ptr<Ast> &ast, int dst) {
+    using namespace peg::udl;
+
+    auto nodes = statements(ast->nodes[0]);
+    if (nodes.empty()) {
+      emit(RegLoadNull, dst);
+      return;
+    }
+
+    for (size_t i = 0; i + 1 < nodes.size(); i++) {
+      compile_statement(nodes[i], false);
+    }
+
+    const auto &last = nodes.back();
+    if (last->tag == "EXPRESSION_STATEMENT"_) {
+      compile_expression(last->nodes[0], dst);
+    } else {
+      compile_statement(last, false);
+      emit(RegLoadNull, dst);
+    }
+  }
+
+  // Returns the register holding the value of `ast`: a local's own register,
+  // or a new temporary.
+  int compile_operand(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+
+    if (ast->tag == "IDENTIFIER"_) {
+      auto symbol = resolve(ast);
+      if (symbol.scope == LocalScope) { return symbol.index; }
+    }
+
+    auto reg = allocate(1);
+    compile_expression(ast, reg);
+    return reg;
+  }
+
+  void compile_expression(const std::shared_ptr<Ast> &ast, int dst) {
+    using namespace peg::udl;
+
+    auto saved = scope().top;
+
+    switch (ast->tag) {
+    case "IDENTIFIER"_: {
+      load_symbol(resolve(ast), dst);
+      break;
+    }
+    case "INFIX_EXPR"_: {
+      auto op = ast->nodes[1]->token;
+
+      if (op == "<") {
+        auto left = compile_operand(ast->nodes[2]);
+        auto right = compile_operand(ast->nodes[0]);
+        emit(RegGreaterThan, dst, left, right);
+        break;
+      }
+
+      auto left = compile_operand(ast->nodes[0]);
+      auto right = compile_operand(ast->nodes[2]);
+
+      switch (peg::str2tag(op)) {
+      case "+"_: emit(RegAdd, dst, left, right); break;
+      case "-"_: emit(RegSub, dst, left, right); break;
+      case "*"_: emit(RegMul, dst, left, right); break;
+      case "/"_: emit(RegDiv, dst, left, right); break;
+      case ">"_: emit(RegGreaterThan, dst, left, right); break;
+      case "=="_: emit(RegEqual, dst, left, right); break;
+      case "!="_: emit(RegNotEqual, dst, left, right); break;
+      default:
+        throw std::runtime_error(fmt::format("unknown operator {}", op));
+        break;
+      }
+      break;
+    }
+    case "PREFIX_EXPR"_: {
+      int i = ast->nodes.size() - 1;
+      auto operand = compile_operand(ast->nodes[i--]);
+
+      while (i >= 0) {
+        auto op = ast->nodes[i]->token;
+        switch (peg::str2tag(op)) {
+        case "!"_: emit(RegBang, dst, operand); break;
+        case "-"_: emit(RegMinus, dst, operand); break;
+        default:
+          throw std::runtime_error(fmt::format("unknown operator {}", op));
+          break;
+        }
+        operand = dst;
+        i--;
+      }
+      break;
+    }
+    case "IF"_: {
+      auto condition = compile_operand(ast->nodes[0]);
+      auto jump_not_truthy_pos = emit(RegJumpNotTruthy, 9999, condition);
+      scope().top = saved;
+
+      compile_block(ast->nodes[1], dst);
+      auto jump_pos = emit(RegJump, 9999);
+
+      scope().instructions[jump_not_truthy_pos].a = current_position();
+      if (ast->nodes.size() < 3) {
+        emit(RegLoadNull, dst);
+      } else {
+        compile_block(ast->nodes[2], dst);
+      }
+
+      scope().instructions[jump_pos].a = current_position();
+      break;
+    }
+    case "INTEGER"_: {
+      auto integer = make_integer(ast->to_integer());
+      emit(RegLoadConstant, dst, add_constant(integer));
+      break;
+    }
+    case "BOOLEAN"_: {
+      emit(ast->to_bool() ? RegLoadTrue : RegLoadFalse, dst);
+      break;
+    }
+    case "STRING"_: {
+      auto str = std::make_shared<String>(ast->token);
+      emit(RegLoadConstant, dst, add_constant(str));
+      break;
+    }
+    case "ARRAY"_: {
+      auto count = static_cast<int>(ast->nodes.size());
+      auto first = allocate(count);
+      for (int i = 0; i < count; i++) {
+        compile_expression(ast->nodes[i], first + i);
+      }
+      emit(RegArray, dst, first, count);
+      break;
+    }
+    case "HASH"_: {
+      auto count = static_cast<int>(ast->nodes.size() * 2);
+      auto first = allocate(count);
+      for (int i = 0; i < count; i += 2) {
+        compile_expression(ast->nodes[i / 2]->nodes[0], first + i);
+        compile_expression(ast->nodes[i / 2]->nodes[1], first + i + 1);
+      }
+      emit(RegHash, dst, first, count);
+      break;
+    }
+    case "CALL"_: {
+      // -1 until the callee has been evaluated into a register.
+      int value = -1;
+      for (auto i = 1u; i < ast->nodes.size(); i++) {
+        auto postfix = ast->nodes[i];
+        auto target = i + 1 == ast->nodes.size() ? dst : allocate(1);
+        switch (postfix->original_tag) {
+        case "INDEX"_: {
+          if (value < 0) { value = compile_operand(ast->nodes[0]); }
+          auto index = compile_operand(postfix->nodes[0]);
+          emit(RegIndex, target, value, index);
+          break;
+        }
+        case "ARGUMENTS"_: {
+          auto numArgs = static_cast<int>(postfix->nodes.size());
+          auto callee = allocate(numArgs + 1);
+          if (value < 0) {
+            compile_expression(ast->nodes[0], callee);
+          } else {
+            emit(RegMove, callee, value);
+          }
+          for (int j = 0; j < numArgs; j++) {
+            compile_expression(postfix->nodes[j], callee + 1 + j);
+          }
+          emit(RegCall, target, callee, numArgs);
+          break;
+        }
+        }
+        value = target;
+      }
+      break;
+    }
+    case "FUNCTION"_: {
+      enter_scope();
+      if (ast->value.has_value()) {
+        symbolTable->define_function_name(ast->to_string());
+      }
+      auto parameters = ast->nodes[0];
+      for (auto node : parameters->nodes) {
+        symbolTable->define(std::string(node->token));
+      }
+      auto body = ast->nodes[1];
+      allocate(static_cast<int>(parameters->nodes.size()) +
+               count_assignments(body));
+      compile_function_body(body);
+
+      auto freeSymbols = symbolTable->freeSymbols;
+      auto numLocals = symbolTable->numDefinitions;
+      auto fnScope = leave_scope();
+
+      auto compiledFn = std::make_shared<CompiledFunction>();
+      compiledFn->numLocals = numLocals;
+      compiledFn->numParameters = parameters->nodes.size();
+      functions[compiledFn.get()] =
+          RegFunction{fnScope.instructions, fnScope.numRegisters};
+      auto fnIndex = add_constant(compiledFn);
+
+      auto numFree = static_cast<int>(freeSymbols.size());
+      auto first = numFree > 0 ? allocate(numFree) : dst;
+      for (int i = 0; i < numFree; i++) {
+        load_symbol(freeSymbols[i], first + i);
+      }
+      emit(RegClosure, first, fnIndex, numFree);
+      if (first != dst) { emit(RegMove, dst, first); }
+      break;
+    }
+    default: {
+      emit(RegLoadNull, dst);
+      break;
+    }
+    }
+
+    scope().top = saved;
+  }
+
+  void compile_function_body(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+
+    auto nodes = statements(ast->nodes[0]);
+    for (size_t i = 0; i + 1 < nodes.size(); i++) {
+      compile_statement(nodes[i], false);
+    }
+
+    if (nodes.empty()) {
+      emit(RegReturnNull);
+      return;
+    }
+
+    const auto &last = nodes.back();
+    if (last->tag == "EXPRESSION_STATEMENT"_) {
+      emit(RegReturn, compile_operand(last->nodes[0]));
+    } else {
+      compile_statement(last, false);
+      if (last->tag != "RETURN"_) { emit(RegReturnNull); }
+    }
+  }
+
+  // Number of `let` statements in a function body, outside of nested
+  // functions. Each one defines a new local, so this is how many registers
+  // the locals other than the parameters need.
+  static int count_assignments(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+
+    if (ast->tag == "FUNCTION"_) { return 0; }
+    int count = ast->tag == "ASSIGNMENT"_ ? 1 : 0;
+    for (const auto &node : ast->nodes) {
+      count += count_assignments(node);
+    }
+    return count;
+  }
+
+  Symbol resolve(const std::shared_ptr<Ast> &ast) {
+    auto name = std::string(ast->token);
+    const auto &symbol = symbolTable->resolve(name);
+    if (!symbol) {
+      throw std::runtime_error(fmt::format("undefined variable {}", name));
+    }
+    return *symbol;
+  }
+
+  void load_symbol(const Symbol &s, int dst) {
+    if (s.scope == GlobalScope) {
+      emit(RegGetGlobal, dst, s.index);
+    } else if (s.scope == LocalScope) {
+      if (s.index != dst) { emit(RegMove, dst, s.index); }
+    } else if (s.scope == BuiltinScope) {
+      emit(RegGetBuiltin, dst, s.index);
+    } else if (s.scope == FreeScope) {
+      emit(RegGetFree, dst, s.index);
+    } else if (s.scope == FunctionScope) {
+      emit(RegCurrentClosure, dst);
+    }
+  }
+
+  int add_constant(std::shared_ptr<Object> obj) {
+    constants.push_back(obj);
+    return constants.size() - 1;
+  }
+
+  size_t emit(RegOpecode op, int a = 0, int b = 0, int c = 0) {
+    scope().instructions.push_back(RegInstruction{op, a, b, c});
+    return scope().instructions.size() - 1;
+  }
+
+  int current_position() const {
+    return static_cast<int>(scopes[scopeIndex].instructions.size());
+  }
+
+  int allocate(int count) {
+    auto &s = scope();
+    auto first = s.top;
+    s.top += count;
+    s.numRegisters = std::max(s.numRegisters, s.top);
+    return first;
+  }
+
+  RegCompilerScope &scope() { return scopes[scopeIndex]; }
+
+  void enter_scope() {
+    scopes.push_back(RegCompilerScope{});
+    scopeIndex++;
+    symbolTable = enclosed_symbol_table(symbolTable);
+  }
+
+  RegCompilerScope leave_scope() {
+    auto s = scope();
+    scopes.pop_back();
+    scopeIndex--;
+    symbolTable = symbolTable->outer;
+    return s;
+  }
+};
+
+} // namespace monkey
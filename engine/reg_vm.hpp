@@ -0,0 +1,358 @@
+#pragma once
+
+#include <reg_compiler.hpp>
+#include <vm.hpp>
+
+namespace monkey {
+
+// A call frame of the register VM. Register `i` of the frame is
+// `stack[base + i]`, and the closure being run is kept alive in the register
+// just below `base`, which held the callee. `result` is the caller's register
+// that receives the return value.
+struct RegFrame {
+  Closure *cl = nullptr;
+  const RegInstruction *code = nullptr;
+  const RegInstruction *ip = nullptr;
+  int base = 0;
+  int result = 0;
+
+  RegFrame() = default;
+  RegFrame(Closure *cl, const RegFunction &fn, int base, int result)
+      : cl(cl), code(fn.instructions.data()), ip(code), base(base),
+        result(result) {}
+};
+
+// Runs code generated by `RegCompiler`. Arguments are evaluated into the
+// registers right after the callee, and those become the parameters of the
+// callee's frame, so a call copies nothing. Operations share their semantics
+// with the stack VM.
+struct RegVM {
+  VMOptions options;
+
+  std::vector<Value> constants;
+  std::vector<Value> stack;
+  std::vector<Value> globals;
+
+  // Frames point into this code, so copies of the VM share it.
+  std::shared_ptr<const RegFunctions> functions;
+
+  std::shared_ptr<Closure> mainClosure;
+  std::vector<RegFrame> frames;
+  int framesIndex = 1;
+
+  Value lastPopped;
+
+#ifdef MONKEY_COUNT_DISPATCH
+  // Number of instructions dispatched, for benchmarks.
+  size_t dispatchCount = 0;
+#endif
+
+  RegVM(const RegBytecode &bytecode, const VMOptions &options = VMOptions())
+      : RegVM(bytecode, std::vector<Value>(VM::GlobalSize), options) {}
+
+  RegVM(const RegBytecode &bytecode, const std::vector<Value> &s,
+        const VMOptions &options = VMOptions())
+      : options(options), constants(VM::to_values(bytecode.constants)),
+        globals(s),
+        functions(std::make_shared<RegFunctions>(bytecode.functions)),
+        mainClosure(std::make_shared<Closure>(bytecode.main)),
+        frames(std::max<size_t>(
+            std::min(options.frameSegment, options.maxFrames), 1)) {
+    if (globals.size() < static_cast<size_t>(bytecode.numGlobals)) {
+      globals.resize(bytecode.numGlobals);
+    }
+    frames[0] = RegFrame(mainClosure.get(), function(*bytecode.main), 0, 0);
+  }
+
+  std::shared_ptr<Object> last_popped_stack_elem() const {
+    return lastPopped.to_object();
+  }
+
+  const RegFunction &function(const CompiledFunction &fn) const {
+    auto it = functions->find(&fn);
+    if (it == functions->end()) {
+      throw make_error("function has no register code");
+    }
+    return it->second;
+  }
+
+  void reserve_stack(size_t size) {
+    if (size > stack.size()) {
+      stack.resize(VM::grown_size(stack.size(), size, options.stackSegment,
+                                  options.maxStackSize));
+    }
+  }
+
+  // Makes room for registers [from, to) and sets them to null, so a local
+  // whose `let` hasn't run reads null rather than what an earlier call left.
+  void clear_registers(size_t from, size_t to) {
+    reserve_stack(to);
+    std::fill(stack.begin() + from, stack.begin() + to, Value::null());
+  }
+
+  void push_frame(const RegFrame &f) {
+    if (static_cast<size_t>(framesIndex) == frames.size()) {
+      frames.resize(VM::grown_size(frames.size(), frames.size() + 1,
+                                   options.frameSegment, options.maxFrames));
+    }
+    frames[framesIndex] = f;
+    framesIndex++;
+  }
+
+  // Closes `function` over the `numFree` registers starting at `free`.
+  static Value make_closure(const Value &function, const Value *free,
+                            int numFree) {
+    return Value::object(
+        std::make_shared<Closure>(
+            std::static_pointer_cast<CompiledFunction>(function.as_object()),
+            std::vector<Value>(free, free + numFree)),
+        CLOSURE_OBJ);
+  }
+
+  void run() {
+#ifdef MONKEY_COUNT_DISPATCH
+#define COUNT_DISPATCH() dispatchCount++
+#else
+#define COUNT_DISPATCH()
+#endif
+
+#if MONKEY_THREADED_DISPATCH
+    static const void *const labels[] = {
+        &&L_RegLoadConstant,   &&L_RegLoadTrue,    &&L_RegLoadFalse,
+        &&L_RegLoadNull,       &&L_RegMove,        &&L_RegGetGlobal,
+        &&L_RegSetGlobal,      &&L_RegGetBuiltin,  &&L_RegGetFree,
+        &&L_RegCurrentClosure, &&L_RegAdd,         &&L_RegSub,
+        &&L_RegMul,            &&L_RegDiv,         &&L_RegEqual,
+        &&L_RegNotEqual,       &&L_RegGreaterThan, &&L_RegMinus,
+        &&L_RegBang,           &&L_RegJump,        &&L_RegJumpNotTruthy,
+        &&L_RegArray,          &&L_RegHash,        &&L_RegIndex,
+        &&L_RegClosure,        &&L_RegCall,        &&L_RegReturn,
+        &&L_RegReturnNull,     &&L_RegPop,         &&L_RegHalt,
+    };
+    static_assert(sizeof(labels) / sizeof(labels[0]) == RegHalt + 1);
+
+#define TARGET(op) L_##op:
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    COUNT_DISPATCH();                                                          \
+    ins = ip++;                                                                \
+    goto *labels[ins->op];                                                     \
+  } while (0)
+#else
+#define TARGET(op) case op:
+#define DISPATCH() continue
+#endif
+
+    // As in VM::run, handlers keep no objects in locals: a computed goto
+    // skips their destructors.
+    RegFrame *frame = nullptr;
+    const RegInstruction *ip = nullptr;
+    const RegInstruction *ins = nullptr;
+    Value *R = nullptr;
+
+    auto load_frame = [&]() {
+      frame = &frames[framesIndex - 1];
+      ip = frame->ip;
+      R = stack.data() + frame->base;
+    };
+
+    // Leaves the current frame with `value` as its result.
+    auto do_return = [&](Value value) {
+      if (framesIndex == 1) {
+        lastPopped = std::move(value);
+        return false;
+      }
+      auto result = frame->result;
+      framesIndex--;
+      load_frame();
+      R[result] = std::move(value);
+      return true;
+    };
+
+    try {
+      clear_registers(0, function(*mainClosure->fn).numRegisters);
+      load_frame();
+
+#if MONKEY_THREADED_DISPATCH
+      DISPATCH();
+#else
+      for (;;) {
+        COUNT_DISPATCH();
+        ins = ip++;
+        switch (ins->op) {
+#endif
+      TARGET(RegLoadConstant) {
+        R[ins->a] = constants[ins->b];
+        DISPATCH();
+      }
+      TARGET(RegLoadTrue) {
+        R[ins->a] = Value::boolean(true);
+        DISPATCH();
+      }
+      TARGET(RegLoadFalse) {
+        R[ins->a] = Value::boolean(false);
+        DISPATCH();
+      }
+      TARGET(RegLoadNull) {
+        R[ins->a] = Value::null();
+        DISPATCH();
+      }
+      TARGET(RegMove) {
+        R[ins->a] = R[ins->b];
+        DISPATCH();
+      }
+      TARGET(RegGetGlobal) {
+        R[ins->a] = globals[ins->b];
+        DISPATCH();
+      }
+      TARGET(RegSetGlobal) {
+        globals[ins->a] = R[ins->b];
+        DISPATCH();
+      }
+      TARGET(RegGetBuiltin) {
+        const auto &definition = BUILTINS[ins->b];
+        R[ins->a] = Value::object(definition.second, BUILTIN_OBJ);
+        DISPATCH();
+      }
+      TARGET(RegGetFree) {
+        R[ins->a] = frame->cl->free[ins->b];
+        DISPATCH();
+      }
+      TARGET(RegCurrentClosure) {
+        R[ins->a] = R[-1];
+        DISPATCH();
+      }
+      TARGET(RegAdd) {
+        const auto &left = R[ins->b];
+        const auto &right = R[ins->c];
+        if (left.is_integer() && right.is_integer()) {
+          R[ins->a] = Value::integer(
+              VM::wrapping_add(left.as_integer(), right.as_integer()));
+        } else {
+          R[ins->a] = VM::binary_operation(OpAdd, left, right);
+        }
+        DISPATCH();
+      }
+      TARGET(RegSub) {
+        const auto &left = R[ins->b];
+        const auto &right = R[ins->c];
+        if (left.is_integer() && right.is_integer()) {
+          R[ins->a] = Value::integer(
+              VM::wrapping_sub(left.as_integer(), right.as_integer()));
+        } else {
+          R[ins->a] = VM::binary_operation(OpSub, left, right);
+        }
+        DISPATCH();
+      }
+      TARGET(RegMul) {
+        R[ins->a] = VM::binary_operation(OpMul, R[ins->b], R[ins->c]);
+        DISPATCH();
+      }
+      TARGET(RegDiv) {
+        R[ins->a] = VM::binary_operation(OpDiv, R[ins->b], R[ins->c]);
+        DISPATCH();
+      }
+      TARGET(RegEqual) {
+        R[ins->a] = Value::boolean(VM::compare(OpEqual, R[ins->b], R[ins->c]));
+        DISPATCH();
+      }
+      TARGET(RegNotEqual) {
+        R[ins->a] =
+            Value::boolean(VM::compare(OpNotEqual, R[ins->b], R[ins->c]));
+        DISPATCH();
+      }
+      TARGET(RegGreaterThan) {
+        R[ins->a] =
+            Value::boolean(VM::compare(OpGreaterThan, R[ins->b], R[ins->c]));
+        DISPATCH();
+      }
+      TARGET(RegMinus) {
+        R[ins->a] = VM::minus_operator(R[ins->b]);
+        DISPATCH();
+      }
+      TARGET(RegBang) {
+        R[ins->a] = VM::bang_operator(R[ins->b]);
+        DISPATCH();
+      }
+      TARGET(RegJump) {
+        ip = frame->code + ins->a;
+        DISPATCH();
+      }
+      TARGET(RegJumpNotTruthy) {
+        if (!VM::is_truthy(R[ins->b])) {
+          ip = frame->code + ins->a;
+        }
+        DISPATCH();
+      }
+      TARGET(RegArray) {
+        R[ins->a] = Value::object(
+            VM::build_array(&R[ins->b], &R[ins->b + ins->c]), ARRAY_OBJ);
+        DISPATCH();
+      }
+      TARGET(RegHash) {
+        R[ins->a] = Value::object(
+            VM::build_hash(&R[ins->b], &R[ins->b + ins->c]), HASH_OBJ);
+        DISPATCH();
+      }
+      TARGET(RegIndex) {
+        R[ins->a] = VM::index_expression(R[ins->b], R[ins->c]);
+        DISPATCH();
+      }
+      TARGET(RegClosure) {
+        R[ins->a] = make_closure(constants[ins->b], &R[ins->a], ins->c);
+        DISPATCH();
+      }
+      TARGET(RegCall) {
+        const auto &callee = R[ins->b];
+        auto numArgs = ins->c;
+        if (callee.type() == CLOSURE_OBJ) {
+          auto &cl = cast<Closure>(callee);
+          if (numArgs != cl.fn->numParameters) {
+            throw make_error(
+                fmt::format("wrong number of arguments: want={}, got={}",
+                            cl.fn->numParameters, numArgs));
+          }
+          const auto &fn = function(*cl.fn);
+          auto base = frame->base + ins->b + 1;
+          frame->ip = ip;
+          clear_registers(base + numArgs, base + fn.numRegisters);
+          push_frame(RegFrame(&cl, fn, base, ins->a));
+          load_frame();
+        } else if (callee.type() == BUILTIN_OBJ) {
+          R[ins->a] =
+              VM::call_builtin(cast<Builtin>(callee), &R[ins->b + 1], numArgs);
+        } else {
+          throw make_error("calling non-function and non-built-in");
+        }
+        DISPATCH();
+      }
+      TARGET(RegReturn) {
+        if (!do_return(std::move(R[ins->a]))) { return; }
+        DISPATCH();
+      }
+      TARGET(RegReturnNull) {
+        if (!do_return(Value::null())) { return; }
+        DISPATCH();
+      }
+      TARGET(RegPop) {
+        lastPopped = R[ins->a];
+        DISPATCH();
+      }
+      TARGET(RegHalt) { return; }
+#if !MONKEY_THREADED_DISPATCH
+        default:
+          throw make_error(fmt::format("opcode {} undefined", ins->op));
+        }
+      }
+#endif
+    } catch (const std::shared_ptr<Object> &err) {
+      lastPopped = Value::object(err, ERROR_OBJ);
+    }
+
+#undef TARGET
+#undef DISPATCH
+#undef COUNT_DISPATCH
+  }
+};
+
+} // namespace monkey
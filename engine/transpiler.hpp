@@ -0,0 +1,501 @@
+#pragma once
+
+#include <map>
+#include <object.hpp>
+#include <symbol_table.hpp>
+
+namespace monkey {
+
+// A C++ expression the transpiler has produced for a Monkey expression. It
+// is of type `bool` if `boolean` is set, and of type `Value` otherwise.
+// A `stable` expression evaluates to the same value whenever it runs and
+// can't fail, so it may be evaluated after code that comes after it.
+struct CppExpression {
+  std::string code;
+  bool stable = false;
+  bool boolean = false;
+};
+
+// A function bound by `let` that calls may go to directly.
+struct KnownFunction {
+  int id;
+  int numParameters;
+};
+
+// The C++ function being generated for a Monkey function, or for the main
+// program when `id` is -1.
+struct TranspilerScope {
+  int id = -1;
+  int numParameters = 0;
+  std::string body;
+  int depth = 1;       // indentation of the next line
+  int temporaries = 0; // `t0`, `t1`, ... declared so far
+  int branches = 0;    // `if` branches the next statement is in
+  bool usesSelf = false;
+
+  // Locals bound to a function by a `let` that runs on every call.
+  std::map<int, KnownFunction> knownLocals;
+};
+
+// Translates a program into a standalone C++ translation unit built on the
+// operations in aot.hpp. Names are resolved with the same symbol table as
+// `Compiler`, so globals, locals and free variables have the same indexes
+// they'd have on the VM. Each Monkey function becomes a C++ function, and a
+// call to a function bound by `let` at the top of a body is a direct call.
+struct Transpiler {
+  std::shared_ptr<SymbolTable> symbolTable;
+  std::vector<TranspilerScope> scopes{TranspilerScope{}};
+
+  std::string declarations; // prototypes of the generated functions
+  std::string constants;    // strings and closures without free variables
+  std::string definitions;  // the generated functions
+  int numFunctions = 0;
+  std::map<std::string, int> strings;
+
+  // Globals bound to a function by a top-level `let`.
+  std::map<int, KnownFunction> knownGlobals;
+
+  Transpiler() : symbolTable(symbol_table()) {
+    int i = 0;
+    for (const auto &[name, _] : BUILTINS) {
+      symbolTable->define_builtin(i, name);
+      i++;
+    }
+  }
+
+  void transpile(const std::shared_ptr<Ast> &ast) { statements(ast, ""); }
+
+  // The generated translation unit. Its `main` runs the program.
+  std::string translation_unit() const {
+    std::string out = "// Generated by `monkey --emit-cpp`.\n\n"
+                      "#include <aot.hpp>\n\nnamespace {\n\n"
+                      "using namespace monkey;\n\n";
+    if (!declarations.empty()) { out += declarations + "\n"; }
+    if (!constants.empty()) { out += constants + "\n"; }
+    for (int i = 0; i < symbolTable->numDefinitions; i++) {
+      out += fmt::format("Value g{};\n", i);
+    }
+    if (symbolTable->numDefinitions) { out += "\n"; }
+    out += definitions;
+    out += "void program() {\n" + scopes[0].body + "}\n\n";
+    out += "} // namespace\n\n"
+           "int main() { return monkey::aot::run(program); }\n";
+    return out;
+  }
+
+  TranspilerScope &scope() { return scopes.back(); }
+
+  void line(const std::string &code) {
+    scope().body += std::string(scope().depth * 2, ' ') + code + "\n";
+  }
+
+  std::string temporary() {
+    return fmt::format("t{}", scope().temporaries++);
+  }
+
+  // Emits the statements of a block or program. The value of a trailing
+  // expression statement is assigned to `target`, or returned if `target`
+  // is "return". Returns true if the last statement returned.
+  bool statements(const std::shared_ptr<Ast> &ast, const std::string &target) {
+    using namespace peg::udl;
+
+    if (ast->tag != "STATEMENTS"_) { return statement(ast, target); }
+    const auto &nodes = ast->nodes;
+    for (size_t i = 0; i < nodes.size(); i++) {
+      auto last = i + 1 == nodes.size();
+      if (statement(nodes[i], last ? target : "") && last) { return true; }
+    }
+    return false;
+  }
+
+  bool statement(const std::shared_ptr<Ast> &ast, const std::string &target) {
+    using namespace peg::udl;
+
+    switch (ast->tag) {
+    case "ASSIGNMENT"_: {
+      auto name = std::string(ast->nodes[0]->token);
+      auto symbol = symbolTable->define(name);
+      auto id = numFunctions; // of the function `value` may be
+      auto value = expression(ast->nodes[1]);
+      line(fmt::format("{} = {};", symbol_code(symbol), to_value(value)));
+      if (ast->nodes[1]->tag == "FUNCTION"_ && scope().branches == 0) {
+        auto numParams = ast->nodes[1]->nodes[0]->nodes.size();
+        KnownFunction fn{id, static_cast<int>(numParams)};
+        if (symbol.scope == GlobalScope) {
+          knownGlobals[symbol.index] = fn;
+        } else {
+          scope().knownLocals[symbol.index] = fn;
+        }
+      }
+      return false;
+    }
+    case "RETURN"_: {
+      auto value = expression(ast->nodes[0]);
+      if (scope().id == -1) {
+        discard(value);
+        line("return;");
+      } else {
+        line(fmt::format("return {};", to_value(value)));
+      }
+      return true;
+    }
+    case "EXPRESSION_STATEMENT"_: {
+      auto value = expression(ast->nodes[0]);
+      if (target == "return") {
+        line(fmt::format("return {};", to_value(value)));
+        return true;
+      } else if (!target.empty()) {
+        line(fmt::format("{} = {};", target, to_value(value)));
+      } else {
+        discard(value);
+      }
+      return false;
+    }
+    default:
+      throw std::logic_error("invalid Ast type: " + ast->name);
+    }
+  }
+
+  void discard(const CppExpression &value) {
+    if (!value.stable) { line(fmt::format("(void){};", value.code)); }
+  }
+
+  static std::string to_value(const CppExpression &value) {
+    if (value.boolean) { return "Value::boolean(" + value.code + ")"; }
+    return value.code;
+  }
+
+  static std::string to_condition(const CppExpression &value) {
+    if (value.boolean) { return value.code; }
+    return "VM::is_truthy(" + value.code + ")";
+  }
+
+  // Evaluates `ast` after `values`. If that takes statements, the values
+  // that aren't stable are kept in temporaries ahead of them, so they are
+  // still evaluated first.
+  void evaluate_next(std::vector<CppExpression> &values,
+                     const std::shared_ptr<Ast> &ast) {
+    auto mark = scope().body.size();
+    auto value = expression(ast);
+    if (scope().body.size() != mark) {
+      std::string saved;
+      for (auto &v : values) {
+        if (v.stable) { continue; }
+        auto t = temporary();
+        saved += std::string(scope().depth * 2, ' ') +
+                 fmt::format("auto {} = {};\n", t, v.code);
+        v.code = t;
+        v.stable = true;
+      }
+      scope().body.insert(mark, saved);
+    }
+    values.push_back(std::move(value));
+  }
+
+  // Keeps a value that isn't stable in a temporary, so it is evaluated now.
+  void keep(CppExpression &value) {
+    if (value.stable) { return; }
+    auto t = temporary();
+    line(fmt::format("auto {} = {};", t, value.code));
+    value.code = t;
+    value.stable = true;
+  }
+
+  // Keeps the values that aren't stable in temporaries, up to the last one,
+  // before they are passed to a single C++ call, whose arguments are
+  // evaluated in no particular order.
+  void sequence(std::vector<CppExpression> &values) {
+    auto last = values.size();
+    while (last > 0 && values[last - 1].stable) {
+      last--;
+    }
+    for (size_t i = 0; i + 1 < last; i++) {
+      keep(values[i]);
+    }
+  }
+
+  CppExpression expression(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+
+    switch (ast->tag) {
+    case "INTEGER"_:
+      return {fmt::format("Value::integer({})", ast->to_integer()), true};
+    case "BOOLEAN"_: return {ast->to_bool() ? "true" : "false", true, true};
+    case "NULL"_: return {"Value::null()", true};
+    case "STRING"_: return {string_constant(ast->token), true};
+    case "IDENTIFIER"_: {
+      auto name = std::string(ast->token);
+      const auto &symbol = symbolTable->resolve(name);
+      if (!symbol) {
+        throw std::runtime_error(fmt::format("undefined variable {}", name));
+      }
+      return {symbol_code(*symbol), true};
+    }
+    case "PREFIX_EXPR"_: {
+      int i = ast->nodes.size() - 1;
+      auto value = expression(ast->nodes[i--]);
+      while (i >= 0) {
+        auto op = ast->nodes[i]->token;
+        if (op == "!") {
+          value = value.boolean
+                      ? CppExpression{"!(" + value.code + ")", false, true}
+                      : CppExpression{"aot::bang(" + value.code + ")", false,
+                                      true};
+        } else if (op == "-") {
+          value = {"aot::minus(" + to_value(value) + ")"};
+        } else {
+          throw std::runtime_error(fmt::format("unknown operator {}", op));
+        }
+        i--;
+      }
+      return value;
+    }
+    case "INFIX_EXPR"_: return infix_expression(ast);
+    case "IF"_: {
+      auto condition = expression(ast->nodes[0]);
+      auto t = temporary();
+      line("Value " + t + ";");
+      line("if (" + to_condition(condition) + ") {");
+      branch(ast->nodes[1], t);
+      if (ast->nodes.size() == 3) {
+        line("} else {");
+        branch(ast->nodes[2], t);
+      }
+      line("}");
+      return {t, true};
+    }
+    case "ARRAY"_:
+    case "HASH"_: {
+      std::vector<CppExpression> values;
+      for (auto node : ast->nodes) {
+        if (ast->tag == "HASH"_) {
+          evaluate_next(values, node->nodes[0]);
+          evaluate_next(values, node->nodes[1]);
+        } else {
+          evaluate_next(values, node);
+        }
+      }
+      auto fn = ast->tag == "HASH"_ ? "aot::hash" : "aot::array";
+      return {fmt::format("{}({{{}}})", fn, join(values))};
+    }
+    case "CALL"_: return call(ast);
+    case "FUNCTION"_: return function(ast);
+    }
+    throw std::logic_error("invalid Ast type: " + ast->name);
+  }
+
+  void branch(const std::shared_ptr<Ast> &block, const std::string &target) {
+    scope().depth++;
+    scope().branches++;
+    statements(block->nodes[0], target);
+    scope().branches--;
+    scope().depth--;
+  }
+
+  CppExpression infix_expression(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+
+    auto op = ast->nodes[1]->token;
+
+    // `<` is `>` with the operands swapped, and like on the VM its right
+    // operand is evaluated first.
+    std::vector<CppExpression> values;
+    if (op == "<") {
+      evaluate_next(values, ast->nodes[2]);
+      evaluate_next(values, ast->nodes[0]);
+      op = ">";
+    } else {
+      evaluate_next(values, ast->nodes[0]);
+      evaluate_next(values, ast->nodes[2]);
+    }
+    sequence(values);
+    auto operands = to_value(values[0]) + ", " + to_value(values[1]);
+
+    std::string fn;
+    auto boolean = false;
+    switch (peg::str2tag(op)) {
+    case "+"_: fn = "aot::add"; break;
+    case "-"_: fn = "aot::sub"; break;
+    case "*"_: fn = "aot::mul"; break;
+    case "/"_: fn = "aot::div"; break;
+    case ">"_: fn = "aot::greater_than"; boolean = true; break;
+    case "=="_: fn = "aot::equal"; boolean = true; break;
+    case "!="_: fn = "aot::not_equal"; boolean = true; break;
+    default: throw std::runtime_error(fmt::format("unknown operator {}", op));
+    }
+    return {fn + "(" + operands + ")", false, boolean};
+  }
+
+  CppExpression call(const std::shared_ptr<Ast> &ast) {
+    using namespace peg::udl;
+
+    auto callee = expression(ast->nodes[0]);
+    auto known = known_function(ast->nodes[0]);
+    for (size_t i = 1; i < ast->nodes.size(); i++) {
+      auto postfix = ast->nodes[i];
+      std::vector<CppExpression> values{callee};
+      switch (postfix->original_tag) {
+      case "INDEX"_: {
+        evaluate_next(values, postfix->nodes[0]);
+        sequence(values);
+        callee = {fmt::format("aot::index({}, {})", to_value(values[0]),
+                              to_value(values[1]))};
+        break;
+      }
+      case "ARGUMENTS"_: {
+        for (auto node : postfix->nodes) {
+          evaluate_next(values, node);
+        }
+        auto numArgs = static_cast<int>(postfix->nodes.size());
+        std::string args = "nullptr";
+        if (numArgs) {
+          // The arguments are evaluated on a line of their own, so the
+          // callee is evaluated ahead of them.
+          keep(values[0]);
+          args = temporary();
+          line(fmt::format("Value {}[] = {{{}}};", args,
+                           join({values.begin() + 1, values.end()})));
+        }
+        auto t = temporary();
+        if (i == 1 && known && known->numParameters == numArgs) {
+          line(fmt::format("auto {} = fn{}({}, {});", t, known->id,
+                           to_value(values[0]), args));
+        } else {
+          line(fmt::format("auto {} = aot::call({}, {}, {});", t,
+                           to_value(values[0]), args, numArgs));
+        }
+        callee = {t, true};
+        break;
+      }
+      }
+    }
+    return callee;
+  }
+
+  std::optional<KnownFunction>
+  known_function(const std::shared_ptr<Ast> &callee) {
+    using namespace peg::udl;
+
+    if (callee->tag != "IDENTIFIER"_) { return std::nullopt; }
+    auto symbol = symbolTable->resolve(std::string(callee->token));
+    if (symbol->scope == FunctionScope) {
+      return KnownFunction{scope().id, scope().numParameters};
+    } else if (symbol->scope != GlobalScope && symbol->scope != LocalScope) {
+      return std::nullopt;
+    }
+    const auto &known =
+        symbol->scope == GlobalScope ? knownGlobals : scope().knownLocals;
+    auto it = known.find(symbol->index);
+    if (it == known.end()) { return std::nullopt; }
+    return it->second;
+  }
+
+  CppExpression function(const std::shared_ptr<Ast> &ast) {
+    auto id = numFunctions++;
+    auto parameters = ast->nodes[0];
+    auto numParams = static_cast<int>(parameters->nodes.size());
+
+    symbolTable = enclosed_symbol_table(symbolTable);
+    scopes.emplace_back();
+    scope().id = id;
+    scope().numParameters = numParams;
+    if (ast->value.has_value()) {
+      symbolTable->define_function_name(ast->to_string());
+    }
+    for (auto node : parameters->nodes) {
+      symbolTable->define(std::string(node->token));
+    }
+    if (!statements(ast->nodes[1]->nodes[0], "return")) {
+      line("return Value::null();");
+    }
+
+    auto freeSymbols = symbolTable->freeSymbols;
+    auto numLocals = symbolTable->numDefinitions;
+    auto fn = std::move(scope());
+    scopes.pop_back();
+    symbolTable = symbolTable->outer;
+
+    // Parameters the body doesn't use are left unnamed.
+    auto self = fn.usesSelf || !freeSymbols.empty() ? "self" : "";
+    auto args = numParams ? "args" : "";
+    auto signature = fmt::format("Value fn{}(const Value &{}, Value *{})", id,
+                                 self, args);
+    declarations += signature + ";\n";
+    definitions += signature + " {\n";
+    if (!freeSymbols.empty()) {
+      definitions += "  const auto &free = aot::free(self);\n";
+    }
+    for (int i = 0; i < numLocals; i++) {
+      definitions +=
+          i < numParams
+              ? fmt::format("  Value l{} = std::move(args[{}]);\n", i, i)
+              : fmt::format("  Value l{};\n", i);
+    }
+    definitions += fn.body + "}\n\n";
+
+    if (freeSymbols.empty()) {
+      auto name = fmt::format("f{}", id);
+      constants += fmt::format(
+          "const Value {} = aot::closure(fn{}, {}, {{}});\n", name, id,
+          numParams);
+      return {name, true};
+    }
+    std::vector<CppExpression> free;
+    for (const auto &s : freeSymbols) {
+      free.push_back({symbol_code(s), true});
+    }
+    return {fmt::format("aot::closure(fn{}, {}, {{{}}})", id, numParams,
+                        join(free))};
+  }
+
+  std::string symbol_code(const Symbol &s) {
+    if (s.scope == GlobalScope) {
+      return fmt::format("g{}", s.index);
+    } else if (s.scope == LocalScope) {
+      return fmt::format("l{}", s.index);
+    } else if (s.scope == BuiltinScope) {
+      return fmt::format("aot::builtin({})", s.index);
+    } else if (s.scope == FreeScope) {
+      return fmt::format("free[{}]", s.index);
+    } else {
+      scope().usesSelf = true;
+      return "self";
+    }
+  }
+
+  std::string string_constant(std::string_view s) {
+    auto it = strings.find(std::string(s));
+    if (it == strings.end()) {
+      it = strings.emplace(std::string(s), strings.size()).first;
+      constants +=
+          fmt::format("const Value s{} = aot::string({});\n", it->second,
+                      string_literal(s));
+    }
+    return fmt::format("s{}", it->second);
+  }
+
+  // Octal escapes have a fixed length, so no character that follows can be
+  // taken as part of one. The length is given for strings with a '\0'.
+  static std::string string_literal(std::string_view s) {
+    std::string out = "{\"";
+    for (unsigned char c : s) {
+      if (c == '"' || c == '\\' || c == '?' || c < ' ' || c > '~') {
+        out += fmt::format("\\{:03o}", c);
+      } else {
+        out += static_cast<char>(c);
+      }
+    }
+    return out + fmt::format("\", {}}}", s.size());
+  }
+
+  static std::string join(const std::vector<CppExpression> &values) {
+    std::string out;
+    for (size_t i = 0; i < values.size(); i++) {
+      if (i != 0) { out += ", "; }
+      out += to_value(values[i]);
+    }
+    return out;
+  }
+};
+
+} // namespace monkey
@@ -1,289 +1,866 @@
 #pragma once
 
 #include <compiler.hpp>
+#include <jit.hpp>
+
+#if !defined(MONKEY_SWITCH_DISPATCH) &&                                        \
+    (defined(__GNUC__) || defined(__clang__))
+#define MONKEY_THREADED_DISPATCH 1
+#else
+#define MONKEY_THREADED_DISPATCH 0
+#endif
 
 namespace monkey {
 
+struct FunctionState;
+
+// Inline cache of a call site: the function it called last time, and the
+// VM's state for it.
+struct CallCache {
+  const CompiledFunction *fn = nullptr;
+  FunctionState *state = nullptr;
+};
+
+// What a VM keeps about a function it runs, filled in the first time it
+// does. Quickening rewrites `decoded` in place, so this belongs to the VM
+// and never carries over to another one running the same bytecode.
+// `stackDepth` is an upper bound on the stack slots a call uses, locals
+// included. `callCaches` has one entry per call site, indexed by the site's
+// second decoded operand. `fn` keeps the function, whose address is the
+// key of its state, alive.
+struct FunctionState {
+  std::shared_ptr<CompiledFunction> fn;
+  DecodedInstructions decoded;
+  size_t stackDepth = 0;
+  std::vector<CallCache> callCaches;
+
+#if MONKEY_JIT
+  // Calls counted with `VMOptions::jit`, and the native code compiled once
+  // the function is hot.
+  size_t callCount = 0;
+  std::shared_ptr<JitCode> jitCode;
+#endif
+};
+
+// Frames are stored by value in `VM::frames` and reused across calls. `cl` is
+// not owning: the closure being run stays alive in the callee slot just below
+// `basePointer` (or in `VM::mainClosure` for the outermost frame). `state`
+// is the VM's state for the closure's function.
 struct Frame {
-  std::shared_ptr<Closure> cl;
-  int ip = -1;
+  Closure *cl = nullptr;
+  FunctionState *state = nullptr;
+  int ip = 0;
   int basePointer = -1;
 
-  Frame(std::shared_ptr<Closure> cl, int basePointer)
-      : cl(cl), basePointer(basePointer) {}
+  Frame() = default;
+  Frame(Closure *cl, FunctionState *state, int basePointer)
+      : cl(cl), state(state), basePointer(basePointer) {}
 
   const Instructions &instructions() const { return cl->fn->instructions; }
 };
 
+// Stack sizes are counted in slots. Both stacks start small and grow in
+// segments, doubling at most, until they reach their maximum; a call that
+// would go past it fails with "stack overflow".
+struct VMOptions {
+  size_t stackSegment = 2048;
+  size_t maxStackSize = 1024 * 1024;
+  size_t frameSegment = 256;
+  size_t maxFrames = 64 * 1024;
+
+  // Rewrites generic arithmetic, comparison and index instructions into the
+  // forms for the operand types they see, and back when a guard fails.
+  bool quickening = true;
+
+  // Compiles a function to native code once it has been called more than
+  // `jitThreshold` times (see jit.hpp). Ignored where there is no JIT.
+  bool jit = false;
+  size_t jitThreshold = 100;
+};
+
 struct VM {
-  static const size_t StackSize = 2048;
   static const size_t GlobalSize = 65535;
-  static const size_t MaxFrames = 1024;
 
-  std::vector<std::shared_ptr<Object>> constants;
+  VMOptions options;
+
+  std::vector<Value> constants;
 
-  std::vector<std::shared_ptr<Object>> stack;
+  // Only grown by `call_closure`, so handlers never check for room: the
+  // stack always has `stackDepth` free slots for the running function.
+  // Slots at and above `sp` hold no objects: whatever takes a value off the
+  // stack moves it out or releases it, so nothing dead is kept alive.
+  std::vector<Value> stack;
   size_t sp = 0;
 
-  std::vector<std::shared_ptr<Object>> globals;
+  // The value of the last expression statement, or the error the program
+  // failed with.
+  Value lastPopped;
+
+  std::vector<Value> globals;
 
-  std::vector<std::shared_ptr<Frame>> frames;
+  std::shared_ptr<Closure> mainClosure;
+  std::vector<Frame> frames;
   int framesIndex = 1;
 
-  VM(const Bytecode &bytecode)
-      : constants(bytecode.constants), stack(StackSize), globals(GlobalSize),
-        frames(MaxFrames) {
+  // Functions that `call` runs its calls from, by number of arguments.
+  std::vector<std::shared_ptr<Closure>> trampolines;
+
+  // The state of each function run so far, and of the closures that
+  // `OpCallKnown` calls, by constant index.
+  std::unordered_map<const CompiledFunction *, FunctionState> functionStates;
+  std::vector<FunctionState *> knownStates;
+
+#ifdef MONKEY_COUNT_DISPATCH
+  // Number of instructions dispatched, for benchmarks.
+  size_t dispatchCount = 0;
+#endif
+
+  // Closure calls whose call site cache did or did not match the callee.
+  size_t callCacheHits = 0;
+  size_t callCacheMisses = 0;
+
+  // Handler addresses for threaded dispatch, set up by the first `run`.
+  static inline const void *const *handlers = nullptr;
+
+  VM(const Bytecode &bytecode, const VMOptions &options = VMOptions())
+      : VM(bytecode, std::vector<Value>(GlobalSize), options) {}
+
+  VM(const Bytecode &bytecode, const std::vector<Value> &s,
+     const VMOptions &options = VMOptions())
+      : options(options), constants(to_values(bytecode.constants)),
+        stack(std::max<size_t>(
+            std::min(options.stackSegment, options.maxStackSize), 1)),
+        globals(s),
+        frames(std::max<size_t>(
+            std::min(options.frameSegment, options.maxFrames), 1)),
+        knownStates(constants.size()) {
+    if (globals.size() < static_cast<size_t>(bytecode.numGlobals)) {
+      globals.resize(bytecode.numGlobals);
+    }
     auto mainFn = std::make_shared<CompiledFunction>(bytecode.instructions);
-    auto mainClosure = std::make_shared<Closure>(mainFn);
-    frames[0] = std::make_shared<Frame>(mainClosure, 0);
+    mainFn->numLocals = bytecode.numLocals;
+    sp = bytecode.numLocals;
+    mainClosure = std::make_shared<Closure>(mainFn);
+    frames[0] = Frame(mainClosure.get(), nullptr, 0);
   }
 
-  VM(const Bytecode &bytecode, const std::vector<std::shared_ptr<Object>> &s)
-      : constants(bytecode.constants), stack(StackSize), globals(s),
-        frames(MaxFrames) {
-    auto mainFn = std::make_shared<CompiledFunction>(bytecode.instructions);
-    auto mainClosure = std::make_shared<Closure>(mainFn);
-    frames[0] = std::make_shared<Frame>(mainClosure, 0);
+  static std::vector<Value>
+  to_values(const std::vector<std::shared_ptr<Object>> &objects) {
+    std::vector<Value> values;
+    values.reserve(objects.size());
+    for (const auto &obj : objects) {
+      values.push_back(Value::object(obj));
+    }
+    return values;
   }
 
   std::shared_ptr<Object> stack_top() const {
     if (sp == 0) { return nullptr; }
-    return stack[sp - 1];
+    return stack[sp - 1].to_object();
   }
 
-  std::shared_ptr<Object> last_popped_stack_elem() const { return stack[sp]; }
-
-  std::shared_ptr<Frame> current_frame() const {
-    return frames[framesIndex - 1];
+  std::shared_ptr<Object> last_popped_stack_elem() const {
+    return lastPopped.to_object();
   }
 
-  void push_frame(std::shared_ptr<Frame> f) {
+  Frame &current_frame() { return frames[framesIndex - 1]; }
+
+  void push_frame(const Frame &f) {
+    if (static_cast<size_t>(framesIndex) == frames.size()) {
+      frames.resize(grown_size(frames.size(), frames.size() + 1,
+                               options.frameSegment, options.maxFrames));
+    }
     frames[framesIndex] = f;
     framesIndex++;
   }
 
-  std::shared_ptr<Frame> pop_frame() {
+  Frame &pop_frame() {
     framesIndex--;
     return frames[framesIndex];
   }
 
+  FunctionState &function_state(const std::shared_ptr<CompiledFunction> &fn) {
+    auto &state = functionStates[fn.get()];
+    if (!state.fn) {
+      state.fn = fn;
+      state.decoded = decode(fn->instructions, handlers);
+      size_t callSites = 0;
+      for (auto &d : state.decoded) {
+        if (d.op == OpCall || d.op == OpTailCall) {
+          d.operands[1] = static_cast<int>(callSites++);
+        }
+      }
+      state.callCaches.assign(callSites, CallCache{});
+      // Monkey functions only jump forward and no instruction grows the
+      // stack by more than one slot, so this bound is safe.
+      state.stackDepth = fn->numLocals + state.decoded.size();
+    }
+    return state;
+  }
+
+  static size_t grown_size(size_t size, size_t needed, size_t segment,
+                           size_t limit) {
+    if (needed > limit) { throw make_error("stack overflow"); }
+    auto grown = std::max(needed, std::min(size * 2, limit));
+    segment = std::max<size_t>(segment, 1);
+    return std::min((grown + segment - 1) / segment * segment, limit);
+  }
+
+  void reserve_stack(size_t depth) {
+    auto needed = sp + depth;
+    if (needed > stack.size()) {
+      stack.resize(grown_size(stack.size(), needed, options.stackSegment,
+                              options.maxStackSize));
+    }
+  }
+
   void run() {
+#ifdef MONKEY_COUNT_DISPATCH
+#define COUNT_DISPATCH() dispatchCount++
+#else
+#define COUNT_DISPATCH()
+#endif
+
+#if MONKEY_THREADED_DISPATCH
+    static const void *const labels[] = {
+        &&L_OpConstant,      &&L_OpAdd,         &&L_OpSub,
+        &&L_OpMul,           &&L_OpDiv,         &&L_OpTrue,
+        &&L_OpFalse,         &&L_OpNull,        &&L_OpEqual,
+        &&L_OpNotEqual,      &&L_OpGreaterThan, &&L_OpMinus,
+        &&L_OpBang,          &&L_OpPop,         &&L_OpJumpNotTruthy,
+        &&L_OpJump,          &&L_OpGetGlobal,   &&L_OpSetGlobal,
+        &&L_OpArray,         &&L_OpHash,        &&L_OpIndex,
+        &&L_OpCall,          &&L_OpReturnValue, &&L_OpReturn,
+        &&L_OpGetLocal,      &&L_OpSetLocal,    &&L_OpGetBuiltin,
+        &&L_OpClosure,       &&L_OpGetFree,     &&L_OpCurrentClosure,
+        &&L_OpTailCall,      &&L_OpJumpTruthy,
+        &&L_OpAddLocalConstant,
+        &&L_OpSubLocalConstant,
+        &&L_OpAddLocals,
+        &&L_OpJumpNotEqualConstant,
+        &&L_OpJumpNotGreaterThanConstant,
+        &&L_OpAddInt,        &&L_OpSubInt,      &&L_OpMulInt,
+        &&L_OpEqualInt,      &&L_OpNotEqualInt, &&L_OpGreaterThanInt,
+        &&L_OpAddIntUnchecked,
+        &&L_OpSubIntUnchecked,
+        &&L_OpMulIntUnchecked,
+        &&L_OpEqualIntUnchecked,
+        &&L_OpNotEqualIntUnchecked,
+        &&L_OpGreaterThanIntUnchecked,
+        &&L_OpCallKnown,     &&L_OpMoveLocal,
+        &&L_OpIndexArrayInt, &&L_OpIndexHashString,
+        &&L_OpHalt,
+    };
+    static_assert(sizeof(labels) / sizeof(labels[0]) == OpHalt + 1);
+    handlers = labels;
+
+#define TARGET(op) L_##op:
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    COUNT_DISPATCH();                                                          \
+    ins = ip++;                                                                \
+    goto *ins->handler;                                                        \
+  } while (0)
+#else
+#define TARGET(op) case op:
+#define DISPATCH() continue
+#endif
+
+    // Handlers keep no objects in locals: a computed goto may leave a scope
+    // without running its destructors, so such work goes into member
+    // functions.
+    //
+    // The active frame, its instruction pointer and its base pointer live in
+    // locals while the loop runs. They are written back to the Frame only
+    // when another frame becomes active or when the loop exits.
+    Frame *frame = nullptr;
+    DecodedInstruction *code = nullptr;
+    DecodedInstruction *ip = nullptr;
+    DecodedInstruction *ins = nullptr;
+    Value *bp = nullptr;
+    CallCache *caches = nullptr;
+
+    auto load_frame = [&]() {
+      frame = &frames[framesIndex - 1];
+      code = frame->state->decoded.data();
+      caches = frame->state->callCaches.data();
+      ip = code + frame->ip;
+      bp = stack.data() + frame->basePointer;
+#if MONKEY_JIT
+      if (options.jit) { ip = code + run_native(*frame, ip - code, bp); }
+#endif
+    };
+
+    auto save_frame = [&]() { frame->ip = static_cast<int>(ip - code); };
+
     try {
-      while (current_frame()->ip <
-             static_cast<int>(current_frame()->instructions().size()) - 1) {
-        current_frame()->ip++;
-
-        auto ip = current_frame()->ip;
-        const auto &ins = current_frame()->instructions();
-        Opecode op = ins[ip];
-
-        switch (op) {
-        case OpConstant: {
-          auto constIndex =
-              read_uint16(&current_frame()->instructions()[ip + 1]);
-          current_frame()->ip += 2;
-          push(constants[constIndex]);
-          break;
-        }
-        case OpAdd:
-        case OpSub:
-        case OpMul:
-        case OpDiv: execute_binary_operation(op); break;
-        case OpTrue: push(CONST_TRUE); break;
-        case OpFalse: push(CONST_FALSE); break;
-        case OpNull: push(CONST_NULL); break;
-        case OpEqual:
-        case OpNotEqual:
-        case OpGreaterThan: execute_comparison(op); break;
-        case OpBang: execute_bang_operator(); break;
-        case OpMinus: execute_minus_operator(); break;
-        case OpPop: pop(); break;
-        case OpJump: {
-          auto pos = read_uint16(&current_frame()->instructions()[ip + 1]);
-          current_frame()->ip = pos - 1;
-          break;
-        }
-        case OpJumpNotTruthy: {
-          auto pos = read_uint16(&current_frame()->instructions()[ip + 1]);
-          current_frame()->ip += 2;
-          auto condition = pop();
-          if (!is_truthy(condition)) { current_frame()->ip = pos - 1; }
-          break;
-        }
-        case OpSetGlobal: {
-          auto globalIndex =
-              read_uint16(&current_frame()->instructions()[ip + 1]);
-          current_frame()->ip += 2;
-          globals[globalIndex] = pop();
-          break;
-        }
-        case OpGetGlobal: {
-          auto globalIndex =
-              read_uint16(&current_frame()->instructions()[ip + 1]);
-          current_frame()->ip += 2;
-          push(globals[globalIndex]);
-          break;
-        }
-        case OpArray: {
-          auto numElements =
-              read_uint16(&current_frame()->instructions()[ip + 1]);
-          current_frame()->ip += 2;
-
-          auto array = build_array(sp - numElements, sp);
-          sp = sp - numElements;
-          push(array);
-          break;
-        }
-        case OpHash: {
-          auto numElements =
-              read_uint16(&current_frame()->instructions()[ip + 1]);
-          current_frame()->ip += 2;
-
-          auto hash = build_hash(sp - numElements, sp);
-          sp = sp - numElements;
-          push(hash);
-          break;
-        }
-        case OpIndex: {
-          auto index = pop();
-          auto left = pop();
-          execute_index_expression(left, index);
-          break;
-        }
-        case OpCall: {
-          auto numArgs = read_uint8(&current_frame()->instructions()[ip + 1]);
-          current_frame()->ip += 1;
-          execute_call(numArgs);
-          break;
-        }
-        case OpReturnValue: {
-          auto returnValue = pop();
-          auto frame = pop_frame();
-          sp = frame->basePointer - 1;
-          push(returnValue);
-          break;
-        }
-        case OpReturn: {
-          auto frame = pop_frame();
-          sp = frame->basePointer - 1;
-          push(CONST_NULL);
-          break;
-        }
-        case OpSetLocal: {
-          auto localIndex =
-              read_uint8(&current_frame()->instructions()[ip + 1]);
-          current_frame()->ip += 1;
-          auto frame = current_frame();
-          stack[frame->basePointer + localIndex] = pop();
-          break;
-        }
-        case OpGetLocal: {
-          auto localIndex =
-              read_uint8(&current_frame()->instructions()[ip + 1]);
-          current_frame()->ip += 1;
-          auto frame = current_frame();
-          push(stack[frame->basePointer + localIndex]);
-          break;
-        }
-        case OpGetBuiltin: {
-          auto builtinIndex = read_uint8(&current_frame()->instructions()[ip + 1]);
-          current_frame()->ip += 1;
-          auto definition = BUILTINS[builtinIndex];
-          push(definition.second);
-          break;
+      auto &state = function_state(current_frame().cl->fn);
+      current_frame().state = &state;
+      reserve_stack(state.stackDepth);
+      load_frame();
+
+#if MONKEY_THREADED_DISPATCH
+      DISPATCH();
+#else
+      for (;;) {
+        COUNT_DISPATCH();
+        ins = ip++;
+        switch (ins->op) {
+#endif
+      TARGET(OpConstant) {
+        push(constants[ins->operands[0]]);
+        DISPATCH();
+      }
+      TARGET(OpAdd)
+      TARGET(OpSub)
+      TARGET(OpMul)
+      TARGET(OpDiv) {
+        auto op = ins->op;
+        quicken_integer_operation(*ins);
+        execute_binary_operation(op);
+        DISPATCH();
+      }
+      TARGET(OpTrue) {
+        push(Value::boolean(true));
+        DISPATCH();
+      }
+      TARGET(OpFalse) {
+        push(Value::boolean(false));
+        DISPATCH();
+      }
+      TARGET(OpNull) {
+        push(Value::null());
+        DISPATCH();
+      }
+      TARGET(OpEqual)
+      TARGET(OpNotEqual)
+      TARGET(OpGreaterThan) {
+        auto op = ins->op;
+        quicken_integer_operation(*ins);
+        execute_comparison(op);
+        DISPATCH();
+      }
+      TARGET(OpBang) {
+        execute_bang_operator();
+        DISPATCH();
+      }
+      TARGET(OpMinus) {
+        execute_minus_operator();
+        DISPATCH();
+      }
+      TARGET(OpPop) {
+        lastPopped = pop();
+        DISPATCH();
+      }
+      TARGET(OpJump) {
+        ip = code + ins->operands[0];
+        DISPATCH();
+      }
+      TARGET(OpJumpNotTruthy) {
+        if (!is_truthy(pop())) { ip = code + ins->operands[0]; }
+        DISPATCH();
+      }
+      TARGET(OpJumpTruthy) {
+        if (is_truthy(pop())) { ip = code + ins->operands[0]; }
+        DISPATCH();
+      }
+      TARGET(OpSetGlobal) {
+        // The REPL shows the value of a `let` as its result.
+        globals[ins->operands[0]] = pop();
+        lastPopped = globals[ins->operands[0]];
+        DISPATCH();
+      }
+      TARGET(OpGetGlobal) {
+        push(globals[ins->operands[0]]);
+        DISPATCH();
+      }
+      TARGET(OpArray) {
+        execute_array_literal(ins->operands[0]);
+        DISPATCH();
+      }
+      TARGET(OpHash) {
+        execute_hash_literal(ins->operands[0]);
+        DISPATCH();
+      }
+      TARGET(OpIndex) {
+        quicken_index(*ins);
+        execute_index_expression();
+        DISPATCH();
+      }
+      TARGET(OpCall) {
+        save_frame();
+        execute_call(ins->operands[0], caches[ins->operands[1]]);
+        load_frame();
+        DISPATCH();
+      }
+      TARGET(OpReturnValue) {
+        framesIndex--;
+        stack[frame->basePointer - 1] = std::move(stack[sp - 1]);
+        release_slots(frame->basePointer);
+        load_frame();
+        DISPATCH();
+      }
+      TARGET(OpReturn) {
+        framesIndex--;
+        release_slots(frame->basePointer - 1);
+        push(Value::null());
+        load_frame();
+        DISPATCH();
+      }
+      TARGET(OpSetLocal) {
+        bp[ins->operands[0]] = pop();
+        DISPATCH();
+      }
+      TARGET(OpGetLocal) {
+        push(bp[ins->operands[0]]);
+        DISPATCH();
+      }
+      TARGET(OpMoveLocal) {
+        push(std::move(bp[ins->operands[0]]));
+        DISPATCH();
+      }
+      TARGET(OpGetBuiltin) {
+        const auto &definition = BUILTINS[ins->operands[0]];
+        push(Value::object(definition.second, BUILTIN_OBJ));
+        DISPATCH();
+      }
+      TARGET(OpClosure) {
+        push_closure(ins->operands[0], ins->operands[1]);
+        DISPATCH();
+      }
+      TARGET(OpGetFree) {
+        push(frame->cl->free[ins->operands[0]]);
+        DISPATCH();
+      }
+      TARGET(OpCurrentClosure) {
+        push(bp[-1]);
+        DISPATCH();
+      }
+      TARGET(OpTailCall) {
+        save_frame();
+        execute_tail_call(ins->operands[0], caches[ins->operands[1]]);
+        load_frame();
+        DISPATCH();
+      }
+      TARGET(OpAddLocalConstant) {
+        push(binary_operation(OpAdd, bp[ins->operands[0]],
+                              constants[ins->operands[1]]));
+        DISPATCH();
+      }
+      TARGET(OpSubLocalConstant) {
+        push(binary_operation(OpSub, bp[ins->operands[0]],
+                              constants[ins->operands[1]]));
+        DISPATCH();
+      }
+      TARGET(OpAddLocals) {
+        push(binary_operation(OpAdd, bp[ins->operands[0]],
+                              bp[ins->operands[1]]));
+        DISPATCH();
+      }
+      TARGET(OpJumpNotEqualConstant) {
+        if (!compare(OpEqual, pop(), constants[ins->operands[1]])) {
+          ip = code + ins->operands[0];
         }
-        case OpClosure: {
-          auto constIndex = read_uint16(&current_frame()->instructions()[ip + 1]);
-          auto numFree = read_uint8(&current_frame()->instructions()[ip + 3]);
-          current_frame()->ip += 3;
-          push_closure(constIndex, numFree);
-          break;
+        DISPATCH();
+      }
+      TARGET(OpJumpNotGreaterThanConstant) {
+        if (!compare(OpGreaterThan, pop(), constants[ins->operands[1]])) {
+          ip = code + ins->operands[0];
         }
-        case OpGetFree: {
-          auto freeIndex = read_uint8(&current_frame()->instructions()[ip + 1]);
-          current_frame()->ip += 1;
-          auto currentClosure = current_frame()->cl;
-          push(currentClosure->free[freeIndex]);
-          break;
+        DISPATCH();
+      }
+      TARGET(OpAddInt) {
+        execute_integer_operation(*ins, [](int64_t l, int64_t r) {
+          return Value::integer(wrapping_add(l, r));
+        });
+        DISPATCH();
+      }
+      TARGET(OpSubInt) {
+        execute_integer_operation(*ins, [](int64_t l, int64_t r) {
+          return Value::integer(wrapping_sub(l, r));
+        });
+        DISPATCH();
+      }
+      TARGET(OpMulInt) {
+        execute_integer_operation(*ins, [](int64_t l, int64_t r) {
+          return Value::integer(wrapping_mul(l, r));
+        });
+        DISPATCH();
+      }
+      TARGET(OpEqualInt) {
+        execute_integer_operation(*ins, [](int64_t l, int64_t r) {
+          return Value::boolean(l == r);
+        });
+        DISPATCH();
+      }
+      TARGET(OpNotEqualInt) {
+        execute_integer_operation(*ins, [](int64_t l, int64_t r) {
+          return Value::boolean(l != r);
+        });
+        DISPATCH();
+      }
+      TARGET(OpGreaterThanInt) {
+        execute_integer_operation(*ins, [](int64_t l, int64_t r) {
+          return Value::boolean(l > r);
+        });
+        DISPATCH();
+      }
+      TARGET(OpAddIntUnchecked) {
+        execute_unchecked_integer_operation([](int64_t l, int64_t r) {
+          return Value::integer(wrapping_add(l, r));
+        });
+        DISPATCH();
+      }
+      TARGET(OpSubIntUnchecked) {
+        execute_unchecked_integer_operation([](int64_t l, int64_t r) {
+          return Value::integer(wrapping_sub(l, r));
+        });
+        DISPATCH();
+      }
+      TARGET(OpMulIntUnchecked) {
+        execute_unchecked_integer_operation([](int64_t l, int64_t r) {
+          return Value::integer(wrapping_mul(l, r));
+        });
+        DISPATCH();
+      }
+      TARGET(OpEqualIntUnchecked) {
+        execute_unchecked_integer_operation([](int64_t l, int64_t r) {
+          return Value::boolean(l == r);
+        });
+        DISPATCH();
+      }
+      TARGET(OpNotEqualIntUnchecked) {
+        execute_unchecked_integer_operation([](int64_t l, int64_t r) {
+          return Value::boolean(l != r);
+        });
+        DISPATCH();
+      }
+      TARGET(OpGreaterThanIntUnchecked) {
+        execute_unchecked_integer_operation([](int64_t l, int64_t r) {
+          return Value::boolean(l > r);
+        });
+        DISPATCH();
+      }
+      TARGET(OpCallKnown) {
+        save_frame();
+        call_known(ins->operands[0], ins->operands[1]);
+        load_frame();
+        DISPATCH();
+      }
+      TARGET(OpIndexArrayInt) {
+        auto &left = stack[sp - 2];
+        const auto &index = stack[sp - 1];
+        if (left.type() == ARRAY_OBJ && index.is_integer()) {
+          left = array_index(left, index.as_integer());
+        } else {
+          deoptimize(*ins, OpIndex);
+          left = index_expression(left, index);
         }
-        case OpCurrentClosure: {
-          auto currentClosure = current_frame()->cl;
-          push(currentClosure);
-          break;
+        stack[--sp].reset();
+        DISPATCH();
+      }
+      TARGET(OpIndexHashString) {
+        auto &left = stack[sp - 2];
+        const auto &index = stack[sp - 1];
+        if (left.type() == HASH_OBJ && index.type() == STRING_OBJ) {
+          left = hash_index(left, index);
+        } else {
+          deoptimize(*ins, OpIndex);
+          left = index_expression(left, index);
         }
+        stack[--sp].reset();
+        DISPATCH();
+      }
+      TARGET(OpHalt) {
+        save_frame();
+        return;
+      }
+#if !MONKEY_THREADED_DISPATCH
+        default:
+          throw make_error(fmt::format("opcode {} undefined", ins->op));
         }
       }
+#endif
     } catch (const std::shared_ptr<Object> &err) {
-      push(err);
-      pop();
+      if (frame) { save_frame(); }
+      lastPopped = Value::object(err, ERROR_OBJ);
+    }
+
+#undef TARGET
+#undef DISPATCH
+#undef COUNT_DISPATCH
+  }
+
+#if MONKEY_JIT
+  // Runs `frame` as native code from `ip` on, compiling its function first
+  // if a call has made it hot, and returns the instruction the interpreter
+  // picks up at. Calls and tail calls enter a frame at 0; returns enter the
+  // caller after its call.
+  size_t run_native(const Frame &frame, size_t ip, Value *bp) {
+    auto &state = *frame.state;
+    if (!state.jitCode) {
+      if (ip != 0 || state.callCount++ < options.jitThreshold) { return ip; }
+      state.jitCode = JitCompiler(state.decoded, constants).compile();
+      if (!state.jitCode) {
+        options.jit = false;
+        return ip;
+      }
     }
+    JitFrame native{stack.data() + sp, bp, constants.data(), globals.data(),
+                    frame.cl->free.data(), &lastPopped};
+    ip = state.jitCode->run(native, ip);
+    sp = static_cast<size_t>(native.top - stack.data());
+    return ip;
+  }
+#endif
+
+  // Calls `callee` with `args` on top of whatever the VM is running, and
+  // returns its result, or the error it failed with. The stack and
+  // `lastPopped` are left as they were.
+  Value call(const Value &callee, const std::vector<Value> &args) {
+    auto numArgs = args.size();
+    auto base = sp;
+    auto frameBase = framesIndex;
+    auto popped = std::move(lastPopped);
+    reserve_stack(numArgs + 1);
+    push(callee);
+    for (const auto &arg : args) {
+      push(arg);
+    }
+
+    // The call runs from a function of its own that does nothing else.
+    if (trampolines.size() <= numArgs) { trampolines.resize(numArgs + 1); }
+    auto &trampoline = trampolines[numArgs];
+    if (!trampoline) {
+      auto fn = std::make_shared<CompiledFunction>(
+          make(OpCall, {static_cast<int>(numArgs)}));
+      trampoline = std::make_shared<Closure>(fn);
+    }
+    push_frame(Frame(trampoline.get(), nullptr, static_cast<int>(base)));
+    run();
+
+    // It got to its OpHalt only if the call returned.
+    auto returned = framesIndex == frameBase + 1 && current_frame().ip == 2;
+    auto result = std::move(returned ? stack[sp - 1] : lastPopped);
+    framesIndex = frameBase;
+    release_slots(base);
+    lastPopped = std::move(popped);
+    return result;
   }
 
-  void push(std::shared_ptr<Object> o) {
-    if (sp >= StackSize) { throw make_error("stack overflow"); }
-    stack[sp] = o;
+  void push(Value val) {
+    stack[sp] = std::move(val);
     sp++;
   }
 
   void push_closure(int constIndex, int numFree) {
-    auto constant = constants[constIndex];
-    auto function = std::dynamic_pointer_cast<CompiledFunction>(constant);
-    if (!function) {
+    const auto &constant = constants[constIndex];
+    if (constant.type() != COMPILED_FUNCTION_OBJ) {
       throw make_error(fmt::format("not a function: {}", constIndex));
     }
+    auto function =
+        std::static_pointer_cast<CompiledFunction>(constant.as_object());
 
-    std::vector<std::shared_ptr<Object>> free;
+    std::vector<Value> free;
     for (int i = 0; i < numFree; i++) {
-      free.push_back(stack[sp - numFree + i]);
+      free.push_back(std::move(stack[sp - numFree + i]));
     }
     sp = sp - numFree;
 
     auto closure = std::make_shared<Closure>(function, free);
-    push(closure);
+    push(Value::object(closure, CLOSURE_OBJ));
   }
 
-  std::shared_ptr<Object> pop() {
-    auto o = stack[sp - 1];
-    stack.pop_back();
+  Value pop() {
     sp--;
-    return o;
+    return std::move(stack[sp]);
   }
 
-  void call_closure(std::shared_ptr<Closure> cl, int numArgs) {
-    if (numArgs != cl->fn->numParameters) {
-      throw make_error(fmt::format("wrong number of arguments: want={}, got={}",
-                                   cl->fn->numParameters, numArgs));
+  // Pushes null for the locals of a new frame past its arguments, up to
+  // `end`. Slots above `sp` hold no objects, but may still hold integers
+  // that an earlier frame left there.
+  void push_locals(size_t end) {
+    while (sp < end) {
+      stack[sp++] = Value::null();
     }
-    auto frame = std::make_shared<Frame>(cl, sp - numArgs);
-    push_frame(frame);
-    sp = frame->basePointer + cl->fn->numLocals;
   }
 
-  void call_builtin(std::shared_ptr<Builtin> builtin, int numArgs) {
-    std::vector<std::shared_ptr<Object>> args;
-    for (int i = 0; i < numArgs; i++) {
-      args.push_back(stack[sp - (numArgs - i)]);
+  // Releases the slots from `from` up to `sp`, which becomes `from`.
+  void release_slots(size_t from) {
+    while (sp > from) {
+      stack[--sp].reset();
+    }
+  }
+
+  // A call site that called `cl.fn` last time has already checked the arity
+  // and looked up the function's state, so a cache hit skips both.
+  FunctionState &check_call(const Closure &cl, int numArgs, CallCache &cache) {
+    if (cl.fn.get() == cache.fn) {
+      callCacheHits++;
+      return *cache.state;
+    }
+    callCacheMisses++;
+    if (numArgs != cl.fn->numParameters) {
+      throw make_error(fmt::format("wrong number of arguments: want={}, got={}",
+                                   cl.fn->numParameters, numArgs));
     }
-    auto result = builtin->fn(args);
-    sp = sp - numArgs;
-    push(result);
+    auto &state = function_state(cl.fn);
+    cache = CallCache{cl.fn.get(), &state};
+    return state;
+  }
+
+  void call_closure(Closure &cl, int numArgs, CallCache &cache) {
+    auto &state = check_call(cl, numArgs, cache);
+    reserve_stack(state.stackDepth - numArgs);
+    auto basePointer = static_cast<int>(sp) - numArgs;
+    push_frame(Frame(&cl, &state, basePointer));
+    push_locals(basePointer + cl.fn->numLocals);
+  }
+
+  // Calls the closure in constant `constIndex`. The compiler has checked
+  // the arity, so only the function's state is left to look up, once.
+  void call_known(int constIndex, int numArgs) {
+    auto &cl = cast<Closure>(constants[constIndex]);
+    auto &state = knownStates[constIndex];
+    if (!state) { state = &function_state(cl.fn); }
+    reserve_stack(state->stackDepth - numArgs);
+    auto basePointer = static_cast<int>(sp) - numArgs;
+    push_frame(Frame(&cl, state, basePointer));
+    push_locals(basePointer + cl.fn->numLocals);
+  }
+
+  void call_builtin(const Builtin &builtin, int numArgs) {
+    auto result = call_builtin(builtin, &stack[sp - numArgs], numArgs);
+    release_slots(sp - numArgs - 1);
+    push(std::move(result));
   }
 
   void execute_binary_operation(Opecode op) {
     auto right = pop();
     auto left = pop();
+    push(binary_operation(op, left, right));
+  }
 
-    auto left_type = left->type();
-    auto right_type = right->type();
+  void execute_comparison(Opecode op) {
+    auto right = pop();
+    auto left = pop();
+    push(Value::boolean(compare(op, left, right)));
+  }
 
-    if (left_type == INTEGER_OBJ && right_type == INTEGER_OBJ) {
-      execute_binary_integer_operation(op, left, right);
+  // Runs an integer form in place on the top two slots. Only the tags are
+  // checked; if an operand isn't an integer, `ins` goes back to the generic
+  // operation, which runs instead.
+  template <typename T>
+  void execute_integer_operation(DecodedInstruction &ins, T fn) {
+    auto &left = stack[sp - 2];
+    const auto &right = stack[sp - 1];
+    if (left.is_integer() && right.is_integer()) {
+      left = fn(left.as_integer(), right.as_integer());
+      sp--;
       return;
     }
+    auto op = generic_opecode(ins.op);
+    deoptimize(ins, op);
+    if (op == OpAdd || op == OpSub || op == OpMul) {
+      execute_binary_operation(op);
+    } else {
+      execute_comparison(op);
+    }
+  }
+
+  // Runs an unchecked integer form in place on the top two slots, which
+  // type inference has proven to hold integers.
+  template <typename T> void execute_unchecked_integer_operation(T fn) {
+    auto &left = stack[sp - 2];
+    left = fn(left.as_integer(), stack[sp - 1].as_integer());
+    sp--;
+  }
+
+  // A quickened instruction that keeps failing its guard stays generic.
+  static const uint8_t MaxDeoptimizations = 4;
+
+  bool may_quicken(const DecodedInstruction &ins) const {
+    return options.quickening && ins.deoptimizations < MaxDeoptimizations;
+  }
+
+  static void rewrite_instruction(DecodedInstruction &ins, Opecode op) {
+    ins.op = op;
+    if (handlers) { ins.handler = handlers[op]; }
+  }
+
+  void deoptimize(DecodedInstruction &ins, Opecode op) {
+    if (!options.quickening) { return; }
+    rewrite_instruction(ins, op);
+    if (ins.deoptimizations < MaxDeoptimizations) { ins.deoptimizations++; }
+  }
+
+  // Called before a generic arithmetic or comparison instruction runs, with
+  // its operands on top of the stack.
+  void quicken_integer_operation(DecodedInstruction &ins) {
+    auto op = integer_opecode(ins.op);
+    if (op == ins.op || !may_quicken(ins)) { return; }
+    if (stack[sp - 2].is_integer() && stack[sp - 1].is_integer()) {
+      rewrite_instruction(ins, op);
+    }
+  }
+
+  void quicken_index(DecodedInstruction &ins) {
+    if (!may_quicken(ins)) { return; }
+    const auto &left = stack[sp - 2];
+    const auto &index = stack[sp - 1];
+    if (left.type() == ARRAY_OBJ && index.is_integer()) {
+      rewrite_instruction(ins, OpIndexArrayInt);
+    } else if (left.type() == HASH_OBJ && index.type() == STRING_OBJ) {
+      rewrite_instruction(ins, OpIndexHashString);
+    }
+  }
+
+  void execute_bang_operator() { push(bang_operator(pop())); }
+
+  void execute_minus_operator() { push(minus_operator(pop())); }
+
+  void execute_index_expression() {
+    auto index = pop();
+    auto left = pop();
+    push(index_expression(left, index));
+  }
+
+  void execute_array_literal(int numElements) {
+    auto array = build_array(&stack[sp - numElements], &stack[sp]);
+    release_slots(sp - numElements);
+    push(Value::object(array, ARRAY_OBJ));
+  }
+
+  void execute_hash_literal(int numElements) {
+    auto hash = build_hash(&stack[sp - numElements], &stack[sp]);
+    release_slots(sp - numElements);
+    push(Value::object(hash, HASH_OBJ));
+  }
+
+  // The operations below don't touch the VM's state; the register VM shares
+  // them so both backends behave the same.
+
+  static Value call_builtin(const Builtin &builtin, const Value *args,
+                            int numArgs) {
+    std::vector<std::shared_ptr<Object>> objects;
+    for (int i = 0; i < numArgs; i++) {
+      objects.push_back(args[i].to_object());
+    }
+    return Value::object(builtin.fn(objects));
+  }
+
+  static Value binary_operation(Opecode op, const Value &left,
+                                const Value &right) {
+    auto left_type = left.type();
+    auto right_type = right.type();
+
+    if (left_type == INTEGER_OBJ && right_type == INTEGER_OBJ) {
+      return binary_integer_operation(op, left.as_integer(),
+                                      right.as_integer());
+    }
 
     if (left_type == STRING_OBJ && right_type == STRING_OBJ) {
-      execute_binary_string_operation(op, left, right);
-      return;
+      return binary_string_operation(op, left, right);
     }
 
     throw make_error(
@@ -291,171 +868,198 @@ struct VM {
                     right_type));
   }
 
-  void execute_binary_integer_operation(Opecode op,
-                                        std::shared_ptr<Object> left,
-                                        std::shared_ptr<Object> right) {
-    auto left_value = cast<Integer>(left).value;
-    auto right_value = cast<Integer>(right).value;
+  // Integer arithmetic wraps around on overflow, as constant folding and
+  // BatchVM do, instead of overflowing signed integers.
+  static int64_t wrapping_add(int64_t l, int64_t r) {
+    return static_cast<int64_t>(static_cast<uint64_t>(l) +
+                                static_cast<uint64_t>(r));
+  }
 
-    int64_t result;
+  static int64_t wrapping_sub(int64_t l, int64_t r) {
+    return static_cast<int64_t>(static_cast<uint64_t>(l) -
+                                static_cast<uint64_t>(r));
+  }
+
+  static int64_t wrapping_mul(int64_t l, int64_t r) {
+    return static_cast<int64_t>(static_cast<uint64_t>(l) *
+                                static_cast<uint64_t>(r));
+  }
 
+  static int64_t wrapping_neg(int64_t n) {
+    return static_cast<int64_t>(0 - static_cast<uint64_t>(n));
+  }
+
+  static Value binary_integer_operation(Opecode op, int64_t left_value,
+                                        int64_t right_value) {
     switch (op) {
-    case OpAdd: result = left_value + right_value; break;
-    case OpSub: result = left_value - right_value; break;
-    case OpMul: result = left_value * right_value; break;
-    case OpDiv: result = left_value / right_value; break;
+    case OpAdd: return Value::integer(wrapping_add(left_value, right_value));
+    case OpSub: return Value::integer(wrapping_sub(left_value, right_value));
+    case OpMul: return Value::integer(wrapping_mul(left_value, right_value));
+    case OpDiv:
+      // The one quotient that overflows wraps to itself.
+      if (right_value == -1) {
+        return Value::integer(wrapping_neg(left_value));
+      }
+      return Value::integer(left_value / right_value);
     default: throw make_error(fmt::format("unknown integer operator: {}", op));
     }
-
-    push(make_integer(result));
   }
 
-  void execute_binary_string_operation(Opecode op, std::shared_ptr<Object> left,
-                                       std::shared_ptr<Object> right) {
-    auto left_value = cast<String>(left).value;
-    auto right_value = cast<String>(right).value;
+  static Value binary_string_operation(Opecode op, const Value &left,
+                                       const Value &right) {
+    const auto &left_value = cast<String>(left).value;
+    const auto &right_value = cast<String>(right).value;
 
     if (op != OpAdd) {
       throw make_error(fmt::format("unknown integer operator: {}", op));
     }
 
-    push(make_string(left_value + right_value));
+    return Value::object(make_string(left_value + right_value), STRING_OBJ);
   }
 
-  void execute_comparison(Opecode op) {
-    auto right = pop();
-    auto left = pop();
+  static bool compare(Opecode op, const Value &left, const Value &right) {
+    auto left_type = left.type();
+    auto right_type = right.type();
 
-    auto left_type = left->type();
-    auto right_type = right->type();
+    if (left_type == INTEGER_OBJ && right_type == INTEGER_OBJ) {
+      return compare_integers(op, left.as_integer(), right.as_integer());
+    }
 
-    if (left_type == INTEGER_OBJ || right_type == INTEGER_OBJ) {
-      execute_integer_comparison(op, left, right);
-      return;
+    if (left_type != BOOLEAN_OBJ || right_type != BOOLEAN_OBJ) {
+      throw make_error(fmt::format("unknown operator: {} ({} {})", op,
+                                   left_type, right_type));
     }
 
-    auto left_value = cast<Boolean>(left).value;
-    auto right_value = cast<Boolean>(right).value;
+    auto left_value = left.as_boolean();
+    auto right_value = right.as_boolean();
 
     switch (op) {
-    case OpEqual: push(make_bool(right_value == left_value)); break;
-    case OpNotEqual: push(make_bool(right_value != left_value)); break;
+    case OpEqual: return right_value == left_value;
+    case OpNotEqual: return right_value != left_value;
     default:
       throw make_error(fmt::format("unknown operator: {} ({} {})", op,
                                    left_type, right_type));
     }
   }
 
-  void execute_integer_comparison(Opecode op, std::shared_ptr<Object> left,
-                                  std::shared_ptr<Object> right) {
-    auto left_value = cast<Integer>(left).value;
-    auto right_value = cast<Integer>(right).value;
-
+  static bool compare_integers(Opecode op, int64_t left_value,
+                               int64_t right_value) {
     switch (op) {
-    case OpEqual: push(make_bool(right_value == left_value)); break;
-    case OpNotEqual: push(make_bool(right_value != left_value)); break;
-    case OpGreaterThan: push(make_bool(left_value > right_value)); break;
-    default: make_error(fmt::format("unknown operator: {}", op));
+    case OpEqual: return right_value == left_value;
+    case OpNotEqual: return right_value != left_value;
+    case OpGreaterThan: return left_value > right_value;
+    default: throw make_error(fmt::format("unknown operator: {}", op));
     }
   }
 
-  void execute_bang_operator() {
-    auto operand = pop();
-    if (operand->type() == BOOLEAN_OBJ) {
-      auto value = cast<Boolean>(operand).value;
-      push(make_bool(!value));
-    } else if (operand->type() == NULL_OBJ) {
-      push(make_bool(true));
+  static Value bang_operator(const Value &operand) {
+    if (operand.is_boolean()) {
+      return Value::boolean(!operand.as_boolean());
+    } else if (operand.is_null()) {
+      return Value::boolean(true);
     } else {
-      push(make_bool(false));
+      return Value::boolean(false);
     }
   }
 
-  void execute_minus_operator() {
-    auto operand = pop();
-    if (operand->type() != INTEGER_OBJ) {
+  static Value minus_operator(const Value &operand) {
+    if (!operand.is_integer()) {
       throw make_error(
-          fmt::format("unsupported types for negation: {}", operand->type()));
+          fmt::format("unsupported types for negation: {}", operand.type()));
     }
 
-    auto value = cast<Integer>(operand).value;
-    push(make_integer(value * -1));
+    return Value::integer(wrapping_neg(operand.as_integer()));
   }
 
-  void execute_index_expression(std::shared_ptr<Object> left,
-                                std::shared_ptr<Object> index) {
-    if (left->type() == ARRAY_OBJ && index->type() == INTEGER_OBJ) {
-      return execute_array_index(left, index);
-    } else if (left->type() == HASH_OBJ) {
-      return execute_hash_index(left, index);
+  static Value index_expression(const Value &left, const Value &index) {
+    if (left.type() == ARRAY_OBJ && index.is_integer()) {
+      return array_index(left, index.as_integer());
+    } else if (left.type() == HASH_OBJ) {
+      return hash_index(left, index);
     } else {
       throw make_error(
-          fmt::format("index operator not supported: {}", left->type()));
+          fmt::format("index operator not supported: {}", left.type()));
     }
   }
 
-  void execute_array_index(std::shared_ptr<Object> array,
-                           std::shared_ptr<Object> index) {
-    auto &arrayObject = cast<Array>(array);
-    auto i = cast<Integer>(index).value;
+  static Value array_index(const Value &array, int64_t i) {
+    const auto &arrayObject = cast<Array>(array);
     int64_t max = arrayObject.elements.size() - 1;
-    if (i < 0 || i > max) {
-      push(CONST_NULL);
-      return;
-    }
-    push(arrayObject.elements[i]);
+    if (i < 0 || i > max) { return Value::null(); }
+    return Value::object(arrayObject.elements[i]);
   }
 
-  void execute_hash_index(std::shared_ptr<Object> hash,
-                          std::shared_ptr<Object> index) {
-    auto &hashObject = cast<Hash>(hash);
-    auto key = index->hash_key();
+  static Value hash_index(const Value &hash, const Value &index) {
+    const auto &hashObject = cast<Hash>(hash);
+    auto key = index.hash_key();
     auto it = hashObject.pairs.find(key);
-    if (it == hashObject.pairs.end()) {
-      push(CONST_NULL);
+    if (it == hashObject.pairs.end()) { return Value::null(); }
+    return Value::object(it->second.value);
+  }
+
+  void execute_call(int numArgs, CallCache &cache) {
+    const auto &callee = stack[sp - 1 - numArgs];
+    if (callee.type() == CLOSURE_OBJ) {
+      call_closure(cast<Closure>(callee), numArgs, cache);
+      return;
+    } else if (callee.type() == BUILTIN_OBJ) {
+      call_builtin(cast<Builtin>(callee), numArgs);
       return;
     }
-    push(it->second.value);
+    throw make_error("calling non-function and non-built-in");
   }
 
-  void execute_call(int numArgs) {
-    auto callee = stack[sp - 1 - numArgs];
-    if (callee) {
-      if (callee->type() == CLOSURE_OBJ) {
-        call_closure(std::dynamic_pointer_cast<Closure>(callee), numArgs);
-        return;
-      } else if (callee->type() == BUILTIN_OBJ) {
-        call_builtin(std::dynamic_pointer_cast<Builtin>(callee), numArgs);
-        return;
-      }
+  // Like `execute_call`, but a closure replaces the function running in the
+  // current frame instead of getting a frame of its own.
+  void execute_tail_call(int numArgs, CallCache &cache) {
+    auto calleeIndex = sp - 1 - numArgs;
+    if (stack[calleeIndex].type() != CLOSURE_OBJ) {
+      execute_call(numArgs, cache);
+      return;
     }
-    throw make_error("calling non-function and non-built-in");
+
+    auto &cl = cast<Closure>(stack[calleeIndex]);
+    auto &state = check_call(cl, numArgs, cache);
+
+    auto &frame = current_frame();
+    auto basePointer = static_cast<size_t>(frame.basePointer);
+    for (size_t i = 0; i <= static_cast<size_t>(numArgs); i++) {
+      stack[basePointer - 1 + i] = std::move(stack[calleeIndex + i]);
+    }
+    release_slots(basePointer + numArgs);
+    frame = Frame(&cl, &state, frame.basePointer);
+
+    reserve_stack(state.stackDepth - numArgs);
+    push_locals(basePointer + cl.fn->numLocals);
   }
 
-  bool is_truthy(std::shared_ptr<Object> obj) const {
-    if (obj->type() == BOOLEAN_OBJ) {
-      return cast<Boolean>(obj).value;
-    } else if (obj->type() == NULL_OBJ) {
+  static bool is_truthy(const Value &val) {
+    if (val.is_boolean()) {
+      return val.as_boolean();
+    } else if (val.is_null()) {
       return false;
     } else {
       return true;
     }
   }
 
-  std::shared_ptr<Object> build_array(int startIndex, int endIndex) {
+  static std::shared_ptr<Object> build_array(const Value *first,
+                                             const Value *last) {
     auto arr = std::make_shared<Array>();
-    for (auto i = startIndex; i < endIndex; i++) {
-      arr->elements.push_back(std::move(stack[i]));
+    for (auto it = first; it != last; ++it) {
+      arr->elements.push_back(it->to_object());
     }
     return arr;
   }
 
-  std::shared_ptr<Object> build_hash(int startIndex, int endIndex) {
+  static std::shared_ptr<Object> build_hash(const Value *first,
+                                            const Value *last) {
     auto hash = std::make_shared<Hash>();
-    for (auto i = startIndex; i < endIndex; i += 2) {
-      auto key = stack[i];
-      auto value = stack[i + 1];
-      hash->pairs[key->hash_key()] = HashPair{key, value};
+    for (auto it = first; it != last; it += 2) {
+      const auto &key = it[0];
+      const auto &value = it[1];
+      hash->pairs[key.hash_key()] =
+          HashPair{key.to_object(), value.to_object()};
     }
     return hash;
   }
@@ -0,0 +1,93 @@
+#include "catch.hpp"
+#include "test-util.hpp"
+
+#include <batch.hpp>
+
+using namespace std;
+using namespace monkey;
+
+struct BatchTestCase {
+  string input; // a program whose last expression is the function to call
+  vector<vector<Value>> rows;
+  size_t batchedRows;
+};
+
+// Checks that a batch call gives each row what a call of its own does.
+void run_batch_test(const vector<BatchTestCase> &tests,
+                    const CompilerOptions &options) {
+  for (const auto &t : tests) {
+    auto ast = parse("([batch])", t.input);
+    REQUIRE(ast != nullptr);
+
+    Compiler compiler(options);
+    compiler.compile(ast);
+    VM vm(compiler.bytecode());
+    vm.run();
+    auto callee = Value::object(vm.last_popped_stack_elem());
+
+    BatchVM batch(vm);
+    batch.batchSize = 3;
+    auto results = batch.call(callee, t.rows);
+    REQUIRE(results.size() == t.rows.size());
+    for (size_t i = 0; i < t.rows.size(); i++) {
+      CHECK(results[i].inspect() == vm.call(callee, t.rows[i]).inspect());
+    }
+    CHECK(batch.batchedRows == t.batchedRows);
+    CHECK(batch.batchedRows + batch.fallbackRows == t.rows.size());
+  }
+}
+
+TEST_CASE("Batch calls", "[batch]") {
+  auto i = [](int64_t n) { return Value::integer(n); };
+  auto b = [](bool v) { return Value::boolean(v); };
+  auto s = [](const char *v) { return Value::object(make_string(v)); };
+
+  vector<BatchTestCase> tests{
+      {
+          "fn(a, b) { if (a > b) { a - b } else { -(b * 2) / 3 } }",
+          {{i(1), i(2)}, {i(5), i(2)}, {i(7), i(7)}, {i(9), i(-4)}},
+          4,
+      },
+      {
+          // Rows of other types go into batches of their own, and the ones
+          // that fail run one by one.
+          "fn(a, b) { if (a == b) { !a } else { 1 + 2 } }",
+          {{i(1), i(1)}, {b(true), b(true)}, {i(2), b(false)}, {b(true), i(3)}},
+          2,
+      },
+      {
+          // Lanes that need a call go on one by one from the start.
+          "let k = 10; let f = fn(x) { fn(y) { if (y > k) { len(\"ab\") } "
+          "else { x + y } } }; f(3)",
+          {{i(1)}, {i(20)}, {i(4)}, {i(11)}, {s("a")}, {}},
+          2,
+      },
+      {
+          "fn(a) { if (a / 2 > 1) { a } }",
+          {{i(8)}, {i(2)}, {i(0)}},
+          3,
+      },
+  };
+
+  run_batch_test(tests, CompilerOptions());
+  run_batch_test(tests, CompilerOptions::level(2));
+}
+
+TEST_CASE("Calls from the host - vm", "[batch]") {
+  string input = "let f = fn(a, b) { a + b }; 99";
+  auto ast = parse("([batch])", input);
+  REQUIRE(ast != nullptr);
+
+  Compiler compiler;
+  compiler.compile(ast);
+  VM vm(compiler.bytecode());
+  vm.run();
+  auto f = Value::object(vm.globals[0].to_object());
+  auto sp = vm.sp;
+
+  CHECK(vm.call(f, {Value::integer(1), Value::integer(2)}).as_integer() == 3);
+  auto err = vm.call(f, {Value::integer(1)});
+  REQUIRE(err.type() == ERROR_OBJ);
+  CHECK(cast<Error>(err).message == "wrong number of arguments: want=2, got=1");
+  CHECK(vm.sp == sp);
+}
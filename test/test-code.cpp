@@ -18,6 +18,12 @@ TEST_CASE("Make", "[code]") {
       {OpAdd, {}, {OpAdd}},
       {OpGetLocal, {255}, {OpGetLocal, 255}},
       {OpClosure, {65534, 255}, {OpClosure, 255, 254, 255}},
+      {OpJumpNotEqualConstant,
+       {65534, 1},
+       {OpJumpNotEqualConstant, 255, 254, 0, 1}},
+      {OpConstant, {65536}, {OpWide, OpConstant, 0, 1, 0, 0}},
+      {OpGetLocal, {256}, {OpWide, OpGetLocal, 0, 0, 1, 0}},
+      {OpClosure, {1, 256}, {OpWide, OpClosure, 0, 0, 0, 1, 0, 0, 1, 0}},
   };
 
   for (const auto &t : tests) {
@@ -41,5 +47,54 @@ TEST_CASE("Instructions string", "[code]") {
   auto concatted = concat_instructions(instructions);
 
   CHECK(to_string(concatted) == expected);
+
+  concatted = concat_instructions({
+      make(OpConstant, {70000}),
+      make(OpGetLocal, {1}),
+  });
+  CHECK(to_string(concatted) == R"(0000 OpConstant 70000\n0006 OpGetLocal 1\n)");
+}
+
+
+TEST_CASE("Decode instructions", "[code]") {
+  auto concatted = concat_instructions({
+      make(OpTrue, {}),
+      make(OpJumpNotTruthy, {10}),
+      make(OpConstant, {1}),
+      make(OpJump, {11}),
+      make(OpNull, {}),
+  });
+
+  auto decoded = decode(concatted);
+
+  REQUIRE(decoded.size() == 6);
+  CHECK(decoded[0].op == OpTrue);
+  CHECK(decoded[1].op == OpJumpNotTruthy);
+  CHECK(decoded[1].operands[0] == 4);
+  CHECK(decoded[2].op == OpConstant);
+  CHECK(decoded[2].operands[0] == 1);
+  CHECK(decoded[3].op == OpJump);
+  CHECK(decoded[3].operands[0] == 5);
+  CHECK(decoded[4].op == OpNull);
+  CHECK(decoded[5].op == OpHalt);
 }
 
+TEST_CASE("Decode wide instructions", "[code]") {
+  auto concatted = concat_instructions({
+      make(OpConstant, {70000}),
+      make(OpJumpNotTruthy, {9999}),
+      make(OpNull, {}),
+  });
+
+  // The jump target was patched in after it stopped fitting its operand.
+  auto widened = widen_jumps(concatted, {{6, 10}});
+  auto decoded = decode(widened);
+
+  REQUIRE(decoded.size() == 4);
+  CHECK(decoded[0].op == OpConstant);
+  CHECK(decoded[0].operands[0] == 70000);
+  CHECK(decoded[1].op == OpJumpNotTruthy);
+  CHECK(decoded[1].operands[0] == 3);
+  CHECK(decoded[2].op == OpNull);
+  CHECK(decoded[3].op == OpHalt);
+}
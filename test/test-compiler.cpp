@@ -37,6 +37,12 @@ void test_constants(const vector<shared_ptr<Object>> &expected,
                         cast<CompiledFunction>(actual[i]).instructions);
       break;
     }
+    case CLOSURE_OBJ: {
+      REQUIRE(actual[i]->type() == CLOSURE_OBJ);
+      test_instructions(cast<Closure>(constant).fn->instructions,
+                        cast<Closure>(actual[i]).fn->instructions);
+      break;
+    }
     default: break;
     }
     i++;
@@ -49,14 +55,14 @@ struct CompilerTestCase {
   vector<Instructions> expectedInstructions;
 };
 
-void run_compiler_test(const char *name,
-                       const vector<CompilerTestCase> &tests) {
+void run_compiler_test(const char *name, const vector<CompilerTestCase> &tests,
+                       const CompilerOptions &options = CompilerOptions()) {
   for (const auto &t : tests) {
     auto ast = parse(name, t.input);
     // cerr << peg::ast_to_s(ast) << endl;
     REQUIRE(ast != nullptr);
 
-    Compiler compiler;
+    Compiler compiler(options);
     compiler.compile(ast);
     auto bytecode = compiler.bytecode();
 
@@ -521,16 +527,14 @@ TEST_CASE("Index Expressions", "[compiler]") {
               make_integer(1),
               make_integer(2),
               make_integer(3),
-              make_integer(1),
-              make_integer(1),
           },
           {
               make(OpConstant, {0}),
               make(OpConstant, {1}),
               make(OpConstant, {2}),
               make(OpArray, {3}),
-              make(OpConstant, {3}),
-              make(OpConstant, {4}),
+              make(OpConstant, {0}),
+              make(OpConstant, {0}),
               make(OpAdd, {}),
               make(OpIndex, {}),
               make(OpPop, {}),
@@ -541,15 +545,13 @@ TEST_CASE("Index Expressions", "[compiler]") {
           {
               make_integer(1),
               make_integer(2),
-              make_integer(2),
-              make_integer(1),
           },
           {
               make(OpConstant, {0}),
               make(OpConstant, {1}),
               make(OpHash, {2}),
-              make(OpConstant, {2}),
-              make(OpConstant, {3}),
+              make(OpConstant, {1}),
+              make(OpConstant, {0}),
               make(OpSub, {}),
               make(OpIndex, {}),
               make(OpPop, {}),
@@ -1027,13 +1029,12 @@ TEST_CASE("Resursive Functions", "[compiler]") {
                   make(OpCall, {1}),
                   make(OpReturnValue, {}),
               }),
-              make_integer(1),
           },
           {
               make(OpClosure, {1, 0}),
               make(OpSetGlobal, {0}),
               make(OpGetGlobal, {0}),
-              make(OpConstant, {2}),
+              make(OpConstant, {0}),
               make(OpCall, {1}),
               make(OpPop, {}),
           },
@@ -1056,18 +1057,17 @@ TEST_CASE("Resursive Functions", "[compiler]") {
                   make(OpCall, {1}),
                   make(OpReturnValue, {}),
               }),
-              make_integer(1),
               make_compiled_function({
                 make(OpClosure, {1, 0}),
                 make(OpSetLocal, {0}),
                 make(OpGetLocal, {0}),
-                make(OpConstant, {2}),
+                make(OpConstant, {0}),
                 make(OpCall, {1}),
                 make(OpReturnValue, {}),
               }),
           },
           {
-              make(OpClosure, {3, 0}),
+              make(OpClosure, {2, 0}),
               make(OpSetGlobal, {0}),
               make(OpGetGlobal, {0}),
               make(OpCall, {0}),
@@ -1078,3 +1078,689 @@ TEST_CASE("Resursive Functions", "[compiler]") {
 
   run_compiler_test("([compiler]: Resursive Functions)", tests);
 }
+
+TEST_CASE("Superinstructions", "[compiler]") {
+  vector<CompilerTestCase> tests{
+      {
+          R"(
+            fn(a, b) { if (a > 1) { a + b } else { a - 1 } };
+          )",
+          {
+              make_integer(1),
+              make_compiled_function({
+                  make(OpGetLocal, {0}),
+                  make(OpJumpNotGreaterThanConstant, {13, 0}),
+                  make(OpAddLocals, {0, 1}),
+                  make(OpJump, {17}),
+                  make(OpSubLocalConstant, {0, 0}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpClosure, {1, 0}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          // The `OpConstant` is a jump target, so the sequence isn't fused.
+          R"(
+            fn(a) { if (a) { a } else { a } + 1 };
+          )",
+          {
+              make_integer(1),
+              make_compiled_function({
+                  make(OpGetLocal, {0}),
+                  make(OpJumpNotTruthy, {10}),
+                  make(OpGetLocal, {0}),
+                  make(OpJump, {12}),
+                  make(OpGetLocal, {0}),
+                  make(OpConstant, {0}),
+                  make(OpAdd, {}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpClosure, {1, 0}),
+              make(OpPop, {}),
+          },
+      },
+  };
+
+  CompilerOptions options;
+  options.superinstructions = true;
+  run_compiler_test("([compiler]: Superinstructions)", tests, options);
+}
+
+TEST_CASE("Tail Calls", "[compiler]") {
+  vector<CompilerTestCase> tests{
+      {
+          R"(
+            let f = fn(x) { if (x) { f(x) } else { f(x) + 1 } };
+          )",
+          {
+              make_integer(1),
+              make_compiled_function({
+                  make(OpGetLocal, {0}),
+                  make(OpJumpNotTruthy, {13}),
+                  make(OpCurrentClosure, {}),
+                  make(OpGetLocal, {0}),
+                  make(OpTailCall, {1}),
+                  make(OpJump, {22}),
+                  make(OpCurrentClosure, {}),
+                  make(OpGetLocal, {0}),
+                  make(OpCall, {1}),
+                  make(OpConstant, {0}),
+                  make(OpAdd, {}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpClosure, {1, 0}),
+              make(OpSetGlobal, {0}),
+          },
+      },
+      {
+          R"(
+            fn() { return len([]); };
+          )",
+          {
+              make_compiled_function({
+                  make(OpGetBuiltin, {0}),
+                  make(OpArray, {0}),
+                  make(OpTailCall, {1}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpClosure, {0, 0}),
+              make(OpPop, {}),
+          },
+      },
+  };
+
+  CompilerOptions options;
+  options.tailCalls = true;
+  run_compiler_test("([compiler]: Tail Calls)", tests, options);
+}
+
+TEST_CASE("Constant Folding", "[compiler]") {
+  vector<CompilerTestCase> tests{
+      {
+          "2 * 60 * 60",
+          {make_integer(7200)},
+          {
+              make(OpConstant, {0}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          "-5; !!5; 1 < 2; true != false",
+          {make_integer(-5)},
+          {
+              make(OpConstant, {0}),
+              make(OpPop, {}),
+              make(OpTrue, {}),
+              make(OpPop, {}),
+              make(OpTrue, {}),
+              make(OpPop, {}),
+              make(OpTrue, {}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          R"("mon" + "key" == "monkey")",
+          {make_string("monkey")},
+          {
+              make(OpConstant, {0}),
+              make(OpConstant, {0}),
+              make(OpEqual, {}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          "let x = 1; x + 2 * 3; 1 / 0",
+          {make_integer(1), make_integer(6), make_integer(0)},
+          {
+              make(OpConstant, {0}),
+              make(OpSetGlobal, {0}),
+              make(OpGetGlobal, {0}),
+              make(OpConstant, {1}),
+              make(OpAdd, {}),
+              make(OpPop, {}),
+              make(OpConstant, {0}),
+              make(OpConstant, {2}),
+              make(OpDiv, {}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          // Overflow wraps, and INT64_MIN / -1 is left to run time.
+          "9223372036854775807 + 1; (-9223372036854775807 - 1) / -1",
+          {make_integer(INT64_MIN), make_integer(-1)},
+          {
+              make(OpConstant, {0}),
+              make(OpPop, {}),
+              make(OpConstant, {0}),
+              make(OpConstant, {1}),
+              make(OpDiv, {}),
+              make(OpPop, {}),
+          },
+      },
+  };
+
+  CompilerOptions options;
+  options.constantFolding = true;
+  run_compiler_test("([compiler]: Constant Folding)", tests, options);
+}
+
+TEST_CASE("Peephole", "[compiler]") {
+  vector<CompilerTestCase> tests{
+      {
+          "if (true) { 10 }; 3333;",
+          {make_integer(10), make_integer(3333)},
+          {
+              make(OpConstant, {0}),
+              make(OpPop, {}),
+              make(OpConstant, {1}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          "if (false) { 10 } else { 20 }",
+          {make_integer(10), make_integer(20)},
+          {
+              make(OpConstant, {1}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          // The code after the `if` can't be reached.
+          "fn(x) { if (!x) { return 1 } else { return 2 }; 3 }",
+          {
+              make_integer(1),
+              make_integer(2),
+              make_integer(3),
+              make_compiled_function({
+                  make(OpGetLocal, {0}),
+                  make(OpJumpTruthy, {9}),
+                  make(OpConstant, {0}),
+                  make(OpReturnValue, {}),
+                  make(OpConstant, {1}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpClosure, {3, 0}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          // The inner `if` jumps straight to the end of the outer one.
+          "fn(x) { if (x) { if (x) { 1 } else { 2 } } else { 3 } }",
+          {
+              make_integer(1),
+              make_integer(2),
+              make_integer(3),
+              make_compiled_function({
+                  make(OpGetLocal, {0}),
+                  make(OpJumpNotTruthy, {22}),
+                  make(OpGetLocal, {0}),
+                  make(OpJumpNotTruthy, {16}),
+                  make(OpConstant, {0}),
+                  make(OpJump, {25}),
+                  make(OpConstant, {1}),
+                  make(OpJump, {25}),
+                  make(OpConstant, {2}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpClosure, {3, 0}),
+              make(OpPop, {}),
+          },
+      },
+  };
+
+  CompilerOptions options;
+  options.peephole = true;
+  run_compiler_test("([compiler]: Peephole)", tests, options);
+}
+
+TEST_CASE("Dead Code", "[compiler]") {
+  vector<CompilerTestCase> tests{
+      {
+          R"(
+            fn(a) {
+              let f = fn() { 1 };
+              let b = 2;
+              let c = a;
+              3;
+              return c;
+              let d = 4;
+              d
+            }
+          )",
+          {
+              make_compiled_function({
+                  make(OpGetLocal, {0}),
+                  make(OpSetLocal, {1}),
+                  make(OpGetLocal, {1}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpClosure, {0, 0}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          // Globals may be read later, and the last value is kept.
+          R"(1; "two"; [1, 2]; let x = 3; 4; 5 + 6; let y = 7;)",
+          {make_integer(3), make_integer(5), make_integer(6),
+           make_integer(7)},
+          {
+              make(OpConstant, {0}),
+              make(OpSetGlobal, {0}),
+              make(OpConstant, {1}),
+              make(OpConstant, {2}),
+              make(OpAdd, {}),
+              make(OpPop, {}),
+              make(OpConstant, {3}),
+              make(OpSetGlobal, {1}),
+          },
+      },
+      {
+          // `y` is never assigned but still has a slot.
+          "fn(a) { if (a) { return 1; let y = 2 }; y }",
+          {
+              make_integer(1),
+              make_compiled_function({
+                  make(OpGetLocal, {0}),
+                  make(OpJumpNotTruthy, {12}),
+                  make(OpConstant, {0}),
+                  make(OpReturnValue, {}),
+                  make(OpJump, {13}),
+                  make(OpNull, {}),
+                  make(OpPop, {}),
+                  make(OpGetLocal, {1}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpClosure, {1, 0}),
+              make(OpPop, {}),
+          },
+      },
+  };
+
+  CompilerOptions options;
+  options.deadCode = true;
+  run_compiler_test("([compiler]: Dead Code)", tests, options);
+
+  string input = "fn(a) { let b = 1; let c = 2; c }";
+  auto ast = parse("([compiler]: Dead Code)", input);
+  REQUIRE(ast != nullptr);
+
+  Compiler compiler(options);
+  compiler.compile(ast);
+  auto fn = compiler.bytecode().constants.back();
+  CHECK(cast<CompiledFunction>(fn).numLocals == 2);
+}
+
+TEST_CASE("Type Inference", "[compiler]") {
+  vector<CompilerTestCase> tests{
+      {
+          // Operands proven to be integers get the unchecked forms.
+          R"(let a = 1; let b = a * 2; b > a; "a" + "b")",
+          {make_integer(1), make_integer(2), make_string("a"),
+           make_string("b")},
+          {
+              make(OpConstant, {0}),
+              make(OpSetGlobal, {0}),
+              make(OpGetGlobal, {0}),
+              make(OpConstant, {1}),
+              make(OpMulIntUnchecked, {}),
+              make(OpSetGlobal, {1}),
+              make(OpGetGlobal, {1}),
+              make(OpGetGlobal, {0}),
+              make(OpGreaterThanIntUnchecked, {}),
+              make(OpPop, {}),
+              make(OpConstant, {2}),
+              make(OpConstant, {3}),
+              make(OpAdd, {}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          // `n` may be an integer, but nothing is known about `n - 1 + n`.
+          "fn(n) { n - 1 + n }",
+          {
+              make_integer(1),
+              make_compiled_function({
+                  make(OpGetLocal, {0}),
+                  make(OpConstant, {0}),
+                  make(OpSubInt, {}),
+                  make(OpGetLocal, {0}),
+                  make(OpAdd, {}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpClosure, {1, 0}),
+              make(OpPop, {}),
+          },
+      },
+  };
+
+  CompilerOptions options;
+  options.typeInference = true;
+  run_compiler_test("([compiler]: Type Inference)", tests, options);
+}
+
+TEST_CASE("Inlining", "[compiler]") {
+  vector<CompilerTestCase> tests{
+      {
+          "let double = fn(x) { x * 2 }; double(3)",
+          {
+              make_integer(2),
+              make_compiled_function({
+                  make(OpGetLocal, {0}),
+                  make(OpConstant, {0}),
+                  make(OpMul, {}),
+                  make(OpReturnValue, {}),
+              }),
+              make_integer(3),
+          },
+          {
+              make(OpClosure, {1, 0}),
+              make(OpSetGlobal, {0}),
+              make(OpConstant, {2}),
+              make(OpSetLocal, {0}),
+              make(OpGetLocal, {0}),
+              make(OpConstant, {0}),
+              make(OpMul, {}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          // Recursive functions are called as usual.
+          "let f = fn(x) { f(x) }; f(1)",
+          {
+              make_compiled_function({
+                  make(OpCurrentClosure, {}),
+                  make(OpGetLocal, {0}),
+                  make(OpCall, {1}),
+                  make(OpReturnValue, {}),
+              }),
+              make_integer(1),
+          },
+          {
+              make(OpClosure, {0, 0}),
+              make(OpSetGlobal, {0}),
+              make(OpGetGlobal, {0}),
+              make(OpConstant, {1}),
+              make(OpCall, {1}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          // So are functions with a `let` in a branch, whose slot would
+          // keep what an earlier inlined call left there.
+          "let f = fn(c) { if (c) { let x = c; x }; x }; f(true)",
+          {
+              make_compiled_function({
+                  make(OpGetLocal, {0}),
+                  make(OpJumpNotTruthy, {14}),
+                  make(OpGetLocal, {0}),
+                  make(OpSetLocal, {1}),
+                  make(OpGetLocal, {1}),
+                  make(OpJump, {15}),
+                  make(OpNull, {}),
+                  make(OpPop, {}),
+                  make(OpGetLocal, {1}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpClosure, {0, 0}),
+              make(OpSetGlobal, {0}),
+              make(OpGetGlobal, {0}),
+              make(OpTrue, {}),
+              make(OpCall, {1}),
+              make(OpPop, {}),
+          },
+      },
+  };
+
+  CompilerOptions options;
+  options.inlining = true;
+  run_compiler_test("([compiler]: Inlining)", tests, options);
+}
+
+TEST_CASE("Lambda Lifting", "[compiler]") {
+  auto closure = [](const vector<Instructions> &instructions) {
+    return make_shared<Closure>(static_pointer_cast<CompiledFunction>(
+        make_compiled_function(instructions)));
+  };
+
+  vector<CompilerTestCase> tests{
+      {
+          "let add = fn(a, b) { a + b }; add(1, 2)",
+          {
+              closure({
+                  make(OpGetLocal, {0}),
+                  make(OpGetLocal, {1}),
+                  make(OpAdd, {}),
+                  make(OpReturnValue, {}),
+              }),
+              make_integer(1),
+              make_integer(2),
+          },
+          {
+              make(OpConstant, {0}),
+              make(OpSetGlobal, {0}),
+              make(OpConstant, {0}),
+              make(OpConstant, {1}),
+              make(OpConstant, {2}),
+              make(OpCallKnown, {0, 2}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          // Only the inner function has a free variable.
+          "fn(a) { fn(b) { a + b } }",
+          {
+              make_compiled_function({
+                  make(OpGetFree, {0}),
+                  make(OpGetLocal, {0}),
+                  make(OpAdd, {}),
+                  make(OpReturnValue, {}),
+              }),
+              closure({
+                  make(OpGetLocal, {0}),
+                  make(OpClosure, {0, 1}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpConstant, {1}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          // A call with the wrong number of arguments fails as usual.
+          "let f = fn(a) { a }; f()",
+          {
+              closure({
+                  make(OpGetLocal, {0}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpConstant, {0}),
+              make(OpSetGlobal, {0}),
+              make(OpGetGlobal, {0}),
+              make(OpCall, {0}),
+              make(OpPop, {}),
+          },
+      },
+  };
+
+  CompilerOptions options;
+  options.lambdaLifting = true;
+  run_compiler_test("([compiler]: Lambda Lifting)", tests, options);
+}
+
+TEST_CASE("Release Locals", "[compiler]") {
+  vector<CompilerTestCase> tests{
+      {
+          R"(
+            fn(a, b) { let c = a + b; a; c };
+          )",
+          {
+              make_compiled_function({
+                  make(OpGetLocal, {0}),
+                  make(OpMoveLocal, {1}),
+                  make(OpAdd, {}),
+                  make(OpSetLocal, {2}),
+                  make(OpMoveLocal, {0}),
+                  make(OpPop, {}),
+                  make(OpMoveLocal, {2}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpClosure, {0, 0}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          // `a` is still read on the other branch.
+          R"(
+            fn(a, b) { if (a) { b } else { a } };
+          )",
+          {
+              make_compiled_function({
+                  make(OpGetLocal, {0}),
+                  make(OpJumpNotTruthy, {10}),
+                  make(OpMoveLocal, {1}),
+                  make(OpJump, {12}),
+                  make(OpMoveLocal, {0}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpClosure, {0, 0}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          // A local that is never read isn't stored.
+          R"(
+            fn() { let x = [1]; 2 };
+          )",
+          {
+              make_integer(1),
+              make_integer(2),
+              make_compiled_function({
+                  make(OpConstant, {0}),
+                  make(OpArray, {1}),
+                  make(OpPop, {}),
+                  make(OpConstant, {1}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpClosure, {2, 0}),
+              make(OpPop, {}),
+          },
+      },
+  };
+
+  CompilerOptions options;
+  options.releaseLocals = true;
+  run_compiler_test("([compiler]: Release Locals)", tests, options);
+}
+
+TEST_CASE("Constant Deduplication", "[compiler]") {
+  vector<CompilerTestCase> tests{
+      {
+          R"(1; "a"; 1; "a")",
+          {make_integer(1), make_string("a")},
+          {
+              make(OpConstant, {0}),
+              make(OpPop, {}),
+              make(OpConstant, {1}),
+              make(OpPop, {}),
+              make(OpConstant, {0}),
+              make(OpPop, {}),
+              make(OpConstant, {1}),
+              make(OpPop, {}),
+          },
+      },
+      {
+          "fn(x) { x }; fn(y) { y }",
+          {
+              make_compiled_function({
+                  make(OpGetLocal, {0}),
+                  make(OpReturnValue, {}),
+              }),
+          },
+          {
+              make(OpClosure, {0, 0}),
+              make(OpPop, {}),
+              make(OpClosure, {0, 0}),
+              make(OpPop, {}),
+          },
+      },
+  };
+
+  run_compiler_test("([compiler]: Constant Deduplication)", tests);
+
+  // Constants of earlier REPL lines are shared as well.
+  auto symbolTable = symbol_table();
+  vector<shared_ptr<Object>> constants;
+  for (string input : {"1 + 2", "2 + 3"}) {
+    auto ast = parse("([compiler]: Constant Deduplication)", input);
+    REQUIRE(ast != nullptr);
+    Compiler compiler(symbolTable, constants);
+    compiler.compile(ast);
+    constants = compiler.constants;
+  }
+  CHECK(constants.size() == 3);
+}
+
+TEST_CASE("Optimization Levels", "[compiler]") {
+  auto enabled = [](const CompilerOptions &options) {
+    vector<string> names;
+    for (const auto &pass : Compiler::passes()) {
+      if (options.*pass.enabled) { names.push_back(pass.name); }
+    }
+    return names;
+  };
+
+  CHECK(enabled(CompilerOptions::level(0)).empty());
+  CHECK(enabled(CompilerOptions::level(1)) ==
+        vector<string>{"constant-folding", "peephole", "release-locals"});
+  CHECK(enabled(CompilerOptions::level(2)) ==
+        vector<string>{"constant-folding", "dead-code", "type-inference",
+                       "inlining", "lambda-lifting", "peephole", "tail-calls",
+                       "superinstructions", "release-locals"});
+
+  REQUIRE(Compiler::find_pass("peephole") != nullptr);
+  CHECK(Compiler::find_pass("peephole")->enabled == &CompilerOptions::peephole);
+  CHECK(Compiler::find_pass("loop-unrolling") == nullptr);
+
+  vector<CompilerTestCase> tests{
+      {
+          "if (true) { 1 + 2 }",
+          {make_integer(3)},
+          {
+              make(OpConstant, {0}),
+              make(OpPop, {}),
+          },
+      },
+  };
+  run_compiler_test("([compiler]: Optimization Levels)", tests,
+                    CompilerOptions::level(1));
+}
@@ -0,0 +1,100 @@
+#include "catch.hpp"
+#include "test-util.hpp"
+
+#include <ir_compiler.hpp>
+
+using namespace std;
+using namespace monkey;
+
+struct IRCompilerTestCase {
+  string input;
+  string expectedIR;
+};
+
+void run_ir_compiler_test(const char *name,
+                          const vector<IRCompilerTestCase> &tests,
+                          CompilerOptions options) {
+  options.ssa = true;
+  options.dumpIR = true;
+  for (const auto &t : tests) {
+    auto ast = parse(name, t.input);
+    REQUIRE(ast != nullptr);
+
+    IRCompiler compiler(options);
+    compiler.compile(ast);
+    CHECK(compiler.irDump == t.expectedIR);
+  }
+}
+
+TEST_CASE("Value numbering", "[ir compiler]") {
+  vector<IRCompilerTestCase> tests{
+      {
+          // The second `a + 2` and both reads of `a` reuse known values.
+          "let a = 1; let b = a + 2; a + 2",
+          "b0:\n"
+          "  v0: integer = const 1\n"
+          "  set_global 0 v0\n"
+          "  v2: integer = const 2\n"
+          "  v3: integer = OpAdd v0, v2\n"
+          "  set_global 1 v3\n"
+          "  pop v3\n"
+          "  end\n",
+      },
+      {
+          // A global defined in a branch is loaded after the `if`.
+          "let a = 1; if (true) { let a = 2; }; a",
+          "b0:\n"
+          "  v0: integer = const 1\n"
+          "  set_global 0 v0\n"
+          "  v2: boolean = const true\n"
+          "  branch v2 b1 b2\n"
+          "b1: <- b0\n"
+          "  v3: integer = const 2\n"
+          "  set_global 1 v3\n"
+          "  v5: null = const null\n"
+          "  jump b3\n"
+          "b2: <- b0\n"
+          "  v6: null = const null\n"
+          "  jump b3\n"
+          "b3: <- b1 b2\n"
+          "  v7: null = phi v5, v6\n"
+          "  pop v7\n"
+          "  v9: any = get_global 1\n"
+          "  pop v9\n"
+          "  end\n",
+      },
+  };
+
+  run_ir_compiler_test("([ir compiler])", tests, CompilerOptions());
+}
+
+TEST_CASE("Constant propagation across branches", "[ir compiler]") {
+  vector<IRCompilerTestCase> tests{
+      {
+          // `x` is 1 where `x == 1` holds.
+          "fn(x) { if (x == 1) { x + 1 } else { 0 } }",
+          "b0:\n"
+          "  v0: any = param 0\n"
+          "  v1: integer = const 1\n"
+          "  v2: boolean = OpEqual v0, v1\n"
+          "  branch v2 b1 b2\n"
+          "b1: <- b0\n"
+          "  v3: integer = const 2\n"
+          "  jump b3\n"
+          "b2: <- b0\n"
+          "  v4: integer = const 0\n"
+          "  jump b3\n"
+          "b3: <- b1 b2\n"
+          "  v5: integer = phi v3, v4\n"
+          "  return v5\n"
+          "b0:\n"
+          "  v0: function = closure 3\n"
+          "  pop v0\n"
+          "  end\n",
+      },
+  };
+
+  CompilerOptions options;
+  options.constantFolding = true;
+  run_ir_compiler_test("([ir compiler])", tests, options);
+}
@@ -23,3 +23,58 @@ TEST_CASE("String hash key", "[object]") {
   CHECK(diff1.hash_key() == diff2.hash_key());
   CHECK_FALSE(hello1.hash_key() == diff1.hash_key());
 }
+
+TEST_CASE("Value immediates", "[object]") {
+  auto i = Value::integer(42);
+  auto b = Value::boolean(true);
+  auto n = Value::null();
+
+  CHECK(i.is_integer());
+  CHECK(i.as_integer() == 42);
+  CHECK(b.is_boolean());
+  CHECK(b.as_boolean());
+  CHECK(n.is_null());
+
+  test_integer_object(42, i.to_object());
+  CHECK(b.to_object().get() == CONST_TRUE.get());
+  CHECK(n.to_object().get() == CONST_NULL.get());
+
+  CHECK(i.hash_key() == make_integer(42)->hash_key());
+  CHECK(b.hash_key() == CONST_TRUE->hash_key());
+}
+
+TEST_CASE("Value objects", "[object]") {
+  auto unboxed = Value::object(make_integer(7));
+  CHECK(unboxed.is_integer());
+  CHECK(unboxed.as_integer() == 7);
+
+  auto str = make_string("monkey");
+  auto val = Value::object(str);
+  REQUIRE(val.is_object());
+  CHECK(val.type() == STRING_OBJ);
+  CHECK(val.as_object().get() == str.get());
+  CHECK(cast<String>(val).value == "monkey");
+
+  auto copied = val;
+  CHECK(str.use_count() == 3);
+
+  auto moved = std::move(copied);
+  CHECK(copied.is_null());
+  CHECK(str.use_count() == 3);
+
+  moved = Value::integer(1);
+  CHECK(str.use_count() == 2);
+}
+
+TEST_CASE("Small integers", "[object]") {
+  CHECK(make_integer(0).get() == make_integer(0).get());
+  CHECK(make_integer(MONKEY_SMALL_INTEGER_MIN).get() ==
+        make_integer(MONKEY_SMALL_INTEGER_MIN).get());
+  CHECK(make_integer(MONKEY_SMALL_INTEGER_MAX).get() ==
+        make_integer(MONKEY_SMALL_INTEGER_MAX).get());
+
+  auto large = int64_t(MONKEY_SMALL_INTEGER_MAX) + 1;
+  CHECK(make_integer(large).get() != make_integer(large).get());
+  test_integer_object(large, make_integer(large));
+  test_integer_object(-1, make_integer(-1));
+}
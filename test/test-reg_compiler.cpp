@@ -0,0 +1,99 @@
+#include "catch.hpp"
+#include "test-util.hpp"
+
+#include <reg_compiler.hpp>
+
+using namespace std;
+using namespace monkey;
+
+struct RegCompilerTestCase {
+  string input;
+  RegInstructions expectedMain;
+  vector<RegInstructions> expectedFunctions;
+};
+
+void run_reg_compiler_test(const char *name,
+                           const vector<RegCompilerTestCase> &tests) {
+  for (const auto &t : tests) {
+    auto ast = parse(name, t.input);
+    REQUIRE(ast != nullptr);
+
+    RegCompiler compiler;
+    compiler.compile(ast);
+    auto bytecode = compiler.bytecode();
+
+    CHECK(to_string(bytecode.functions.at(bytecode.main.get()).instructions) ==
+          to_string(t.expectedMain));
+
+    size_t i = 0;
+    for (const auto &constant : bytecode.constants) {
+      if (constant->type() != COMPILED_FUNCTION_OBJ) { continue; }
+      REQUIRE(i < t.expectedFunctions.size());
+      const auto &fn = cast<CompiledFunction>(constant);
+      CHECK(to_string(bytecode.functions.at(&fn).instructions) ==
+            to_string(t.expectedFunctions[i]));
+      i++;
+    }
+    CHECK(i == t.expectedFunctions.size());
+  }
+}
+
+TEST_CASE("Register code", "[reg compiler]") {
+  vector<RegCompilerTestCase> tests{
+      {
+          "1 + 2 * 3",
+          {
+              {RegLoadConstant, 1, 0},
+              {RegLoadConstant, 3, 1},
+              {RegLoadConstant, 4, 2},
+              {RegMul, 2, 3, 4},
+              {RegAdd, 0, 1, 2},
+              {RegPop, 0},
+              {RegHalt},
+          },
+          {},
+      },
+      {
+          "let a = 1; if (a < 2) { a } else { -a }",
+          {
+              {RegLoadConstant, 0, 0},
+              {RegSetGlobal, 0, 0},
+              {RegLoadConstant, 2, 1},
+              {RegGetGlobal, 3, 0},
+              {RegGreaterThan, 1, 2, 3},
+              {RegJumpNotTruthy, 8, 1},
+              {RegGetGlobal, 0, 0},
+              {RegJump, 10},
+              {RegGetGlobal, 1, 0},
+              {RegMinus, 0, 1},
+              {RegPop, 0},
+              {RegHalt},
+          },
+          {},
+      },
+      {
+          // Locals live in their own registers and arguments are evaluated
+          // right after the callee, where the callee's frame starts.
+          "let f = fn(x) { let y = x + 1; f(y, [x]) }",
+          {
+              {RegClosure, 0, 1, 0},
+              {RegSetGlobal, 0, 0},
+              {RegHalt},
+          },
+          {
+              {
+                  {RegLoadConstant, 2, 0},
+                  {RegAdd, 1, 0, 2},
+                  {RegCurrentClosure, 3},
+                  {RegMove, 4, 1},
+                  {RegMove, 6, 0},
+                  {RegArray, 5, 6, 1},
+                  {RegCall, 2, 3, 2},
+                  {RegReturn, 2},
+              },
+          },
+      },
+  };
+
+  run_reg_compiler_test("([reg compiler]: Register code)", tests);
+}
@@ -0,0 +1,148 @@
+#include "catch.hpp"
+#include "test-util.hpp"
+
+#include <aot.hpp>
+#include <transpiler.hpp>
+
+using namespace std;
+using namespace monkey;
+
+struct TranspilerTestCase {
+  string input;
+  string expectedProgram;
+  string expectedFunctions;
+};
+
+void run_transpiler_test(const char *name,
+                         const vector<TranspilerTestCase> &tests) {
+  for (const auto &t : tests) {
+    auto ast = parse(name, t.input);
+    REQUIRE(ast != nullptr);
+
+    Transpiler transpiler;
+    transpiler.transpile(ast);
+
+    CHECK(transpiler.scopes[0].body == t.expectedProgram);
+    CHECK(transpiler.definitions == t.expectedFunctions);
+  }
+}
+
+TEST_CASE("Transpiled expressions", "[transpiler]") {
+  vector<TranspilerTestCase> tests{
+      {
+          "1 + 2 < 3",
+          "  (void)aot::greater_than(Value::integer(3), "
+          "aot::add(Value::integer(1), Value::integer(2)));\n",
+          "",
+      },
+      {
+          "let x = if (true) { 10 } else { \"a\" }; !x",
+          "  Value t0;\n"
+          "  if (true) {\n"
+          "    t0 = Value::integer(10);\n"
+          "  } else {\n"
+          "    t0 = s0;\n"
+          "  }\n"
+          "  g0 = t0;\n"
+          "  (void)aot::bang(g0);\n",
+          "",
+      },
+      {
+          // The left operand fails before the call has its effect.
+          "[1][0] + len([])",
+          "  auto t2 = aot::index(aot::array({Value::integer(1)}), "
+          "Value::integer(0));\n"
+          "  Value t0[] = {aot::array({})};\n"
+          "  auto t1 = aot::call(aot::builtin(0), t0, 1);\n"
+          "  (void)aot::add(t2, t1);\n",
+          "",
+      },
+      {
+          // Of two operands that fail, the left one fails first.
+          "-true + -\"a\"",
+          "  auto t0 = aot::minus(Value::boolean(true));\n"
+          "  (void)aot::add(t0, aot::minus(s0));\n",
+          "",
+      },
+      {
+          "[1][-true][-\"a\"]",
+          "  auto t0 = aot::array({Value::integer(1)});\n"
+          "  auto t1 = aot::index(t0, aot::minus(Value::boolean(true)));\n"
+          "  (void)aot::index(t1, aot::minus(s0));\n",
+          "",
+      },
+  };
+
+  run_transpiler_test("[transpiler]", tests);
+}
+
+TEST_CASE("Transpiled functions", "[transpiler]") {
+  vector<TranspilerTestCase> tests{
+      {
+          "let f = fn(a) { f(a) }; f(1)",
+          "  g0 = f0;\n"
+          "  Value t0[] = {Value::integer(1)};\n"
+          "  auto t1 = fn0(g0, t0);\n",
+          "Value fn0(const Value &self, Value *args) {\n"
+          "  Value l0 = std::move(args[0]);\n"
+          "  Value t0[] = {l0};\n"
+          "  auto t1 = fn0(self, t0);\n"
+          "  return t1;\n"
+          "}\n\n",
+      },
+      {
+          "let f = fn(a) { fn() { a } }; f(1)()",
+          "  g0 = f0;\n"
+          "  Value t0[] = {Value::integer(1)};\n"
+          "  auto t1 = fn0(g0, t0);\n"
+          "  auto t2 = aot::call(t1, nullptr, 0);\n",
+          "Value fn1(const Value &self, Value *) {\n"
+          "  const auto &free = aot::free(self);\n"
+          "  return free[0];\n"
+          "}\n\n"
+          "Value fn0(const Value &, Value *args) {\n"
+          "  Value l0 = std::move(args[0]);\n"
+          "  return aot::closure(fn1, 0, {l0});\n"
+          "}\n\n",
+      },
+      {
+          // A function bound in a branch may not be there when it is called.
+          "if (true) { let f = fn() { 1 }; }; f(2)",
+          "  Value t0;\n"
+          "  if (true) {\n"
+          "    g0 = f0;\n"
+          "  }\n"
+          "  Value t1[] = {Value::integer(2)};\n"
+          "  auto t2 = aot::call(g0, t1, 1);\n",
+          "Value fn0(const Value &, Value *) {\n"
+          "  return Value::integer(1);\n"
+          "}\n\n",
+      },
+  };
+
+  run_transpiler_test("[transpiler]", tests);
+}
+
+TEST_CASE("Transpiled string literals", "[transpiler]") {
+  CHECK(Transpiler::string_literal("a\"b?\\") ==
+        "{\"a\\042b\\077\\134\", 5}");
+  CHECK(Transpiler::string_literal(string("1\n\0002", 4)) ==
+        "{\"1\\012\\0002\", 4}");
+}
+
+TEST_CASE("Native calls", "[transpiler]") {
+  auto fn = aot::closure(
+      [](const Value &, Value *args) { return aot::add(args[0], args[1]); },
+      2, {});
+
+  Value args[] = {Value::integer(1), Value::integer(2)};
+  CHECK(aot::call(fn, args, 2).as_integer() == 3);
+
+  try {
+    aot::call(fn, args, 1);
+    FAIL("expected an error");
+  } catch (const shared_ptr<Object> &err) {
+    CHECK(cast<Error>(err).message ==
+          "wrong number of arguments: want=2, got=1");
+  }
+}
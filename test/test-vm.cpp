@@ -2,6 +2,8 @@
 #include "test-util.hpp"
 
 #include <compiler.hpp>
+#include <ir_compiler.hpp>
+#include <reg_vm.hpp>
 #include <vm.hpp>
 
 using namespace std;
@@ -26,7 +28,7 @@ void test_expected_object(shared_ptr<Object> expected,
     const auto &actualElements = cast<Array>(actual).elements;
     REQUIRE(expectedElements.size() == actualElements.size());
     for (size_t i = 0; i < expectedElements.size(); i++) {
-      REQUIRE(expectedElements[i] != actualElements[i]);
+      test_expected_object(expectedElements[i], actualElements[i]);
     }
     break;
   }
@@ -42,18 +44,28 @@ struct VmTestCase {
   shared_ptr<Object> expected;
 };
 
-void run_vm_test(const char *name, const vector<VmTestCase> &tests) {
+void run_vm_test(const char *name, const vector<VmTestCase> &tests,
+                 const CompilerOptions &options,
+                 const VMOptions &vmOptions = VMOptions()) {
   for (const auto &t : tests) {
     auto ast = parse(name, t.input);
     // cerr << peg::ast_to_s(ast) << endl;
     REQUIRE(ast != nullptr);
 
-    Compiler compiler;
-    compiler.compile(ast);
+    Bytecode bytecode;
+    if (options.ssa) {
+      IRCompiler compiler(options);
+      compiler.compile(ast);
+      bytecode = compiler.bytecode();
+    } else {
+      Compiler compiler(options);
+      compiler.compile(ast);
+      bytecode = compiler.bytecode();
+    }
 
     // {
     //   size_t i = 0;
-    //   for (auto constant : compiler.bytecode().constants) {
+    //   for (auto constant : bytecode.constants) {
     //     cerr << fmt::format("CONSTANT {} ({})", i, constant->name())
     //          << std::endl;
     //     if (constant->type() == COMPILED_FUNCTION_OBJ) {
@@ -69,15 +81,68 @@ void run_vm_test(const char *name, const vector<VmTestCase> &tests) {
     //   }
     // }
 
-    VM vm(compiler.bytecode());
+    VM vm(bytecode, vmOptions);
     vm.run();
 
     auto stack_elem = vm.last_popped_stack_elem();
 
     test_expected_object(t.expected, stack_elem);
+
+    // Nothing above the top of the stack is kept alive.
+    CHECK(count_if(vm.stack.begin() + vm.sp, vm.stack.end(),
+                   [](const Value &val) { return val.is_object(); }) == 0);
   }
 }
 
+void run_reg_vm_test(const char *name, const vector<VmTestCase> &tests) {
+  for (const auto &t : tests) {
+    auto ast = parse(name, t.input);
+    REQUIRE(ast != nullptr);
+
+    RegCompiler compiler;
+    compiler.compile(ast);
+
+    RegVM vm(compiler.bytecode());
+    vm.run();
+
+    test_expected_object(t.expected, vm.last_popped_stack_elem());
+  }
+}
+
+// Runs every test on the stack VM, without and with the bytecode
+// optimizations, through the SSA form and with every function compiled to
+// native code on its first call, and on the register VM.
+void run_vm_test(const char *name, const vector<VmTestCase> &tests) {
+  run_vm_test(name, tests, CompilerOptions());
+
+  CompilerOptions optimized;
+  optimized.constantFolding = true;
+  optimized.deadCode = true;
+  optimized.peephole = true;
+  optimized.superinstructions = true;
+  optimized.tailCalls = true;
+  optimized.typeInference = true;
+  optimized.inlining = true;
+  optimized.lambdaLifting = true;
+  optimized.releaseLocals = true;
+  run_vm_test(name, tests, optimized);
+
+  CompilerOptions ssa;
+  ssa.ssa = true;
+  run_vm_test(name, tests, ssa);
+  optimized.ssa = true;
+  run_vm_test(name, tests, optimized);
+
+  VMOptions jit;
+  jit.jit = true;
+  jit.jitThreshold = 0;
+  run_vm_test(name, tests, CompilerOptions(), jit);
+  optimized.ssa = false;
+  run_vm_test(name, tests, optimized, jit);
+
+  run_reg_vm_test(name, tests);
+}
+
 TEST_CASE("Integer arithmetic - vm", "[vm]") {
   vector<VmTestCase> tests{
       {"1", make_integer(1)},
@@ -96,6 +161,17 @@ TEST_CASE("Integer arithmetic - vm", "[vm]") {
       {"-10", make_integer(-10)},
       {"-50 + 100 + -50", make_integer(0)},
       {"(5 + 10 * 2 + 15 / 3) * 2 + -10", make_integer(50)},
+      // Overflow wraps around, in parameters the compiler can't fold.
+      {"let f = fn(a, b) { a + b }; f(9223372036854775807, 1)",
+       make_integer(INT64_MIN)},
+      {"let f = fn(a, b) { a - b }; f(-9223372036854775807, 2)",
+       make_integer(INT64_MAX)},
+      {"let f = fn(a, b) { a * b }; f(4611686018427387904, 2)",
+       make_integer(INT64_MIN)},
+      {"let f = fn(a, b) { a / b }; f(-9223372036854775807 - 1, -1)",
+       make_integer(INT64_MIN)},
+      {"let f = fn(a) { -a }; f(-9223372036854775807 - 1)",
+       make_integer(INT64_MIN)},
   };
 
   run_vm_test("([vm]: Integer arithmetic)", tests);
@@ -146,6 +222,13 @@ TEST_CASE("Conditionals - vm", "[vm]") {
       {"if (1 > 2) { 10 }", CONST_NULL},
       {"if (false) { 10 }", CONST_NULL},
       {"if ((if (false) { 10 })) { 10 } else { 20 }", make_integer(20)},
+      {"let x = 1; if (!x) { 10 } else { 20 }", make_integer(20)},
+      {"let x = false; if (!x) { 10 } else { 20 }", make_integer(10)},
+      // A `let` in a branch that never runs still binds its name.
+      {"let f = fn() { if (false) { let x = 1; }; x }; f()", CONST_NULL},
+      {"let f = fn() { if (true) { 1 } else { let x = 2; }; x }; f()",
+       CONST_NULL},
+      {"if (false) { let x = 1; }; x", CONST_NULL},
   };
 
   run_vm_test("([vm]: Conditionals)", tests);
@@ -347,6 +430,25 @@ TEST_CASE("Calling Functions With Bindings - vm", "[vm]") {
          firstFoobar() + secondFoobar();
        )",
        make_integer(150)},
+      // A local whose `let` didn't run is null, not what an earlier call
+      // left in its slot.
+      {R"(
+         let k = fn(x) { len(x) };
+         k([1, 2]);
+         let g = fn(c) { if (c) { let x = [1]; 5 }; x };
+         g(false);
+         let z = fn(a, b, d) { a + b + d };
+         z(40, 41, 42);
+         g(false);
+       )",
+       CONST_NULL},
+      {R"(
+         let k = fn(x) { len(x) };
+         let g = fn(c) { if (c) { let x = [1]; 5 }; x };
+         k([1, 2]);
+         g(false);
+       )",
+       CONST_NULL},
       {R"(
          let globalSeed = 50;
          let minusOne = fn() {
@@ -581,3 +683,503 @@ TEST_CASE("Recursive Functions - vm", "[vm]") {
 
   run_vm_test("([vm]: Recursive Functions)", tests);
 }
+
+TEST_CASE("Stack Limits - vm", "[vm]") {
+  vector<VmTestCase> tests{
+      {R"(
+         let countDown = fn(x) { if (x == 0) { 0 } else { countDown(x - 1) } };
+         countDown(20000);
+       )",
+       make_integer(0)},
+      {R"(
+         let loop = fn() { 1 + loop() };
+         loop();
+       )",
+       make_error("stack overflow")},
+  };
+
+  run_vm_test("([vm]: Stack Limits)", tests);
+
+  auto run = [](int n) {
+    auto input = "let sum = fn(x) { if (x == 0) { 0 } else { x + sum(x - 1) } };"
+                 "sum(" +
+                 std::to_string(n) + ");";
+    auto ast = parse("([vm]: Stack Limits)", input);
+    REQUIRE(ast != nullptr);
+
+    Compiler compiler;
+    compiler.compile(ast);
+
+    VMOptions options;
+    options.stackSegment = 16;
+    options.maxStackSize = 256;
+    options.frameSegment = 4;
+    options.maxFrames = 32;
+
+    VM vm(compiler.bytecode(), options);
+    vm.run();
+    return vm.last_popped_stack_elem();
+  };
+
+  test_integer_object(55, run(10));
+  test_error_object("stack overflow", run(100));
+}
+
+TEST_CASE("Releasing Values - vm", "[vm]") {
+  // Once a call returns, neither its slots nor its locals keep the array it
+  // was given alive.
+  string input = R"(
+    let f = fn(a) { let n = len(a); let b = [a, a]; if (n > 2) { b } ; n };
+    f
+  )";
+  auto ast = parse("([vm]: Releasing Values)", input);
+  REQUIRE(ast != nullptr);
+
+  for (const auto &options : {CompilerOptions(), CompilerOptions::level(2)}) {
+    Compiler compiler(options);
+    compiler.compile(ast);
+    VM vm(compiler.bytecode());
+    vm.run();
+    auto f = Value::object(vm.last_popped_stack_elem());
+
+    auto array = make_array({1, 2, 3});
+    CHECK(vm.call(f, {Value::object(array)}).as_integer() == 3);
+    CHECK(array.use_count() == 1);
+  }
+}
+
+TEST_CASE("Fresh Locals - vm", "[vm]") {
+  // A local whose `let` didn't run is null, not an integer that an earlier
+  // call left in its slot.
+  vector<VmTestCase> tests{
+      {R"(
+         let g = fn(c) { if (c) { let x = [1]; 5 }; x };
+         let z = fn(a, b, d) { a + b + d };
+         z(40, 41, 42);
+         g(false);
+       )",
+       CONST_NULL},
+  };
+
+  run_vm_test("([vm]: Fresh Locals)", tests, CompilerOptions());
+  run_vm_test("([vm]: Fresh Locals)", tests, CompilerOptions::level(2));
+}
+
+TEST_CASE("Superinstructions - vm", "[vm]") {
+  vector<VmTestCase> tests{
+      {R"(
+         let f = fn(a, b) { if (a > 1) { a + b } else { a - 1 } };
+         f(2, 3) * 10 + f(1, 3);
+       )",
+       make_integer(50)},
+      {R"(
+         let f = fn(a) { if (a == 1) { 10 } else { 20 } };
+         f(1) + f(2);
+       )",
+       make_integer(30)},
+      {R"(
+         let f = fn(a, b) { a + b + "!" };
+         f("a", "b");
+       )",
+       make_string("ab!")},
+      {R"(
+         let f = fn(a) { if (a == 1) { 10 } };
+         f("1");
+       )",
+       make_error("unknown operator: 8 (7 0)")},
+  };
+
+  run_vm_test("([vm]: Superinstructions)", tests);
+}
+
+TEST_CASE("Type Inference - vm", "[vm]") {
+  vector<VmTestCase> tests{
+      {R"(
+         let fib = fn(x) { if (x < 2) { x } else { fib(x - 1) + fib(x - 2) } };
+         fib(15);
+       )",
+       make_integer(610)},
+      {R"(
+         let x = 2; let y = x * 3;
+         y > x == true;
+       )",
+       make_bool(true)},
+      {R"(
+         let f = fn(a) { a - 1 };
+         f("a");
+       )",
+       make_error("unsupported types for binary operation: 7 0")},
+  };
+
+  run_vm_test("([vm]: Type Inference)", tests);
+}
+
+TEST_CASE("Inlining - vm", "[vm]") {
+  vector<VmTestCase> tests{
+      {R"(
+         let double = fn(x) { x * 2 };
+         double(double(3)) + 1;
+       )",
+       make_integer(13)},
+      {R"(
+         let f = fn(x) { let y = x + 1; y * y };
+         let g = fn(x) { f(x) + f(x + 1) };
+         g(2);
+       )",
+       make_integer(25)},
+      {R"(
+         let sq = fn(x) { x * x };
+         let h = fn(a) { let b = sq(a); b + sq(b) };
+         h(3);
+       )",
+       make_integer(90)},
+      {R"(
+         let f = fn(x) { if (x > 1) { x } else { 0 } };
+         f(5) + f(1);
+       )",
+       make_integer(5)},
+      {R"(
+         let g = fn(c) { if (c) { let x = 1; 5 }; x };
+         g(true);
+         g(false);
+       )",
+       CONST_NULL},
+      {R"(
+         let f = fn(x) { x };
+         let g = fn(c) { f(1); if (c) { let y = 5; }; y };
+         g(false);
+       )",
+       CONST_NULL},
+      {R"(
+         let double = fn(x) { x * 2 };
+         let apply = fn(f, x) { f(x) };
+         apply(double, 4);
+       )",
+       make_integer(8)},
+      {R"(
+         let a = 1;
+         let f = fn() { a };
+         let a = 2;
+         f();
+       )",
+       make_integer(1)},
+  };
+
+  run_vm_test("([vm]: Inlining)", tests);
+}
+
+TEST_CASE("Lambda Lifting - vm", "[vm]") {
+  vector<VmTestCase> tests{
+      {R"(
+         let one = fn() { return 1; };
+         one() + one();
+       )",
+       make_integer(2)},
+      {R"(
+         let outer = fn(x) {
+           let inc = fn(y) { return y + 1; };
+           inc(x) + inc(x)
+         };
+         outer(1) + outer(2);
+       )",
+       make_integer(10)},
+      {R"(
+         let countdown = fn(x) { if (x == 0) { return 0; } countdown(x - 1) };
+         let start = fn() { return countdown(3); };
+         start();
+       )",
+       make_integer(0)},
+      {R"(
+         let adder = fn(a) { fn(b) { a + b } };
+         adder(1)(2);
+       )",
+       make_integer(3)},
+      {R"(
+         let f = fn(a) { return a; };
+         f();
+       )",
+       make_error("wrong number of arguments: want=1, got=0")},
+  };
+
+  run_vm_test("([vm]: Lambda Lifting)", tests);
+}
+
+TEST_CASE("Quickening - vm", "[vm]") {
+  struct Test {
+    string input;
+    shared_ptr<Object> expected;
+    Opecode quickened; // the op of the function's first generic instruction
+  };
+
+  vector<Test> tests{
+      {"let f = fn(a, b) { a + b }; f(1, 2); f(3, 4)", make_integer(7),
+       OpAddInt},
+      {"let f = fn(a, b) { a > b }; f(1, 2); f(4, 3)", make_bool(true),
+       OpGreaterThanInt},
+      // A failed guard goes back to the generic form.
+      {R"(let f = fn(a, b) { a + b }; f(1, 2); f("x", "y"))",
+       make_string("xy"), OpAdd},
+      {"let f = fn(a, i) { a[i] }; f([1, 2], 1); f([3, 4], 0)",
+       make_integer(3), OpIndexArrayInt},
+      {R"(let f = fn(h, k) { h[k] }; f({"a": 1}, "a"); f({"b": 2}, "b"))",
+       make_integer(2), OpIndexHashString},
+      {R"(let f = fn(a, i) { a[i] }; f([1, 2], 1); f({"k": 5}, "k"))",
+       make_integer(5), OpIndex},
+  };
+
+  for (const auto &t : tests) {
+    auto ast = parse("([vm]: Quickening)", t.input);
+    REQUIRE(ast != nullptr);
+
+    Compiler compiler;
+    compiler.compile(ast);
+    auto bytecode = compiler.bytecode();
+    VM vm(bytecode);
+    vm.run();
+    test_expected_object(t.expected, vm.last_popped_stack_elem());
+
+    auto it = find_if(bytecode.constants.begin(), bytecode.constants.end(),
+                      [](const shared_ptr<Object> &constant) {
+                        return constant->type() == COMPILED_FUNCTION_OBJ;
+                      });
+    REQUIRE(it != bytecode.constants.end());
+    auto fn = static_pointer_cast<CompiledFunction>(*it);
+    const auto &decoded = vm.function_state(fn).decoded;
+    REQUIRE(decoded.size() > 2);
+    CHECK(decoded[2].op == t.quickened);
+  }
+
+  // Without quickening, instructions keep their generic form, even when
+  // another VM has quickened the same bytecode.
+  string input = "let f = fn(a, b) { a + b }; f(1, 2); f(3, 4)";
+  auto ast = parse("([vm]: Quickening)", input);
+  REQUIRE(ast != nullptr);
+  Compiler compiler;
+  compiler.compile(ast);
+  auto bytecode = compiler.bytecode();
+  auto fn = static_pointer_cast<CompiledFunction>(bytecode.constants[0]);
+  VM quickened(bytecode);
+  quickened.run();
+  CHECK(quickened.function_state(fn).decoded[2].op == OpAddInt);
+  VMOptions options;
+  options.quickening = false;
+  VM vm(bytecode, options);
+  vm.run();
+  test_integer_object(7, vm.last_popped_stack_elem());
+  CHECK(vm.function_state(fn).decoded[2].op == OpAdd);
+
+  // Nor do the integer forms the compiler emits go back to the generic one
+  // when a guard fails.
+  input = R"(let f = fn(a) { a + 1 }; f(1); f("x"))";
+  ast = parse("([vm]: Quickening)", input);
+  REQUIRE(ast != nullptr);
+  CompilerOptions typed;
+  typed.typeInference = true;
+  Compiler typedCompiler(typed);
+  typedCompiler.compile(ast);
+  bytecode = typedCompiler.bytecode();
+  VM typedVm(bytecode, options);
+  typedVm.run();
+  test_expected_object(
+      make_error("unsupported types for binary operation: 7 0"),
+      typedVm.last_popped_stack_elem());
+  auto it = find_if(bytecode.constants.begin(), bytecode.constants.end(),
+                    [](const shared_ptr<Object> &constant) {
+                      return constant->type() == COMPILED_FUNCTION_OBJ;
+                    });
+  REQUIRE(it != bytecode.constants.end());
+  fn = static_pointer_cast<CompiledFunction>(*it);
+  CHECK(typedVm.function_state(fn).decoded[2].op == OpAddInt);
+}
+
+TEST_CASE("Wide Operands - vm", "[vm]") {
+  // More constants, array elements and globals than a 2-byte operand holds,
+  // and branches longer than a 2-byte jump target reaches.
+  string elements = "0";
+  for (auto i = 1; i < 70000; i++) {
+    elements += ", " + to_string(i);
+  }
+  // Identifiers are letters only, so local `i` is named `v` plus two letters.
+  auto local = [](int i) {
+    return string{'v', static_cast<char>('a' + i / 26),
+                  static_cast<char>('a' + i % 26)};
+  };
+  string locals;
+  for (auto i = 0; i < 300; i++) {
+    locals += fmt::format("let {} = {}; ", local(i), i);
+  }
+
+  auto global = [](int i) {
+    return string{'g', static_cast<char>('a' + i / 26 / 26 / 26 % 26),
+                  static_cast<char>('a' + i / 26 / 26 % 26),
+                  static_cast<char>('a' + i / 26 % 26),
+                  static_cast<char>('a' + i % 26)};
+  };
+  string globals;
+  for (auto i = 0; i < 70000; i++) {
+    globals += fmt::format("let {} = {}; ", global(i), i);
+  }
+
+  vector<VmTestCase> tests{
+      {"[" + elements + "][69999]", make_integer(69999)},
+      {"if (true) { [" + elements + "]; 1 } else { 2 }", make_integer(1)},
+      {"if (false) { [" + elements + "]; 1 } else { 2 }", make_integer(2)},
+      {"let f = fn(x) { " + locals + local(299) + " + x }; f(1)", make_integer(300)},
+      {globals + global(69999), make_integer(69999)},
+  };
+
+  run_vm_test("([vm]: Wide Operands)", tests, CompilerOptions());
+  run_vm_test("([vm]: Wide Operands)", tests, CompilerOptions::level(2));
+  run_reg_vm_test("([vm]: Wide Operands)", tests);
+}
+
+TEST_CASE("Tail Calls - vm", "[vm]") {
+  auto run = [](const string &input) {
+    auto ast = parse("([vm]: Tail Calls)", input);
+    REQUIRE(ast != nullptr);
+
+    CompilerOptions compilerOptions;
+    compilerOptions.tailCalls = true;
+    Compiler compiler(compilerOptions);
+    compiler.compile(ast);
+
+    VMOptions options;
+    options.maxStackSize = 64;
+    options.maxFrames = 4;
+
+    VM vm(compiler.bytecode(), options);
+    vm.run();
+    return vm.last_popped_stack_elem();
+  };
+
+  test_integer_object(
+      50005000, run(R"(
+        let sum = fn(x, acc) { if (x == 0) { acc } else { sum(x - 1, acc + x) } };
+        sum(10000, 0);
+      )"));
+
+  test_integer_object(0, run(R"(
+        let apply = fn(f, x) { f(x) };
+        let down = fn(x) { if (x == 0) { 0 } else { apply(down, x - 1) } };
+        down(1000);
+      )"));
+
+  test_integer_object(3, run(R"(
+        let f = fn(arr) { len(arr) };
+        f([1, 2, 3]);
+      )"));
+
+  test_error_object("stack overflow", run(R"(
+        let sum = fn(x) { if (x == 0) { 0 } else { x + sum(x - 1) } };
+        sum(10000);
+      )"));
+}
+
+TEST_CASE("Call Caches - vm", "[vm]") {
+  struct Test {
+    string input;
+    size_t hits;
+    size_t misses;
+  };
+
+  vector<Test> tests{
+      {"let f = fn(x) { x }; f(1); f(2); f(3);", 0, 3},
+      {R"(
+        let count = fn(x) { if (x == 0) { 0 } else { count(x - 1) } };
+        count(10);
+      )",
+       9, 2},
+      // The two `fn() { 2 }` share a compiled function.
+      {R"(
+        let apply = fn(f) { f() };
+        apply(fn() { 1 });
+        apply(fn() { 2 });
+        apply(fn() { 2 });
+      )",
+       1, 5},
+  };
+
+  for (const auto &t : tests) {
+    auto ast = parse("([vm]: Call Caches)", t.input);
+    REQUIRE(ast != nullptr);
+
+    Compiler compiler;
+    compiler.compile(ast);
+    VM vm(compiler.bytecode());
+    vm.run();
+
+    CHECK(vm.callCacheHits == t.hits);
+    CHECK(vm.callCacheMisses == t.misses);
+  }
+
+  string input = R"(
+    let apply = fn(f) { f(1) };
+    apply(fn(x) { x });
+    apply(fn(x, y) { x });
+  )";
+  auto ast = parse("([vm]: Call Caches)", input);
+  REQUIRE(ast != nullptr);
+
+  Compiler compiler;
+  compiler.compile(ast);
+  VM vm(compiler.bytecode());
+  vm.run();
+  test_error_object("wrong number of arguments: want=2, got=1",
+                    vm.last_popped_stack_elem());
+}
+
+#if MONKEY_JIT
+TEST_CASE("JIT - vm", "[vm]") {
+  auto run = [](const string &input, size_t threshold) {
+    auto ast = parse("([vm]: JIT)", input);
+    REQUIRE(ast != nullptr);
+
+    Compiler compiler;
+    compiler.compile(ast);
+    auto bytecode = compiler.bytecode();
+
+    VMOptions options;
+    options.jit = true;
+    options.jitThreshold = threshold;
+    VM vm(bytecode, options);
+    vm.run();
+
+    auto fn = find_if(bytecode.constants.begin(), bytecode.constants.end(),
+                      [](const shared_ptr<Object> &constant) {
+                        return constant->type() == COMPILED_FUNCTION_OBJ;
+                      });
+    REQUIRE(fn != bytecode.constants.end());
+    auto compiled =
+        vm.function_state(static_pointer_cast<CompiledFunction>(*fn))
+            .jitCode != nullptr;
+    return make_pair(vm.last_popped_stack_elem(), compiled);
+  };
+
+  // A function is compiled on the call after `jitThreshold` calls.
+  auto [twice, compiledAfterTwo] =
+      run("let f = fn(x) { x * 2 }; f(1); f(2)", 2);
+  test_integer_object(4, twice);
+  CHECK_FALSE(compiledAfterTwo);
+
+  auto [thrice, compiledAfterThree] =
+      run("let f = fn(x) { x * 2 }; f(1); f(2); f(3)", 2);
+  test_integer_object(6, thrice);
+  CHECK(compiledAfterThree);
+
+  // A failed tag check leaves the instruction to the interpreter.
+  auto [concatenated, compiledConcat] =
+      run(R"(let f = fn(a, b) { a + b }; f(1, 2); f("x", "y"))", 0);
+  test_string_object("xy", concatenated);
+  CHECK(compiledConcat);
+
+  // Objects in locals and in stale stack slots are copied and released
+  // with their reference counts.
+  auto [counted, compiledCount] = run(R"(
+    let f = fn(x) { let a = [x, x]; let b = a; len(b) + x };
+    f(1) + f(2) + f(3)
+  )",
+                                      0);
+  test_integer_object(12, counted);
+  CHECK(compiledCount);
+}
+#endif